@@ -1,8 +1,57 @@
 #pragma once
 
 #include "znbackend.h"
+#include "zndram.h"
+#include "znepoch.h"
+#include "znindex.h"
 #include "glib.h"
+#include <stdalign.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+#define ZN_CACHEMAP_SHARD_BITS 6
+#define ZN_CACHEMAP_SHARDS (1u << ZN_CACHEMAP_SHARD_BITS)
+#define ZN_CACHEMAP_NO_ID UINT32_MAX /**< Marks an empty chunk in `data_map` */
+
+#define ZN_CACHEMAP_WAIT_SLOTS 8                        /**< Wait slots per shard */
+#define ZN_CACHEMAP_WAIT_OVERFLOW ZN_CACHEMAP_WAIT_SLOTS /**< Shared slot once all are taken */
+#define ZN_CACHEMAP_NO_WAIT UINT32_MAX                   /**< Pending entry nobody waits for */
+
+/**
+ * @struct zn_wait_slot
+ *
+ * @brief Where threads wait for a pending entry to be written
+ */
+struct zn_wait_slot {
+    GCond cond;
+    uint32_t waiters; /**< Threads sleeping on `cond` */
+    bool resolved;    /**< The entry was written or failed, the last waiter frees the slot */
+    GBytes *data;     /**< Chunk published by the writer, so waiters don't read it from disk */
+    struct zn_pair location; /**< Where the published chunk was written */
+};
+
+/**
+ * @struct zn_cachemap_shard
+ *
+ * @brief Independently locked part of the Data ID → location map
+ *
+ * The first thread to wait for a pending entry takes a slot from a fixed
+ * pool and stores its index in the entry, so the writer wakes only the
+ * threads waiting for that ID and misses never allocate. When the pool is
+ * used up, waiters share the overflow slot and recheck their entry on every
+ * wakeup.
+ *
+ * Every shard starts on a cache line of its own, so threads working on
+ * neighbouring shards don't bounce each other's lines.
+ */
+struct zn_cachemap_shard {
+    alignas(64) GMutex lock; /**< Serializes writers of the shard, lookups of cached IDs don't take it */
+    struct zn_index index; /**< Data ID → location, for the IDs hashed to this shard. Pending
+                                entries keep the index of their wait slot in `zone`. */
+    struct zn_wait_slot waits[ZN_CACHEMAP_WAIT_SLOTS + 1];
+    uint8_t free_waits[ZN_CACHEMAP_WAIT_SLOTS]; /**< Stack of unused wait slots */
+    uint32_t nr_free_waits;
+};
 
 /**
  * @struct zn_cachemap
@@ -11,16 +60,25 @@
  * Keeps track of two things:
  *  1. Data ID → (Zone ID, chunk pointer)
  *  2. Zone ID → Data ID
+ *
+ * The first map is split into shards by a hash of the data ID, so writers of
+ * different IDs rarely wait for each other, and lookups of cached IDs take no
+ * lock at all. The second map has one lock per
+ * zone. A shard lock may be held while taking a zone lock, never the other
+ * way around.
  */
 struct zn_cachemap {
-    GMutex cache_map_mutex;
-    GHashTable *zone_map;
-    GHashTable **data_map;  /**< Zone ID → GHashTable (chunk -> Data ID) */
-    gint *active_readers;   /**< Non-owning reference to the number of currently active readers per zone. */
+    struct zn_cachemap_shard shards[ZN_CACHEMAP_SHARDS];
+    uint32_t *data_map;     /**< Zone ID, chunk → Data ID, `max_zone_chunks` entries per zone */
+    uint64_t max_zone_chunks; /**< Chunks per zone, the stride of `data_map` */
+    GMutex *zone_locks;     /**< Protects the entries of each zone in `data_map` */
+    struct zn_epoch *epoch; /**< Non-owning reference to the epochs readers enter on a hit */
+    struct zn_dram_tier *dram; /**< Non-owning reference to the DRAM tier, kept consistent with the map */
 };
 
 void
-zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr);
+zn_cachemap_init(struct zn_cachemap *map, const int num_zones, uint64_t max_zone_chunks,
+                 struct zn_epoch *epoch, struct zn_dram_tier *dram);
 
 /**
  * @struct zone_map_result
@@ -28,17 +86,25 @@ zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_read
  * This is a type with two possible values:
  * 1. It contains a zn_pair, which represents the location on disk
      where the data can be found
- * 2. It contains a condition variable, which new threads will wait on
-        as this thread is tasked with writing the data to disk. The
-        thread should signal once it is finished.
+ * 2. It tells the thread that it is tasked with writing the data to disk.
+        Other threads looking for the data wait until the thread calls
+        `zn_cachemap_insert` or `zn_cachemap_fail`.
+ * 3. It contains the location and a copy of the data, handed over by the
+        thread that wrote it while this thread waited.
  */
 struct zone_map_result {
     union {
         struct zn_pair location;
-        GCond *write_finished;
     } value;
+    GBytes *data; /**< Only for RESULT_DATA, the caller releases it with `g_bytes_unref` */
 
-    enum { RESULT_LOC = 0, RESULT_COND = 1 } type;
+    enum {
+        RESULT_LOC = 0,
+        RESULT_COND = 1,
+        RESULT_PENDING = 2, /**< Only from `zn_cachemap_find_batch`, another writer owns the entry */
+        RESULT_DATA = 3,    /**< Like RESULT_LOC, but the data doesn't have to be read from disk */
+        RESULT_FULL = 4     /**< A miss that couldn't be claimed, the index shard of the ID is full */
+    } type;
 };
 
 /** @brief Finds the data in the zone if it exists, otherwise returns additional information for
@@ -48,22 +114,44 @@ struct zone_map_result {
  *  If there doesn't exist the data id on disk, the cache will instead return:
  *  - A condition variable with a message indicating that the thread
  *       needs to write and then signal this later
- *	- When a reader requests to read, we need to increment the active
- *       reader count on behalf of them
+ *	- When a reader requests to read, it enters an epoch on behalf of
+ *       them, the caller leaves it with `zn_epoch_exit` once it is done
  *
  * This function should sleep on a condition variable when it finds it
  *      in the cache (indicating that a thread is currently writing the
  *      data to disk). When it is woken up, it should try again to see
- *      if the data exists in the cache map.
+ *      if the data exists in the cache map. If the writer handed over a
+ *      copy of the data, it is returned as RESULT_DATA.
+ *
+ * A miss whose shard has no room for another entry is returned as
+ * RESULT_FULL, nothing was claimed and the caller fails the request.
  */
 struct zone_map_result
 zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id);
 
+/** @brief Finds a batch of data IDs
+ *  @param data_ids the elements to find
+ *  @param nr number of elements
+ *  @param[out] results one result per element
+ *
+ *  Like `zn_cachemap_find`, hits enter an epoch and misses are
+ *  claimed for the caller to write. Entries that are being written by
+ *  someone else, including an earlier duplicate in the same batch, are
+ *  returned as RESULT_PENDING instead of sleeping. The
+ *  caller resolves those with `zn_cachemap_find` once its own writes are
+ *  done.
+ */
+void
+zn_cachemap_find_batch(struct zn_cachemap *map, const uint32_t *data_ids, uint32_t nr,
+                       struct zone_map_result *results);
+
 /** @brief Inserts a new mapping into the data structure. Called by
  * the thread when it's finished writing to the zone.
  *
  * @param data_id id of the data to be inserted
  * @param location the location on disk where the data lives
+ * @param iov the data, copied for threads waiting for it (may be NULL)
+ * @param iovcnt number of segments of `iov`
  * @return void
  *
  * Implementation notes:
@@ -72,7 +160,19 @@ zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id);
  *     here by signalling when the thread calls this function.
  */
 void
-zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location);
+zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location,
+                   const struct iovec *iov, int iovcnt);
+
+/** @brief Moves an existing mapping to a new location. Called by GC after copying the data.
+ * @param data_id id of the data that moved
+ * @param location the new location on disk
+ * @return void
+ * Implementation notes:
+ *   - Removes the old location from the Zone ID → Data ID map, so clearing the old zone
+ *     afterwards leaves the entry alone
+ */
+void
+zn_cachemap_relocate(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location);
 
 /** @brief Clears all entries of a zone in the mapping. Called by eviction threads.
  * @param zone the zone
@@ -90,9 +190,74 @@ zn_cachemap_clear_chunk(struct zn_cachemap *map, struct zn_pair *location);
  * @return void
  * Implementation notes:
  *   - Additionally clears the Zone ID → Data ID map
+ *   - Takes the zone's IDs in one step, then removes them one shard lock at a
+ *     time, so lookups of other IDs keep going while a zone is cleared
  */
 void
 zn_cachemap_clear_zone(struct zn_cachemap *map, uint32_t zone);
 
+/** @brief Clears all entries of a set of zones in one pass. Called by eviction threads.
+ * @param zones the zones to clear
+ * @param nr_zones number of zones
+ * Implementation notes:
+ *   - Same as `zn_cachemap_clear_zone`, but the IDs of all zones are grouped by
+ *     shard so each shard lock is taken once per set instead of once per chunk
+ */
+void
+zn_cachemap_clear_zones(struct zn_cachemap *map, const uint32_t *zones, uint32_t nr_zones);
+
+/** @brief Maps an ID to a location without claiming it first. Called while a journal is replayed.
+ * @param data_id id of the data
+ * @param location the location on disk where the data lives
+ * @return void
+ * Implementation notes:
+ *   - Moves the ID if it was mapped already, and unmaps any other ID left at `location`
+ */
+void
+zn_cachemap_restore(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location);
+
+/** @brief Maps an ID to a location unless a newer copy was mapped. Called by the zone scan.
+ * @param data_id id of the data
+ * @param location the location on disk where the copy was found
+ * @param generation generation in the header of the copy
+ * @param generations generation of the copy at each location, `max_zone_chunks` per zone
+ * @return true if the copy is now the mapped one
+ * Implementation notes:
+ *   - Of two copies with the same generation the first one found is kept, GC copies
+ *     keep the header so their data is the same
+ */
+bool
+zn_cachemap_restore_newest(struct zn_cachemap *map, const uint32_t data_id,
+                           struct zn_pair location, uint64_t generation, uint64_t *generations);
+
+/** @brief Unmaps an ID if it still lives at a location. Called while a journal is replayed.
+ * @param data_id id of the data
+ * @param location the location it was evicted from
+ * @return void
+ */
+void
+zn_cachemap_forget(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location);
+
+/** @brief Copies the IDs of every chunk of a zone
+ * @param zone the zone
+ * @param[out] ids `max_zone_chunks` IDs, `ZN_CACHEMAP_NO_ID` for empty chunks
+ * @return void
+ */
+void
+zn_cachemap_zone_ids(struct zn_cachemap *map, uint32_t zone, uint32_t *ids);
+
 void
 zn_cachemap_fail(struct zn_cachemap *map, const uint32_t id);
+
+/** @brief Offers a chunk that was just read from flash to the DRAM tier
+ * @param location where the chunk was read from, with its ID
+ * @param iov the chunk contents
+ * @param iovcnt number of segments
+ * @return void
+ * Implementation notes:
+ *   - The chunk is copied outside the lock and only inserted if the map still
+ *     points at `location`, so a chunk evicted in the meantime can't end up in DRAM
+ */
+void
+zn_cachemap_admit(struct zn_cachemap *map, struct zn_pair location, const struct iovec *iov,
+                  int iovcnt);
@@ -45,6 +45,12 @@ typedef void (*update_policy_t)(policy_data_t policy, struct zn_pair location,
 /** A generic eviction function informed by the policy */
 typedef int (*do_evict)(policy_data_t policy);
 
+/** Picks up to `max` zones to evict at once, returns how many were picked */
+typedef uint32_t (*do_evict_zones_t)(policy_data_t policy, uint32_t *zones, uint32_t max);
+
+/** Called exactly once when every chunk of a zone has been written */
+typedef void (*zone_full_t)(policy_data_t policy, uint32_t zone);
+
 /** @struct zn_evict_policy
     @brief generic policy type
  */
@@ -52,8 +58,10 @@ struct zn_evict_policy {
     enum zn_evict_policy_type type; /**< Eviction policy. */
     policy_data_t data;             /**< Opaque data handle */
     update_policy_t update_policy;  /**< Called when policy needs to be updated */
+    zone_full_t zone_full;          /**< Called when a zone has been filled */
     do_evict
         do_evict;  /**< Called when eviction thread needs to evict something */
+    do_evict_zones_t do_evict_zones; /**< Picks a set of victim zones, zone granularity only */
 };
 
 /** @brief Sets up the data structure for the selected eviction policy.
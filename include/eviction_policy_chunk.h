@@ -5,6 +5,7 @@
 #include "glib.h"
 
 #include "cachemap.h"
+#include "znio.h"
 #include "zone_state_manager.h"
 
 #include <stdint.h>
@@ -31,6 +32,13 @@ struct zn_policy_chunk {
     uint32_t total_chunks;   /**< Number of chunks on disk */
 
     unsigned char *chunk_buf; /**< Buffer for use during GC */
+    struct zn_io_req *gc_reqs; /**< Read requests for relocating a zone during GC */
+    uint32_t *gc_index;        /**< Chunk in the old zone read by each of `gc_reqs` */
+    uint32_t *gc_moved;        /**< Chunks in the old zone written by the current GC run */
+    struct iovec *gc_iov;      /**< Chunks written by the current GC run */
+    bool gc_running;           /**< A GC run owns the buffers above, it drops the lock while
+                                    it waits for zones so others must not start one */
+    struct zsm_waiter *gc_waiter; /**< Waiter of the running GC, woken when chunks are evicted */
 };
 
 /** @brief Updates the chunk LRU policy
@@ -39,6 +47,11 @@ void
 zn_policy_chunk_update(policy_data_t policy, struct zn_pair location,
                              enum zn_io_type io_type);
 
+/** @brief Makes a filled zone a candidate for GC
+ */
+void
+zn_policy_chunk_zone_full(policy_data_t policy, uint32_t zone);
+
 /** @brief Gets a chunk to evict.
     @returns the 0 on evict, 1 if no evict.
  */
@@ -22,8 +22,20 @@ void
 zn_policy_promotional_update(policy_data_t policy, struct zn_pair location,
                              enum zn_io_type io_type);
 
+/** @brief Adds a filled zone to the promotional LRU
+ */
+void
+zn_policy_promotional_zone_full(policy_data_t policy, uint32_t zone);
+
 /** @brief Gets a zone to evict.
     @returns the zone to evict, -1 if there are no full zones.
  */
 int
 zn_policy_promotional_get_zone_to_evict(policy_data_t policy);
+
+/** @brief Gets the least recently used zones to evict, taken under one lock.
+    @returns the number of zones written to `zones`, fewer than `max` if there are not enough
+             full zones.
+ */
+uint32_t
+zn_policy_promotional_get_zones_to_evict(policy_data_t policy, uint32_t *zones, uint32_t max);
@@ -23,7 +23,6 @@ struct zn_pair {
     uint32_t zone;         /**< Identifier of the zone where the data is stored. */
     uint32_t chunk_offset; /**< Offset within the zone where the data chunk is located. */
     uint32_t id;           /**< Unique ID */
-    bool in_use;           /**< Defines if ze_pair is in use. */
 };
 
 #endif //ZNBACKEND_H
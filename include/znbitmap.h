@@ -0,0 +1,77 @@
+#ifndef ZN_BITMAP_H
+#define ZN_BITMAP_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ZN_BITMAP_WORD_BITS 32
+
+/**
+ * @struct zn_bitmap
+ * @brief Fixed size set of bits, one per chunk of a zone.
+ *
+ * Bits are set and cleared with atomic operations on their word, so writers
+ * of different bits don't need a common lock and counts can be read without
+ * one. Counts and scans go a word at a time.
+ */
+struct zn_bitmap {
+    guint *words;
+    uint32_t nr_bits;
+};
+
+/**
+ * @brief Allocates a bitmap with every bit clear
+ */
+void
+zn_bitmap_init(struct zn_bitmap *bitmap, uint32_t nr_bits);
+
+/**
+ * @brief Frees the words of a bitmap
+ */
+void
+zn_bitmap_destroy(struct zn_bitmap *bitmap);
+
+/**
+ * @brief Sets a bit
+ *
+ * @return true if the bit was clear before
+ */
+bool
+zn_bitmap_set(struct zn_bitmap *bitmap, uint32_t bit);
+
+/**
+ * @brief Clears a bit
+ *
+ * @return true if the bit was set before
+ */
+bool
+zn_bitmap_clear(struct zn_bitmap *bitmap, uint32_t bit);
+
+/**
+ * @brief Checks if a bit is set
+ */
+bool
+zn_bitmap_test(const struct zn_bitmap *bitmap, uint32_t bit);
+
+/**
+ * @brief Clears every bit, concurrent writers must be done with the bitmap
+ */
+void
+zn_bitmap_clear_all(struct zn_bitmap *bitmap);
+
+/**
+ * @brief Number of set bits
+ */
+uint32_t
+zn_bitmap_count(const struct zn_bitmap *bitmap);
+
+/**
+ * @brief Finds the first set bit at or after `from`
+ *
+ * @return Index of the bit, `nr_bits` if there is none
+ */
+uint32_t
+zn_bitmap_next_set(const struct zn_bitmap *bitmap, uint32_t from);
+
+#endif // ZN_BITMAP_H
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZN_BUFFER_ALIGN 4096                 /**< Satisfies O_DIRECT on 512e and 4Kn devices */
+#define ZN_BUFFER_HUGE_PAGE_SZ (2 * 1024 * 1024)
+#define ZN_BUFFERS_PER_THREAD 2 /**< One for the caller to hold, one for the next request */
+
+/**
+ * @struct zn_buffer_pool
+ * @brief Preallocated pool of aligned chunk buffers
+ *
+ * All buffers are carved out of one region, allocated up front (on huge pages
+ * with `ZN_HUGE_PAGES`), so the data path never calls the allocator and every
+ * buffer can be used with O_DIRECT. When the pool runs dry a buffer is
+ * allocated on the spot instead of blocking, and freed once it is returned.
+ */
+struct zn_buffer_pool {
+    GAsyncQueue *free_buffers; /**< Buffers not checked out */
+    unsigned char *region;     /**< Backing memory of all pooled buffers */
+    size_t region_sz;          /**< Size of the region in bytes */
+    size_t buffer_sz;          /**< Size of a single buffer */
+    uint32_t nr_buffers;       /**< Buffers in the pool */
+    bool huge_pages;           /**< The region was mapped on huge pages */
+};
+
+/**
+ * @brief Allocates the pool
+ *
+ * @param pool Pool to initialize
+ * @param buffer_sz Size of each buffer, rounded up to `ZN_BUFFER_ALIGN`
+ * @param nr_buffers Number of buffers
+ */
+void
+zn_buffer_pool_init(struct zn_buffer_pool *pool, size_t buffer_sz, uint32_t nr_buffers);
+
+/**
+ * @brief Frees the pool, all buffers must have been returned
+ */
+void
+zn_buffer_pool_destroy(struct zn_buffer_pool *pool);
+
+/**
+ * @brief Checks out a buffer
+ *
+ * @return Buffer of at least `buffer_sz` bytes aligned to `ZN_BUFFER_ALIGN`
+ */
+unsigned char *
+zn_buffer_pool_get(struct zn_buffer_pool *pool);
+
+/**
+ * @brief Returns a buffer taken with `zn_buffer_pool_get`
+ */
+void
+zn_buffer_pool_put(struct zn_buffer_pool *pool, unsigned char *buffer);
+
+/**
+ * @brief Allocates memory aligned for O_DIRECT outside of any pool
+ *
+ * @param size Size in bytes
+ * @return Memory to be released with `free`
+ */
+unsigned char *
+zn_buffer_alloc_aligned(size_t size);
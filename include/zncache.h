@@ -10,15 +10,23 @@
 #include "zone_state_manager.h"
 #include "eviction_policy.h"
 #include "znbackend.h"
+#include "znbuffer.h"
+#include "znio.h"
 #include "znprofiler.h"
+#include "znstage.h"
+#include "zninflight.h"
+#include "znjournal.h"
 
 #define MICROSECS_PER_SECOND 1000000
 // #define EVICT_SLEEP_US ((long) (EVICT_SLEEP_SECS * MICROSECS_PER_SECOND)) // Compile-time
 // #define ZE_READ_SLEEP_US ((long) (0.25 * MICROSECS_PER_SECOND)) // Compile-time
 
-#define WRITE_GRANULARITY 4096
 #define MAX_OPEN_ZONES 14
 
+#define ZN_SCAN_READ_BYTES (4u << 20) /**< Size of each sequential read of a zone scan */
+#define ZN_SCAN_HEADER_READ_MIN (16u * ZN_BUFFER_ALIGN) /**< From this chunk size on, a zone
+                                                             scan only reads chunk headers */
+
 /**
  * @struct zn_reader
  * @brief Manages concurrent read operations within the cache.
@@ -34,6 +42,38 @@ struct zn_reader {
     uint64_t thresh_perc; /**< The next percentage to report numbers at */
 };
 
+/**
+ * @struct zn_write_req
+ * @brief A miss waiting in the write coalescer
+ */
+struct zn_write_req {
+    uint32_t id;
+    uint64_t generation;     /**< Generation in the chunk's header */
+    const struct iovec *iov; /**< The fetched chunk */
+    int iovcnt;
+    int ret;   /**< Result of the write, set by the leader */
+    bool done; /**< The leader has finished with this request */
+};
+
+/**
+ * @struct zn_write_coalescer
+ * @brief Packs concurrent misses into one sequential zone write
+ *
+ * The first miss to arrive becomes the leader. It waits up to `window_us` for
+ * misses that are still fetching their data to join, or until `max_chunks`
+ * are pending, then writes all of them to consecutive chunks with a single
+ * I/O. The other misses sleep until the leader has published their chunk.
+ */
+struct zn_write_coalescer {
+    GMutex lock;
+    GCond cond;          /**< Wakes the leader on new requests, and waiters on completion */
+    GPtrArray *pending;  /**< Requests for the next batch */
+    bool leading;        /**< A leader is collecting `pending` */
+    uint32_t fetching;   /**< Misses still fetching their data, they may join the batch */
+    uint32_t max_chunks; /**< Write as soon as this many chunks are pending, 1 disables */
+    gint64 window_us;    /**< Longest a leader waits for more requests */
+};
+
 struct zn_cache_hitratio {
     GMutex lock;
     uint64_t hits;
@@ -57,12 +97,23 @@ struct zn_cache {
     size_t chunk_sz;              /**< Size of each chunk in bytes. */
     uint64_t zone_cap;            /**< Maximum storage capacity per zone in bytes. */
     uint64_t zone_size;           /**< Storage size per zone in bytes. */
+    bool zone_append;             /**< Chunks are written with zone append, zones are shared */
+    bool shared_zones;            /**< Several writers fill each active zone at the same time */
 
+    struct zn_io io; /**< I/O engine used for all chunk reads and writes */
+    struct zn_buffer_pool buffers; /**< Chunk buffers handed out by gets */
+    GThreadPool *miss_pool;        /**< Fetches the misses of `zn_cache_mget` in parallel */
+    struct zn_write_coalescer coalescer; /**< Batches concurrent misses into one write */
+    struct zn_dram_tier dram;            /**< Hot chunks kept in DRAM in front of flash */
+    struct zn_inflight inflight;         /**< Flash reads of hits shared by concurrent readers */
+    struct zn_stage *stages;             /**< DRAM staging buffer of each zone */
+    uint32_t stage_chunks;               /**< Chunks per staging buffer, 0 if staging is off */
     struct zn_cachemap cache_map;
     struct zn_evict_policy eviction_policy;
     struct zone_state_manager zone_state;
     struct zn_reader reader; /**< Reader structure for tracking workload location. */
-    gint *active_readers;    /**< Owning reference of the list of active readers per zone */
+    struct zn_epoch epoch;   /**< Epochs of the readers, zones are reset once none can use them */
+    struct zn_journal journal; /**< Log of the cache map for warm restarts, off unless opened */
 
     struct zn_cache_hitratio ratio;
 
@@ -77,6 +128,37 @@ struct zn_cache {
 void
 zn_fg_evict(struct zn_cache *cache);
 
+/**
+ * @brief Removes a zone from the cache map and resets it once no reader can use it anymore
+ *
+ * The zone must not hold any valid chunks. It stays full until it is reset,
+ * which may happen in a later call of `zn_cache_reclaim_zones`. Writers that
+ * find no zone wait for it in the meantime, the last reader resets it.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param zone Zone to reset
+ */
+void
+zn_cache_retire_zone(struct zn_cache *cache, uint32_t zone);
+
+/**
+ * @brief Same as `zn_cache_retire_zone` for a set of zones, cleared and retired together
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param zones Zones to reset
+ * @param nr_zones Number of zones
+ */
+void
+zn_cache_retire_zones(struct zn_cache *cache, const uint32_t *zones, uint32_t nr_zones);
+
+/**
+ * @brief Resets the retired zones that no reader can use anymore
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ */
+void
+zn_cache_reclaim_zones(struct zn_cache *cache);
+
 /**
  * @brief Get data from cache
  *
@@ -85,11 +167,115 @@ zn_fg_evict(struct zn_cache *cache);
  * @param cache Pointer to the `zn_cache` structure.
  * @param id Cache item ID to get
  * @param random_buffer Buffer used for read simulation
- * @returns Buffer of data recieved or NULL on error (callee is responsible for freeing)
+ * @returns Buffer of data recieved or NULL on error (release with `zn_cache_release`)
  */
 unsigned char *
 zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_buffer);
 
+/**
+ * @brief Get data from cache into a caller supplied buffer
+ *
+ * Like `zn_cache_get`, but hits are read straight into `iov` and misses are
+ * fetched into `iov` and written to flash from it, so no buffer is allocated
+ * or copied. With `DIRECT_IO` every segment must be aligned to
+ * `ZN_BUFFER_ALIGN`.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param id Cache item ID to get
+ * @param iov Segments to fill, must add up to exactly `chunk_sz` bytes
+ * @param iovcnt Number of segments
+ * @param random_buffer Buffer used for read simulation
+ * @returns Non-zero on error
+ */
+int
+zn_cache_get_into(struct zn_cache *cache, const uint32_t id, const struct iovec *iov, int iovcnt,
+                  unsigned char *random_buffer);
+
+/**
+ * @brief Get a batch of items from the cache
+ *
+ * The whole batch is looked up in the cache map at once. Hits are read in
+ * zone and chunk order with neighbouring chunks merged into one read, while
+ * misses are fetched and written in parallel on the miss pool.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param ids Cache item IDs to get
+ * @param nr Number of items
+ * @param bufs One buffer of `chunk_sz` bytes per item
+ * @param random_buffer Buffer used for read simulation
+ * @returns Non-zero if any item couldn't be read
+ */
+int
+zn_cache_mget(struct zn_cache *cache, const uint32_t *ids, uint32_t nr, const struct iovec *bufs,
+              unsigned char *random_buffer);
+
+/**
+ * @brief Receives consecutive segments of a streaming get
+ *
+ * @param data Bytes of the chunk, only valid until the callback returns
+ * @param offset Offset of `data` within the chunk
+ * @param len Number of bytes in `data`
+ * @param user_data Pointer passed to `zn_cache_get_stream`
+ * @returns Non-zero to stop streaming
+ */
+typedef int (*zn_cache_stream_fn)(const unsigned char *data, size_t offset, size_t len,
+                                  void *user_data);
+
+/**
+ * @brief Stream a byte range of an item through a segment buffer
+ *
+ * `fn` is called with successive segments of at most `segment_sz` bytes as
+ * soon as each one is available, so the first bytes arrive before the rest of
+ * the chunk is read and memory use does not grow with the chunk size. A miss
+ * writes the whole chunk to flash a segment at a time, holding its zone until
+ * the last segment is written, so `fn` should not block for long. With
+ * `DIRECT_IO`, `segment` must be aligned to `ZN_BUFFER_ALIGN` and
+ * `segment_sz` a multiple of it, `offset` and `len` can be anything.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param id Cache item ID to get
+ * @param offset Byte offset into the chunk to start at
+ * @param len Number of bytes to stream
+ * @param segment Buffer of `segment_sz` bytes the segments are read into
+ * @param segment_sz Size of `segment`
+ * @param fn Callback receiving the segments
+ * @param user_data Passed to `fn`
+ * @param random_buffer Buffer used for read simulation
+ * @returns Non-zero on error or if `fn` stopped the stream
+ */
+int
+zn_cache_get_stream(struct zn_cache *cache, const uint32_t id, size_t offset, size_t len,
+                    unsigned char *segment, size_t segment_sz, zn_cache_stream_fn fn,
+                    void *user_data, unsigned char *random_buffer);
+
+/**
+ * @brief Get a byte range of an item into a caller supplied buffer
+ *
+ * Hits read only the requested range. Misses cache the whole chunk, streaming
+ * it through a buffer of at most one device write. Any range and buffer can
+ * be used with `DIRECT_IO`.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param id Cache item ID to get
+ * @param offset Byte offset into the chunk to start at
+ * @param iov Segments to fill, must not reach past the end of the chunk
+ * @param iovcnt Number of segments
+ * @param random_buffer Buffer used for read simulation
+ * @returns Non-zero on error
+ */
+int
+zn_cache_get_range(struct zn_cache *cache, const uint32_t id, size_t offset,
+                   const struct iovec *iov, int iovcnt, unsigned char *random_buffer);
+
+/**
+ * @brief Return a buffer from `zn_cache_get` to the buffer pool
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param data Buffer to release
+ */
+void
+zn_cache_release(struct zn_cache *cache, unsigned char *data);
+
 /**
  * @brief Initializes a `zn_cache` structure with the given parameters.
  *
@@ -102,11 +288,12 @@ zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_bu
  * @param chunk_sz The size of each chunk in bytes.
  * @param zone_cap The maximum capacity per zone in bytes.
  * @param fd File descriptor associated with the disk
+ * @param nr_threads Number of threads getting from the cache, sizes the buffer pool
  * @param eviction_policy Eviction policy used
  */
 void
 zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, uint64_t zone_cap,
-              int fd, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
+              int fd, uint32_t nr_threads, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
               uint64_t workload_max, char *metrics_file);
 
 /**
@@ -125,48 +312,129 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
 void
 zn_destroy_cache(struct zn_cache *cache);
 
+/**
+ * @brief Journals the cache map to a file, replaying it first on a warm restart
+ *
+ * A replay rebuilds the cache map, the zone state manager and the eviction
+ * policy from the journal, without reading any chunk from the device. The
+ * journal is then compacted, and every later insert and eviction is appended
+ * to it. Must be called after `zn_init_cache`, before the cache is used.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param path Journal file
+ * @param warm Replay the journal, it must match the device (see `zn_journal_matches`).
+ *             Otherwise a new journal is started from the cache map, which is empty
+ *             unless it was rebuilt by `zn_cache_scan`.
+ * @return Non-zero if the journal couldn't be replayed or written
+ */
+int
+zn_cache_open_journal(struct zn_cache *cache, const char *path, bool warm);
+
+/**
+ * Rebuild the cache from the chunk headers on the device, used when no journal can be replayed
+ *
+ * Every zone is read up to its write pointer, `ZN_SCAN_ZONES` zones at a
+ * time. Each chunk with a valid header is mapped to its ID, of several copies
+ * of an ID the one with the highest generation wins. The zone state manager
+ * and eviction policy are then restored as after a journal replay. Must be
+ * called after `zn_init_cache`, before `zn_cache_open_journal` and before the
+ * cache is used.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @return Non-zero if the device couldn't be read
+ */
+int
+zn_cache_scan(struct zn_cache *cache);
+
 /**
  * @brief Read a chunk from disk
  *
  * @param cache Pointer to the `zn_cache` structure
  * @param zone_pair Chunk, zone pair
- * @return Buffer read from disk, to be freed by caller
+ * @param iov Segments to read the chunk into
+ * @param iovcnt Number of segments
+ * @return Non-zero on error
  */
-unsigned char *
-zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair);
+int
+zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair, const struct iovec *iov,
+                  int iovcnt);
 
 /**
- * @brief Write buffer to disk
+ * @brief Read part of a chunk from disk
  *
- * @param to_write Total size of write
- * @param buffer   Buffer to write to disk
- * @param fd       Disk file descriptor
- * @param write_size Granularity for each write
+ * With `DIRECT_IO`, ranges or segments that aren't aligned to
+ * `ZN_BUFFER_ALIGN` are read whole blocks at a time into a pooled buffer and
+ * copied out.
+ *
+ * @param cache Pointer to the `zn_cache` structure
+ * @param zone_pair Chunk, zone pair
+ * @param offset Byte offset into the chunk to start reading at
+ * @param iov Segments to read into, must not reach past the end of the chunk
+ * @param iovcnt Number of segments
+ * @return Non-zero on error
+ */
+int
+zn_read_range_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair, size_t offset,
+                        const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Write buffer to disk and make it durable
+ *
+ * The buffer is split into the largest writes the device accepts, which are
+ * submitted through the I/O engine as one ordered chain so the zone's write
+ * pointer only ever moves forward. A single flush, shared with any other
+ * writers flushing at the same time, follows the chain.
+ *
+ * @param io       I/O engine of the disk
+ * @param iov      Segments to write to disk
+ * @param iovcnt   Number of segments
+ * @param wp_start Offset to start writing at
  * @return int     Non-zero on error
+ */
+int
+zn_write_out(struct zn_io *io, const struct iovec *iov, int iovcnt, unsigned long long wp_start);
+
+/**
+ * @brief Write a chunk to a location handed out by the zone state manager
+ *
+ * `iov` can hold several chunks for consecutive locations, as handed out by
+ * `zsm_get_active_zone_batch`. In zone append mode it holds a single chunk,
+ * the device decides where in the zone it lands and `location->chunk_offset`
+ * is updated to match.
  *
- * @note Be careful write size is not too large otherwise you can get errors
+ * @param cache Pointer to the `zn_cache` structure
+ * @param location Location of the first chunk
+ * @param iov Chunks to write
+ * @param iovcnt Number of segments in `iov`
+ * @return Non-zero on error
  */
 int
-zn_write_out(int fd, size_t to_write, const unsigned char *buffer, ssize_t write_size,
-             unsigned long long wp_start);
+zn_cache_write_chunk(struct zn_cache *cache, struct zn_pair *location, const struct iovec *iov,
+                     int iovcnt);
 
 /**
- * Allocate a buffer prefixed by `zone_id`, with the rest being `RANDOM_DATA`
- * Simulates remote read with ZE_READ_SLEEP_US
+ * Fill a buffer with a chunk header for `id`, followed by the rest of `buffer`
+ * Simulates remote read with ZE_READ_SLEEP_US. Copying the payload out of `buffer`
+ * stands in for the transfer from the remote source, so it is done once, straight
+ * into `iov`, which is then written to flash as is.
  *
  * @param cache Pointer to the `zn_cache` structure.
- * @param zone_id ID to write to first 4 bytes
- * @return Allocated buffer or NULL, caller is responsible for free
+ * @param id ID to write to the header
+ * @param iov Segments to fill, `chunk_sz` bytes in total
+ * @param iovcnt Number of segments
+ * @param buffer Data the rest of the chunk is copied from
+ * @return Generation written to the header
  */
-unsigned char *
-zn_gen_write_buffer(struct zn_cache *cache, uint32_t zone_id, unsigned char *buffer);
+uint64_t
+zn_gen_write_data(struct zn_cache *cache, uint32_t id, const struct iovec *iov, int iovcnt,
+                  unsigned char *buffer);
 
 /**
  * Validate contents of cache read
  *
  * @param cache Pointer to the `zn_cache` structure.
  * @param data Data to validate against RANDOM_DATA
- * @param id Identifier that should be in first 4 bytes
+ * @param id Identifier that should be in the chunk header
  * @return Non-zero on error
  */
 int
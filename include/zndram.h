@@ -0,0 +1,148 @@
+#pragma once
+
+#include "znbackend.h"
+#include "znepoch.h"
+
+#include <glib.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * @struct zn_dram_entry
+ * @brief A chunk held in the DRAM tier
+ */
+struct zn_dram_entry {
+    uint32_t id;
+    struct zn_pair location; /**< Where the chunk lives on flash, kept current by the cache map */
+    GBytes *data;            /**< Chunk contents, readers copy from their own reference */
+    GList link;              /**< Position in the LRU queue */
+};
+
+#define ZN_DRAM_SHARD_BITS 6
+#define ZN_DRAM_SHARDS (1u << ZN_DRAM_SHARD_BITS)
+
+/**
+ * @struct zn_dram_shard
+ * @brief Independently locked part of the DRAM tier, on cache lines of its own
+ *
+ * Each shard has its own share of the capacity and its own LRU order, so a
+ * get only takes the lock of the shard its ID hashes to.
+ */
+struct zn_dram_shard {
+    alignas(64) GMutex lock;
+    GHashTable *entries;  /**< Data ID → zn_dram_entry */
+    GQueue lru;           /**< Resident entries, most recently used at the head */
+    GHashTable *seen;     /**< Data IDs read once from flash, candidates for admission */
+    GQueue seen_order;    /**< Data IDs in `seen`, oldest at the tail */
+    uint64_t used;        /**< Bytes currently held */
+    uint64_t hits;        /**< Gets served from this shard */
+    uint64_t lookups;     /**< Gets that consulted this shard */
+};
+
+/**
+ * @struct zn_dram_tier
+ * @brief Bounded DRAM copy of the hottest chunks, consulted before the cache map.
+ *
+ * A chunk is admitted when it is read from flash for the second time while
+ * its ID is still remembered from the first read, so chunks that are only
+ * read once never displace hot ones. Admitted chunks are evicted in LRU
+ * order once their shard used its share of `capacity`.
+ *
+ * Every entry is a copy of a chunk that is also on flash. The cache map
+ * invalidates entries under its own lock whenever a chunk leaves flash, so
+ * the tier never holds data the cache no longer has.
+ */
+struct zn_dram_tier {
+    struct zn_dram_shard shards[ZN_DRAM_SHARDS];
+    uint32_t nr_shards;     /**< Shards in use, fewer if the tier holds fewer chunks than that */
+    uint32_t max_seen;      /**< Most IDs remembered for admission, per shard */
+    uint64_t capacity;      /**< Bytes the tier may hold, 0 disables it */
+    uint64_t shard_capacity; /**< Bytes each shard may hold */
+    struct zn_epoch *epoch; /**< Non-owning reference to the epochs readers enter on a hit */
+};
+
+/**
+ * @brief Sets up the DRAM tier
+ *
+ * @param tier Tier to initialize
+ * @param capacity Bytes the tier may hold, 0 disables it
+ * @param chunk_sz Size of each chunk in bytes
+ * @param epoch Epochs readers enter on a hit, shared with the cache map
+ */
+void
+zn_dram_init(struct zn_dram_tier *tier, uint64_t capacity, size_t chunk_sz,
+             struct zn_epoch *epoch);
+
+/**
+ * @brief Frees every entry of the tier
+ */
+void
+zn_dram_destroy(struct zn_dram_tier *tier);
+
+/**
+ * @brief Checks if the tier holds any chunks
+ */
+bool
+zn_dram_enabled(struct zn_dram_tier *tier);
+
+/**
+ * @brief Looks up a chunk in the tier
+ *
+ * On a hit the caller enters an epoch, like `zn_cachemap_find` does, so the
+ * zone is not reset while the caller still uses the location.
+ *
+ * @param tier DRAM tier
+ * @param id Data ID to look up
+ * @param[out] location Location of the chunk on flash
+ * @return Reference to the chunk contents (release with `g_bytes_unref`), NULL on a miss
+ */
+GBytes *
+zn_dram_get(struct zn_dram_tier *tier, uint32_t id, struct zn_pair *location);
+
+/**
+ * @brief Records a flash read of a chunk
+ *
+ * @param tier DRAM tier
+ * @param id Data ID that was read
+ * @return true if this is the second read and the chunk should be inserted
+ */
+bool
+zn_dram_should_admit(struct zn_dram_tier *tier, uint32_t id);
+
+/**
+ * @brief Inserts a chunk, evicting the least recently used ones to make room
+ *
+ * The caller must hold the cache map lock of the ID and have checked that
+ * `location` is still the chunk's location, so a chunk that is concurrently
+ * evicted from flash is never inserted.
+ *
+ * @param tier DRAM tier
+ * @param location Location of the chunk on flash, with its ID
+ * @param data Chunk contents, the tier takes the reference
+ */
+void
+zn_dram_insert_locked(struct zn_dram_tier *tier, struct zn_pair location, GBytes *data);
+
+/**
+ * @brief Follows a chunk that GC moved to another location
+ *
+ * Called with the cache map lock of the ID held.
+ */
+void
+zn_dram_relocate_locked(struct zn_dram_tier *tier, uint32_t id, struct zn_pair location);
+
+/**
+ * @brief Drops a chunk from the tier
+ *
+ * Called with the cache map lock of the ID held.
+ */
+void
+zn_dram_invalidate_locked(struct zn_dram_tier *tier, uint32_t id);
+
+/**
+ * @brief Fraction of lookups served from DRAM
+ */
+double
+zn_dram_hit_ratio(struct zn_dram_tier *tier);
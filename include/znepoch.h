@@ -0,0 +1,106 @@
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @struct zn_epoch_slot
+ * @brief Epoch of one thread, alone on its cache line so readers never share one
+ */
+struct zn_epoch_slot {
+    gint epoch;    /**< Epoch the thread entered with the low bit set, 0 while it is outside */
+    uint32_t nest; /**< Nested enters, only touched by the thread itself or under `shared_lock` */
+    char pad[56];
+};
+
+/**
+ * @struct zn_epoch_retired
+ * @brief A zone waiting for the readers that may still use it
+ */
+struct zn_epoch_retired {
+    uint32_t zone;
+    gint epoch; /**< Readers that entered at this epoch or later can't see the zone */
+};
+
+/**
+ * @struct zn_epoch
+ * @brief Epoch based reclamation of zones.
+ *
+ * Readers enter an epoch before they look up a location and leave it once
+ * they are done reading it, which only writes the reader's own slot. A zone
+ * that was cleared from the cache map is retired instead of being waited
+ * for. It is reset by `zn_epoch_reclaim` once every thread that was reading
+ * when it was retired has left its epoch, nobody spins on a shared counter.
+ *
+ * Up to `ZN_MAX_THREADS - 1` threads get a slot of their own. Any threads
+ * beyond that share the slot of `ZN_THREAD_SHARED`: their enters and exits
+ * take `shared_lock`, and the slot only leaves its epoch once all of them
+ * have left, so they can hold off reclamation longer.
+ */
+struct zn_epoch {
+    gint global;                 /**< Current epoch, always even */
+    struct zn_epoch_slot *slots; /**< One per thread index, see `zn_thread_index` */
+    GMutex lock;                 /**< Protects `retired` */
+    GMutex shared_lock;          /**< Serializes the threads sharing `ZN_THREAD_SHARED` */
+    GQueue retired;              /**< zn_epoch_retired, oldest at the head */
+};
+
+/**
+ * @brief Sets up the epochs, no zone is retired
+ */
+void
+zn_epoch_init(struct zn_epoch *epoch);
+
+/**
+ * @brief Frees the epochs, retired zones are forgotten
+ */
+void
+zn_epoch_destroy(struct zn_epoch *epoch);
+
+/**
+ * @brief Enters the current epoch, locations looked up afterwards stay readable until the exit
+ *
+ * Calls nest, only the outermost enter and exit change the thread's epoch.
+ */
+void
+zn_epoch_enter(struct zn_epoch *epoch);
+
+/**
+ * @brief Leaves the epoch entered by the matching `zn_epoch_enter`
+ */
+void
+zn_epoch_exit(struct zn_epoch *epoch);
+
+/**
+ * @brief Retires a zone that was just cleared from the cache map
+ *
+ * Readers that enter an epoch from now on can't find the zone anymore.
+ */
+void
+zn_epoch_retire(struct zn_epoch *epoch, uint32_t zone);
+
+/**
+ * @brief Retires a set of zones that were just cleared from the cache map, with one epoch bump
+ */
+void
+zn_epoch_retire_zones(struct zn_epoch *epoch, const uint32_t *zones, uint32_t nr_zones);
+
+/**
+ * @brief Number of retired zones that were not reclaimed yet
+ */
+uint32_t
+zn_epoch_nr_retired(struct zn_epoch *epoch);
+
+/**
+ * @brief Calls `reset` with every retired zone no reader can use anymore
+ *
+ * @param epoch Epochs
+ * @param reset Called without locks held, once with all the reclaimed zones
+ * @param user_data Passed to `reset`
+ * @return Number of zones reclaimed
+ */
+uint32_t
+zn_epoch_reclaim(struct zn_epoch *epoch,
+                 void (*reset)(const uint32_t *zones, uint32_t nr_zones, void *user_data),
+                 void *user_data);
@@ -0,0 +1,123 @@
+#ifndef ZN_INDEX_H
+#define ZN_INDEX_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @enum zn_index_state
+ * @brief State of a slot of the index
+ */
+enum zn_index_state {
+    ZN_INDEX_EMPTY = 0,   /**< Slot is free */
+    ZN_INDEX_PENDING = 1, /**< A thread is writing the chunk, it has no location yet */
+    ZN_INDEX_LOC = 2,     /**< The chunk is on disk at `zone`, `chunk_offset` */
+};
+
+#define ZN_INDEX_STATE_BITS 2
+#define ZN_INDEX_STATE_MASK ((1u << ZN_INDEX_STATE_BITS) - 1)
+
+/**
+ * @struct zn_index_entry
+ * @brief A 16 byte slot, four of them share a cache line.
+ *
+ * `meta` holds the state in its low bits and a version above them. Writers
+ * bump the version to odd before changing a slot and to even afterwards, so a
+ * reader that saw the same even version before and after copying the slot
+ * has a consistent copy.
+ */
+struct zn_index_entry {
+    uint32_t id;
+    uint32_t zone;
+    uint32_t chunk_offset;
+    uint32_t meta;
+};
+
+/**
+ * @struct zn_index
+ * @brief Open addressing Data ID → location table with lock-free lookups.
+ *
+ * Slots are preallocated for the largest number of chunks the cache can hold
+ * and collisions are resolved with linear probing, so inserts never allocate
+ * and lookups usually touch a single cache line. Removal shifts the following
+ * entries of the probe sequence back instead of leaving tombstones.
+ *
+ * Writers must be serialized by the caller. Lookups take no lock, they retry
+ * if a slot changed while it was read or if a removal moved entries
+ * (`shift_seq` is odd while it does).
+ */
+struct zn_index {
+    struct zn_index_entry *slots;
+    uint64_t mask;     /**< Number of slots minus one, the number of slots is a power of two */
+    uint64_t count;    /**< Occupied slots */
+    gint shift_seq;    /**< Odd while a removal moves entries */
+};
+
+/**
+ * @brief Allocates the slots of an index
+ *
+ * @param index Index to initialize
+ * @param capacity Most entries the index will hold, at least twice as many slots are allocated
+ */
+void
+zn_index_init(struct zn_index *index, uint64_t capacity);
+
+/**
+ * @brief Frees the slots of an index
+ */
+void
+zn_index_destroy(struct zn_index *index);
+
+/**
+ * @brief Looks up a Data ID without taking a lock
+ *
+ * @param index Index
+ * @param id Data ID to find
+ * @param[out] entry Consistent copy of the entry, `meta` identifies the version that was read
+ * @param[out] slot Slot the entry was found in
+ * @return true if the ID is in the index
+ */
+bool
+zn_index_lookup(struct zn_index *index, uint32_t id, struct zn_index_entry *entry, uint64_t *slot);
+
+/**
+ * @brief Inserts a Data ID that is not in the index yet
+ *
+ * The caller must serialize writers. Slots are never added, once 15/16 of
+ * them are in use further inserts fail.
+ *
+ * @return Non-zero if the index is full
+ */
+int
+zn_index_insert(struct zn_index *index, uint32_t id, enum zn_index_state state, uint32_t zone,
+                uint32_t chunk_offset);
+
+/**
+ * @brief Changes the state and location of a Data ID in the index
+ *
+ * The caller must serialize writers.
+ */
+void
+zn_index_update(struct zn_index *index, uint32_t id, enum zn_index_state state, uint32_t zone,
+                uint32_t chunk_offset);
+
+/**
+ * @brief Removes a Data ID from the index
+ *
+ * The caller must serialize writers.
+ *
+ * @return true if the ID was in the index
+ */
+bool
+zn_index_remove(struct zn_index *index, uint32_t id);
+
+/**
+ * @brief State of an entry
+ */
+static inline enum zn_index_state
+zn_index_entry_state(const struct zn_index_entry *entry) {
+    return (enum zn_index_state) (entry->meta & ZN_INDEX_STATE_MASK);
+}
+
+#endif // ZN_INDEX_H
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "znbackend.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * @struct zn_inflight_read
+ * @brief A chunk read that other readers of the same location wait for
+ */
+struct zn_inflight_read {
+    gint64 key;        /**< Packed location, see `zn_inflight_key` */
+    GCond cond;        /**< Signalled once the read is done */
+    uint32_t joiners;  /**< Threads waiting for the read, the last one frees it */
+    bool done;         /**< The leader finished the read */
+    int ret;           /**< Result of the read */
+    GBytes *data;      /**< Copy of the chunk for the joiners, NULL if the read failed */
+};
+
+/**
+ * @struct zn_inflight
+ * @brief Table of the flash reads of cache hits currently in progress.
+ *
+ * The first thread to read a location leads the read, threads that hit the
+ * same location before it finished join it and copy the chunk from a shared
+ * reference instead of issuing their own read.
+ *
+ * Every reader, leader or joiner, is in the epoch it entered in
+ * `zn_cachemap_find`, so the zone can't be reset while a read is in the
+ * table and a location always identifies the same chunk.
+ */
+struct zn_inflight {
+    GMutex lock;
+    GHashTable *reads; /**< Packed location → zn_inflight_read */
+};
+
+/**
+ * @brief Sets up an empty table
+ */
+void
+zn_inflight_init(struct zn_inflight *inflight);
+
+/**
+ * @brief Frees the table, no reads may be in progress
+ */
+void
+zn_inflight_destroy(struct zn_inflight *inflight);
+
+/**
+ * @brief Joins the read of a location, or registers the caller as its leader
+ *
+ * @param inflight Table of reads in progress
+ * @param location Location to read
+ * @param iov Destination of the chunk
+ * @param iovcnt Number of segments of `iov`
+ * @param[out] read Read the caller leads, pass it to `zn_inflight_end` after reading
+ * @param[out] ret Result of the read the caller joined
+ * @return true if the caller leads the read, false if `iov` was filled by another thread's read
+ */
+bool
+zn_inflight_begin(struct zn_inflight *inflight, struct zn_pair location, const struct iovec *iov,
+                  int iovcnt, struct zn_inflight_read **read, int *ret);
+
+/**
+ * @brief Finishes a read the caller leads and hands the chunk to the threads that joined it
+ *
+ * @param inflight Table of reads in progress
+ * @param read Read returned by `zn_inflight_begin`
+ * @param iov The chunk that was read
+ * @param iovcnt Number of segments of `iov`
+ * @param ret Result of the read
+ */
+void
+zn_inflight_end(struct zn_inflight *inflight, struct zn_inflight_read *read,
+                const struct iovec *iov, int iovcnt, int ret);
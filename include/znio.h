@@ -0,0 +1,202 @@
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @enum zn_io_op
+ * @brief Operations understood by the I/O engine
+ */
+enum zn_io_op {
+    ZN_IO_OP_READ = 0,  /**< Read `len` bytes at `offset` into `buf` */
+    ZN_IO_OP_WRITE = 1, /**< Write `len` bytes from `buf` to `offset` */
+    ZN_IO_OP_FSYNC = 2, /**< Flush the device, `buf`, `len` and `offset` are ignored */
+    ZN_IO_OP_READV = 3, /**< Read `len` bytes at `offset` into the `iovcnt` segments of `iov` */
+    ZN_IO_OP_WRITEV = 4, /**< Write the `iovcnt` segments of `iov`, `len` bytes, to `offset` */
+};
+
+/**
+ * @struct zn_io_req
+ * @brief A single request for the I/O engine.
+ *
+ * Requests are owned by the caller and must stay alive until they have been
+ * completed by `zn_io_wait`.
+ */
+struct zn_io_req {
+    enum zn_io_op op;
+    void *buf;       /**< Source or destination buffer */
+    const struct iovec *iov; /**< Segments of `ZN_IO_OP_READV` and `ZN_IO_OP_WRITEV` */
+    int iovcnt;              /**< Number of segments in `iov` */
+    size_t len;      /**< Length of the transfer in bytes */
+    uint64_t offset; /**< Byte offset on the device */
+    bool link;       /**< The next request only starts once this one has fully completed */
+    ssize_t res;     /**< Bytes transferred or -errno, set on completion */
+};
+
+/**
+ * @struct zn_io
+ * @brief Asynchronous I/O engine for chunk reads and writes.
+ *
+ * With `ZN_IO_URING` defined every thread that submits gets its own io_uring
+ * (created on first use), so threads never contend on a ring and each one can
+ * keep up to `queue_depth` requests in flight. Without it requests are executed
+ * synchronously on submission with pread/pwrite.
+ *
+ * Device flushes are shared between threads with `zn_io_sync`.
+ */
+struct zn_io {
+    int fd;               /**< File descriptor of the device */
+    uint32_t queue_depth; /**< Maximum in-flight requests per thread */
+    size_t max_write;     /**< Largest single write the device takes without splitting */
+    uint32_t nsid;        /**< NVMe namespace, only set once zone append is enabled */
+    uint32_t lba_size;    /**< Logical block size used for zone append commands */
+
+    GMutex sync_lock;
+    GCond sync_cond;
+    uint64_t sync_requested; /**< Flush requests handed out so far */
+    uint64_t sync_completed; /**< All requests up to and including this one are durable */
+    bool syncing;            /**< A thread is flushing the device on behalf of the others */
+};
+
+/**
+ * @brief Sets up the I/O engine
+ *
+ * @param io Engine to initialize
+ * @param fd File descriptor of the device
+ * @param queue_depth Maximum in-flight requests per submitting thread
+ */
+void
+zn_io_init(struct zn_io *io, int fd, uint32_t queue_depth);
+
+/**
+ * @brief Queue requests on the calling thread's ring and submit them to the device
+ *
+ * Returns as soon as the requests are submitted. Chains of linked requests are
+ * executed in order, if one member fails the rest of the chain completes with
+ * -ECANCELED.
+ *
+ * @param io I/O engine
+ * @param reqs Requests to submit, must remain valid until `zn_io_wait` returns
+ * @param nr Number of requests
+ * @return 0 on success, -errno if the ring could not be used
+ */
+int
+zn_io_submit(struct zn_io *io, struct zn_io_req *reqs, uint32_t nr);
+
+/**
+ * @brief Waits for all requests submitted by the calling thread to complete
+ *
+ * @param io I/O engine
+ * @return 0 on success, -errno if the ring could not be used
+ */
+int
+zn_io_wait(struct zn_io *io);
+
+/**
+ * @brief Submits requests and waits for them to complete
+ *
+ * @param io I/O engine
+ * @param reqs Requests to execute
+ * @param nr Number of requests
+ * @return 0 if every request transferred its full length, -1 otherwise
+ */
+int
+zn_io_run(struct zn_io *io, struct zn_io_req *reqs, uint32_t nr);
+
+/**
+ * @brief Counts the requests needed to transfer a scatter-gather list
+ *
+ * @param io I/O engine
+ * @param iov Segments of the transfer
+ * @param iovcnt Number of segments
+ * @return Number of requests `zn_io_prep_iov` fills in
+ */
+uint32_t
+zn_io_iov_reqs(const struct zn_io *io, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Splits a scatter-gather list into requests for consecutive device offsets
+ *
+ * Neighbouring segments are combined into vectored requests and segments are
+ * split, so no request is larger than `max_write`. With `link` set the
+ * requests form one chain and execute in order. Vectored requests point into
+ * `iov`, which must stay valid until they complete.
+ *
+ * @param io I/O engine
+ * @param reqs Requests to fill in, sized with `zn_io_iov_reqs`
+ * @param op `ZN_IO_OP_READ` or `ZN_IO_OP_WRITE`
+ * @param iov Segments of the transfer
+ * @param iovcnt Number of segments
+ * @param offset Device offset of the first byte
+ * @param link Chain the requests
+ * @return Number of requests filled in
+ */
+uint32_t
+zn_io_prep_iov(const struct zn_io *io, struct zn_io_req *reqs, enum zn_io_op op,
+               const struct iovec *iov, int iovcnt, uint64_t offset, bool link);
+
+/**
+ * @brief Makes all writes that completed before the call durable
+ *
+ * Concurrent callers are grouped, one of them flushes the device for
+ * everyone that arrived before its flush started and the others wait for it.
+ *
+ * @param io I/O engine
+ * @return 0 on success, -errno of the failed flush otherwise
+ */
+int
+zn_io_sync(struct zn_io *io);
+
+/**
+ * @brief Enables zone append, which is issued as an NVMe passthrough command
+ *
+ * @param io I/O engine
+ * @param lba_size Logical block size of the namespace
+ * @return 0 on success, -1 if the device is not an NVMe namespace
+ */
+int
+zn_io_zone_append_init(struct zn_io *io, uint32_t lba_size);
+
+/**
+ * @brief Appends data to a zone, the device picks where it is written
+ *
+ * Blocks until the command completes. Several threads can append to the same
+ * zone at once.
+ *
+ * @param io I/O engine with zone append enabled
+ * @param buf Data to write, `len` must be a multiple of the logical block size
+ * @param len Length of the write in bytes
+ * @param zone_start Byte offset of the start of the zone
+ * @param[out] written_offset Byte offset the data was written to
+ * @return 0 on success, -1 on error
+ */
+int
+zn_io_zone_append(struct zn_io *io, const void *buf, size_t len, uint64_t zone_start,
+                  uint64_t *written_offset);
+
+/**
+ * @brief Total length of a scatter-gather list
+ */
+static inline size_t
+zn_io_iov_len(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/**
+ * @brief Checks if a completed request transferred its full length
+ */
+static inline bool
+zn_io_req_ok(const struct zn_io_req *req) {
+    if (req->op == ZN_IO_OP_FSYNC) {
+        return req->res == 0;
+    }
+    return req->res >= 0 && (size_t) req->res == req->len;
+}
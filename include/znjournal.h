@@ -0,0 +1,233 @@
+#pragma once
+
+#include "znbackend.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZN_CHUNK_MAGIC 0x4b48435a   /**< "ZCHK", marks the header of a written chunk */
+#define ZN_JOURNAL_MAGIC 0x4c4e4a5a /**< "ZJNL", marks the header of a journal file */
+#define ZN_JOURNAL_VERSION 1
+
+#define ZN_JOURNAL_BUFFER_RECORDS 4096 /**< Records buffered in memory before they are written */
+#define ZN_JOURNAL_MIN_COMPACT 65536   /**< Journals with fewer records are never compacted */
+#define ZN_JOURNAL_GENERATION_GAP (1u << 20) /**< Generations skipped on a restart, more than
+                                                  chunks can be written but not yet journaled */
+
+/**
+ * @struct zn_chunk_header
+ * @brief Written at the start of every chunk, in place of the first bytes of its data
+ *
+ * The generation grows with every chunk written, so of two copies of the same
+ * ID the newer one can be told apart. Copies made by GC keep the header.
+ */
+struct zn_chunk_header {
+    uint32_t id;
+    uint32_t magic;      /**< `ZN_CHUNK_MAGIC` */
+    uint64_t generation;
+    uint32_t length;     /**< Bytes of the chunk, header included */
+    uint32_t checksum;   /**< Of the fields above, see `zn_journal_checksum` */
+};
+
+/**
+ * @enum zn_journal_op
+ * @brief Changes of the cache map that are journaled
+ */
+enum zn_journal_op {
+    ZN_JOURNAL_INSERT = 1,      /**< The ID now lives at the location, also written when GC moves it */
+    ZN_JOURNAL_CLEAR_CHUNK = 2, /**< The ID was evicted from the location */
+    ZN_JOURNAL_CLEAR_ZONE = 3,  /**< Every ID of the zone was evicted, the zone is about to be reset */
+};
+
+/**
+ * @struct zn_journal_record
+ * @brief One change of the cache map
+ */
+struct zn_journal_record {
+    uint32_t op; /**< `zn_journal_op` */
+    uint32_t id;
+    uint32_t zone;
+    uint32_t chunk_offset;
+    uint64_t generation; /**< Generation of the chunk for inserts, 0 if unknown */
+    uint32_t pad;
+    uint32_t checksum; /**< Of the fields above, a torn record ends the journal */
+};
+
+/**
+ * @struct zn_journal_header
+ * @brief Start of a journal file, a journal is only replayed on the device it was written for
+ */
+struct zn_journal_header {
+    uint32_t magic;   /**< `ZN_JOURNAL_MAGIC` */
+    uint32_t version; /**< `ZN_JOURNAL_VERSION` */
+    uint64_t chunk_sz;
+    uint64_t zone_cap;
+    uint32_t nr_zones;
+    uint32_t pad;
+    uint64_t generation; /**< Every chunk written before the file was created has a lower one */
+    uint32_t pad2;
+    uint32_t checksum; /**< Of the fields above */
+};
+
+/**
+ * @struct zn_journal
+ * @brief Append-only log of the cache map, replayed on a warm restart
+ *
+ * Records are buffered and written in large appends. Replaying the journal
+ * in order rebuilds the cache map without reading the device, so a restart
+ * takes time in proportion to the journal, not to the device. Once the
+ * journal has doubled since it was last written out it is compacted: a new
+ * file holding one insert per cached chunk replaces it.
+ *
+ * Changes are journaled after they are applied to the cache map, and a
+ * chunk can't be evicted or moved before its insert was journaled, so the
+ * records of one ID are always in order. Staged chunks are only journaled
+ * once they are flushed to the device, those evicted while staged are left
+ * out. Compaction may write out a change whose record follows in the new
+ * file, every record is idempotent.
+ */
+struct zn_journal {
+    GMutex lock;
+    int fd;     /**< -1 while journaling is off */
+    char *path;
+    struct zn_journal_header header; /**< Written at the start of every new file */
+    struct zn_journal_record *buffer; /**< Records not written to the file yet */
+    uint32_t nr_buffered;
+    uint64_t nr_records;   /**< Records in the file, buffered ones included */
+    uint64_t compact_at;   /**< Compact once the file holds this many records */
+    uint64_t generation;   /**< Generation of the next chunk written */
+    bool failed;           /**< A write failed, journaling stopped */
+};
+
+/**
+ * @brief Checksum used by chunk headers and journal records (32 bit FNV-1a)
+ */
+uint32_t
+zn_journal_checksum(const void *data, size_t len);
+
+/**
+ * @brief Fills in a chunk header and its checksum
+ */
+void
+zn_chunk_header_init(struct zn_chunk_header *header, uint32_t id, uint32_t length,
+                     uint64_t generation);
+
+/**
+ * @brief Checks the magic and checksum of a chunk header read from the device
+ *
+ * @return true if the header was written whole by `zn_chunk_header_init`
+ */
+bool
+zn_chunk_header_valid(const struct zn_chunk_header *header);
+
+/**
+ * @brief Sets up a journal that is off, appending to it does nothing
+ */
+void
+zn_journal_init(struct zn_journal *journal);
+
+/**
+ * @brief Writes out buffered records and closes the file
+ */
+void
+zn_journal_destroy(struct zn_journal *journal);
+
+/**
+ * @brief Checks if a journal file exists and was written for a device of the same geometry
+ *
+ * @return true if the journal can be replayed
+ */
+bool
+zn_journal_matches(const char *path, size_t chunk_sz, uint64_t zone_cap, uint32_t nr_zones);
+
+/**
+ * @brief Replays every whole record of a journal file in order
+ *
+ * Stops at the first record with a bad checksum, the rest of the file was
+ * torn by a crash.
+ *
+ * @param path Journal file, must match the device, see `zn_journal_matches`
+ * @param apply Called with each record
+ * @param user_data Passed to `apply`
+ * @param[out] generation Higher than the generation of any chunk in the journal
+ * @param[out] torn Set if the journal ended in a bad or partial record
+ * @return Number of records replayed, -1 if the file couldn't be read
+ */
+int64_t
+zn_journal_replay(const char *path, void (*apply)(const struct zn_journal_record *record,
+                                                  void *user_data),
+                  void *user_data, uint64_t *generation, bool *torn);
+
+/**
+ * @brief Checks that a journal can be replayed to its end
+ *
+ * @return true if it matches the device and no record was torn
+ */
+bool
+zn_journal_intact(const char *path, size_t chunk_sz, uint64_t zone_cap, uint32_t nr_zones);
+
+/**
+ * @brief Starts journaling to a new file that holds only the records written by `fill`
+ *
+ * The new file replaces `path` once it is durable, so a crash leaves either
+ * the old journal or the new one. Appends from other threads wait until it
+ * is done.
+ *
+ * @param journal Journal
+ * @param path File to write, NULL to keep the current one
+ * @param chunk_sz Size of each chunk, recorded in the file header
+ * @param zone_cap Capacity of each zone, recorded in the file header
+ * @param nr_zones Number of zones, recorded in the file header
+ * @param fill Writes the live chunks with `zn_journal_put_locked`
+ * @param user_data Passed to `fill`
+ * @return Non-zero on error, journaling stops
+ */
+int
+zn_journal_compact(struct zn_journal *journal, const char *path, size_t chunk_sz,
+                   uint64_t zone_cap, uint32_t nr_zones,
+                   void (*fill)(struct zn_journal *journal, void *user_data), void *user_data);
+
+/**
+ * @brief Appends a record, only called by the `fill` of `zn_journal_compact`
+ */
+void
+zn_journal_put_locked(struct zn_journal *journal, enum zn_journal_op op, uint32_t id,
+                      struct zn_pair location, uint64_t generation);
+
+/**
+ * @brief Appends a record
+ *
+ * @param journal Journal
+ * @param op Change of the cache map
+ * @param id ID that changed, unused for `ZN_JOURNAL_CLEAR_ZONE`
+ * @param location Location of the ID, only the zone for `ZN_JOURNAL_CLEAR_ZONE`
+ * @param generation Generation of the chunk for inserts, 0 otherwise
+ */
+void
+zn_journal_append(struct zn_journal *journal, enum zn_journal_op op, uint32_t id,
+                  struct zn_pair location, uint64_t generation);
+
+/**
+ * @brief Writes out buffered records and waits until they are durable
+ *
+ * Called before evicted zones are reset, so a replay never maps an ID to a
+ * location that was written again.
+ *
+ * @return Non-zero on error, journaling stops and the file is removed
+ */
+int
+zn_journal_sync(struct zn_journal *journal);
+
+/**
+ * @brief The journal has doubled since it was last written out
+ */
+bool
+zn_journal_should_compact(struct zn_journal *journal);
+
+/**
+ * @brief Hands out the generation of a new chunk
+ */
+uint64_t
+zn_journal_next_generation(struct zn_journal *journal);
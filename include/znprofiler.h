@@ -24,7 +24,7 @@ struct zn_profiler_metrics {
     enum zn_profiler_type type;
 };
 
-#define PROFILING_METRICS 11 // Keep in sync with enum, zn_profiler_metric_names, and zn_profiler_metric_types
+#define PROFILING_METRICS 12 // Keep in sync with enum, zn_profiler_metric_names, and zn_profiler_metric_types
 enum zn_profiler_tag {
     ZN_PROFILER_METRIC_GET_LATENCY = 0,
     ZN_PROFILER_METRIC_CACHE_USED_MIB = 1,
@@ -37,6 +37,7 @@ enum zn_profiler_tag {
     ZN_PROFILER_METRIC_CACHE_THROUGHPUT = 8,
     ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT = 9,
     ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT = 10,
+    ZN_PROFILER_METRIC_DRAM_HITRATIO = 11,
 };
 
 // (in znprofiler.c)
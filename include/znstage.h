@@ -0,0 +1,113 @@
+#pragma once
+
+#include "znbackend.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct zn_cache;
+
+/**
+ * @struct zn_stage
+ * @brief DRAM staging buffer of one zone
+ *
+ * New chunks of the zone are copied here and published straight away. They
+ * are flushed to the zone in order, with one large write, once the buffer
+ * fills or the zone is complete. Until then reads are served from the buffer.
+ *
+ * Chunks are only added by the writer holding the zone, so the staged chunks
+ * are always the `count` chunks starting at `start`.
+ */
+struct zn_stage {
+    GMutex lock;        /**< Protects the fields below against readers */
+    unsigned char *buf; /**< Staged chunks, allocated on first use, NULL otherwise */
+    uint32_t start;     /**< Chunk offset in the zone of the first staged chunk */
+    uint32_t count;     /**< Chunks currently staged */
+};
+
+/**
+ * @brief Sets up the staging buffers of every zone
+ *
+ * @param cache Cache, `chunk_sz` and `nr_zones` must be set
+ * @param stage_bytes Size of the staging buffer of each zone, staging is disabled if it holds
+ *        fewer than two chunks
+ */
+void
+zn_stage_init(struct zn_cache *cache, uint64_t stage_bytes);
+
+/**
+ * @brief Checks if chunks are written through the staging buffers
+ */
+bool
+zn_stage_enabled(struct zn_cache *cache);
+
+/**
+ * @brief Copies a chunk into the staging buffer of its zone
+ *
+ * The caller must hold the zone. If the buffer is already full it is
+ * flushed first.
+ *
+ * @param cache Pointer to the `zn_cache` structure
+ * @param location Location from `zsm_get_active_zone`
+ * @param iov The chunk
+ * @param iovcnt Number of segments in `iov`
+ * @return Non-zero if the full buffer couldn't be flushed, the chunk is not staged
+ */
+int
+zn_stage_put(struct zn_cache *cache, struct zn_pair location, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Removes the chunk that was staged last again, it couldn't be flushed
+ *
+ * The caller must hold the zone, `location` is the one passed to `zn_stage_put`.
+ */
+void
+zn_stage_unput(struct zn_cache *cache, struct zn_pair location);
+
+/**
+ * @brief Checks if the staging buffer of a zone is full
+ */
+bool
+zn_stage_full(struct zn_cache *cache, uint32_t zone);
+
+/**
+ * @brief Writes the staged chunks of a zone to flash
+ *
+ * The caller must hold the zone. On error the chunks stay staged and
+ * readable. Once written, the chunks that are still in the cache map are
+ * journaled.
+ *
+ * @return Non-zero on error
+ */
+int
+zn_stage_flush(struct zn_cache *cache, uint32_t zone);
+
+/**
+ * @brief Checks if a chunk is staged and not on the device yet
+ */
+bool
+zn_stage_holds(struct zn_cache *cache, struct zn_pair location);
+
+/**
+ * @brief Reads part of a chunk if it is still staged
+ *
+ * @param offset Byte offset into the chunk to start reading at
+ * @return true if `iov` was filled from the staging buffer
+ */
+bool
+zn_stage_read(struct zn_cache *cache, struct zn_pair location, size_t offset,
+              const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Drops everything staged for a zone, called before the zone is reset
+ */
+void
+zn_stage_drop(struct zn_cache *cache, uint32_t zone);
+
+/**
+ * @brief Writes out whatever is still staged and frees the staging buffers
+ */
+void
+zn_stage_destroy(struct zn_cache *cache);
@@ -114,6 +114,56 @@ print_zbd_info(struct zbd_info *info);
 int
 zone_cap(int fd, uint64_t *zone_capacity);
 
+/**
+ * @brief Get the largest zone append the device accepts
+ *
+ * @param[in] fd open zoned block device
+ * @param[out] max_bytes maximum size of a single zone append in bytes
+ * @return non-zero on error
+ */
+int
+zone_append_max_bytes(int fd, uint64_t *max_bytes);
+
+/**
+ * @brief Get the largest write the block layer passes to the device without splitting it
+ *
+ * @param[in] fd open block device
+ * @param[out] max_bytes maximum size of a single write in bytes
+ * @return non-zero on error
+ */
+int
+max_write_bytes(int fd, uint64_t *max_bytes);
+
+/**
+ * @brief Number of thread indexes, the size of per-thread arrays
+ */
+#define ZN_MAX_THREADS 256
+
+/**
+ * @brief Thread index shared by every thread past the first `ZN_MAX_THREADS - 1`
+ */
+#define ZN_THREAD_SHARED (ZN_MAX_THREADS - 1)
+
+/**
+ * @brief Small dense index of the calling thread
+ *
+ * Each thread gets the lowest index that is not in use on its first call and
+ * keeps it until it exits, so per-thread arrays of `ZN_MAX_THREADS` entries
+ * can be indexed with it. Only `ZN_MAX_THREADS - 1` indexes are handed out to
+ * single threads, once they are all taken new threads get `ZN_THREAD_SHARED`
+ * and keep it. Users of per-thread arrays must synchronize that entry.
+ *
+ * @return Index of the calling thread, below `zn_thread_index_bound()`
+ */
+uint32_t
+zn_thread_index(void);
+
+/**
+ * @brief One past the highest thread index handed out so far
+ */
+uint32_t
+zn_thread_index_bound(void);
+
 void
 print_zn_pair_list(struct zn_pair *list, uint32_t len);
 
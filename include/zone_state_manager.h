@@ -4,6 +4,7 @@
 #include "stdbool.h"
 #include "cachemap.h"
 #include "znbackend.h"
+#include "znbitmap.h"
 
 #include <stdint.h>
 
@@ -18,6 +19,9 @@ enum zn_zone_condition {
     ZN_ZONE_FULL = 1,   /**< The zone is completely occupied and cannot accept new data. */
     ZN_ZONE_ACTIVE = 2, /**< The zone is currently in use and may still have space for new data. */
     ZN_ZONE_WRITE_OCCURING = 3, /**< The zone is currently being written to. */
+    ZN_ZONE_FINISHING = 4, /**< The zone is full, the device is still finishing it. */
+    ZN_ZONE_RESETTING = 5, /**< The zone was evicted, the device is still resetting it. */
+    ZN_ZONE_OFFLINE = 6,   /**< The device failed to reset the zone, it is never used again. */
 };
 
 /**
@@ -26,7 +30,7 @@ enum zn_zone_condition {
  */
 enum zsm_get_active_zone_error {
     ZSM_GET_ACTIVE_ZONE_SUCCESS = 0,  /**< Success */
-    ZSM_GET_ACTIVE_ZONE_RETRY = 2,    /**< Thread needs to retry later */
+    ZSM_GET_ACTIVE_ZONE_RETRY = 2,    /**< Thread was queued, see `zsm_try_get_active_zone_batch` */
     ZSM_GET_ACTIVE_ZONE_ERROR = 3,    /**< Error occurred */
     ZSM_GET_ACTIVE_ZONE_EVICT = 4     /**< Thread needs to evict */
 };
@@ -38,8 +42,44 @@ enum zsm_get_active_zone_error {
 struct zn_zone {
     enum zn_zone_condition state;
     uint32_t zone_id;
-    uint32_t chunk_offset;
-    GQueue *invalid; /**< Invalidated chunks, used after filled on SSD */
+    uint32_t chunk_offset; /**< Next chunk to write, only used by exclusive zones */
+    gint reserved; /**< Chunks handed out to writers, only used by shared zones. At least
+                        `max_zone_chunks` unless writers may reserve chunks of the zone */
+    gint written;  /**< Chunks whose write finished or failed, only used by shared zones */
+    int32_t slot;  /**< Affinity slot that owns the zone, -1 if it is in the shared pool */
+    bool reset_pending; /**< Evicted while FINISHING, it is reset once the finish completes */
+    bool retired;       /**< Cleared from the cache, evicted once its readers are done */
+    bool stuck_open;    /**< A finish or reset failed, it may still be open on the device */
+    uint32_t cmd_failures; /**< Failed attempts of the finish or reset that is queued */
+    struct zn_bitmap valid;   /**< Chunks holding cached data, kept by the chunk eviction policy */
+    struct zn_bitmap invalid; /**< Invalidated chunks, used after filled on SSD */
+};
+
+/**
+ * @struct zsm_affinity_slot
+ * @brief An active zone owned by a group of threads
+ *
+ * The zone is written by one thread of the group at a time, holding `lock`
+ * from `zsm_get_active_zone` until the zone is returned. It stays with the
+ * group between writes instead of going back to the shared pool, unless
+ * other threads are waiting for a zone.
+ */
+struct zsm_affinity_slot {
+    GMutex lock;
+    struct zn_zone *zone; /**< Owned zone, NULL until the group needs one */
+};
+
+/**
+ * @struct zsm_waiter
+ * @brief A thread waiting for a zone to write to
+ *
+ * Waiters are queued in the order they first asked for a zone and woken one
+ * at a time as zones are returned, closed or reset.
+ */
+struct zsm_waiter {
+    GCond cond;
+    uint64_t ticket; /**< Order of arrival, 0 until the waiter is first queued */
+    bool queued;     /**< In the wait queue, cleared by the thread that wakes it */
 };
 
 /**
@@ -53,6 +93,24 @@ struct zone_state_manager {
     struct zn_zone *state; /**< An array that stores the state of each zone, and acts as the backing
     memory for the active and free queues. */
     int writes_occurring;  /**< The current number of writes occuring on active zones */
+    struct zn_zone *current; /**< Shared zone writers reserve chunks of without the lock, or NULL */
+    struct zsm_affinity_slot *slots; /**< Zones owned by groups of threads, see `zn_thread_index` */
+    uint32_t nr_slots;               /**< Number of affinity slots, 0 if affinity is off */
+    GQueue waiters;                  /**< zsm_waiter, ordered by ticket */
+    gint nr_waiting;                 /**< Length of `waiters`, read by slot owners without the lock */
+    gint nr_retired;                 /**< Retired zones, free once their readers are done */
+    uint64_t next_ticket;            /**< Ticket of the next waiter to arrive */
+
+    // Zone finishes and resets, issued by the worker without holding the lock
+    GThread *worker;       /**< NULL if the backend has no zone commands, they complete at once */
+    GQueue pending;        /**< Zones to finish or reset, in the order they were queued */
+    GCond work_cond;       /**< Signalled when a zone is queued or the worker should stop */
+    GCond idle_cond;       /**< Broadcast when the worker ran out of zones */
+    uint32_t nr_finishing; /**< FINISHING zones, they count as active until the device is done */
+    uint32_t nr_resetting; /**< RESETTING zones, and FINISHING ones waiting to be reset */
+    uint32_t nr_stuck_open; /**< Zones with `stuck_open` set, they count as active */
+    bool busy;             /**< The worker is running a command */
+    bool stopping;         /**< The worker exits once `pending` is empty */
 
     // Information about the cache
     int fd;                       /**< File descriptor of the SSD */
@@ -63,6 +121,8 @@ struct zone_state_manager {
     uint64_t max_zone_chunks;     /**< Maximum amount of chunks that a zone can store */
     uint32_t num_zones;           /**< Number of zones */
 	enum zn_backend backend_type; /**< The type of backend */
+    bool shared;                  /**< Active zones are filled by several writers at once */
+    bool append;                  /**< Shared zones are written with zone append */
 };
 
 /**
@@ -75,59 +135,203 @@ struct zone_state_manager {
  * @param[in]  zone_size size of the zone in bytes
  * @param[in]  chunk_size size of the chunk in bytes
  * @param[in]  backend_type the type of SSD that is backing the zones
+ * @param[in]  shared hand out active zones to several writers at once, each writer reserves
+ *             its chunks with an atomic add instead of holding the zone
+ * @param[in]  append shared zones are written with zone append, the device picks the chunk
+ *             offset of each write. Implies `shared`
+ * @param[in]  affinity give each thread, or group of threads, an active zone of its own.
+ *             Only used for exclusive zones, and only if more than one zone can be active
  *
  */
 void
 zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int fd,
          const uint64_t zone_cap, const uint64_t zone_size, const size_t chunk_size,
          const uint32_t max_nr_active_zones,
-         const enum zn_backend backend_type);
+         const enum zn_backend backend_type, const bool shared, const bool append,
+         const bool affinity);
+
+/** @brief Waits until every queued zone finish and reset completed
+ *  Implementation notes:
+ *  - Zones closed or evicted after the call started may still be pending when it returns
+ */
+void
+zsm_drain(struct zone_state_manager *state);
+
+/** @brief Stops the zone worker after it completed the zones queued so far */
+void
+zsm_destroy(struct zone_state_manager *state);
+
+/** @brief Restores the zones of a journal that was replayed, before any zone is handed out
+ *  @param[in]     state zone_state data structure
+ *  @param[in,out] written chunks the journal recorded in each zone, 0 if it holds none. Set
+ *                 to the chunks on the device of each zone that is kept, 0 for the others
+ *  @return non-zero if the zones couldn't be reported or finished
+ *  Implementation notes:
+ *  - Zones that are kept are full, partly written ones are finished. On a zoned device
+ *    chunks past the write pointer never reached it, and zones that are not kept are
+ *    reset if anything was written to them
+ */
+int
+zsm_restore(struct zone_state_manager *state, uint32_t *written);
 
 /** @brief Returns a new chunk that a thread can write to
  *  @param[in]  state zone_state data structure
  *  @param[out] pair the new location to write to
- *  @return 0 on success, 1 indicates that the thread needs to retry later, and -1 on failure
+ *  @return ZSM_GET_ACTIVE_ZONE_SUCCESS, ZSM_GET_ACTIVE_ZONE_EVICT if no zone is free and none is
+ *          active, or ZSM_GET_ACTIVE_ZONE_ERROR
  *  Implementation notes:
  *  - Gets an active zone if it can, otherwise get from the free list (and move it to the active
  * list)
  *  - Increment the corresponding chunk pointer to point to the next free zone
  *  - If chunk pointer reaches the end, move zone to full list
+ *  - Shared zones stay available to other writers until all of their chunks have been handed
+ *    out. Chunks are reserved without taking the lock, it is only taken to open a zone and
+ *    once the last chunk of a zone was handed out
+ *  - In append mode `pair->chunk_offset` is only known once the write completes
+ *  - With affinity the thread's own zone is used if its group isn't writing to it already,
+ *    the shared pool otherwise. The zone must be returned by the same thread. Zones of idle
+ *    slots go back to the pool when no other zone can be taken, and a slot's zone goes back
+ *    when it is returned while threads wait, so owned zones never hold up the others
+ *  - If every active zone is being written and no zone can be opened, the thread sleeps in
+ *    the wait queue until one is returned, closed or reset. Zones being reset or retired
+ *    are waited for too, ZSM_GET_ACTIVE_ZONE_EVICT is only returned if there are none
  */
 enum zsm_get_active_zone_error
 zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair);
 
-/** @brief Not yet thought out well, but a function for host-side gc (when we need to relocate a
- * number of chunks)
- *  @param chunks specifies how many chunks we need
- *  @return which chunks can be written to, in the form of a dynamic array
+/** @brief Returns a run of consecutive chunks that a thread can write to with a single write
+ *  @param[in]  state zone_state data structure
+ *  @param[in]  chunks number of chunks wanted
+ *  @param[out] pair location of the first chunk of the run
+ *  @param[out] nr_chunks length of the run, at least 1 and at most `chunks`. It is shorter when
+ *              the zone has fewer chunks left, the caller asks again for the rest
+ *  @return same as `zsm_get_active_zone`
  *  Implementation notes:
- *  - Updates the zone state accordingly
+ *  - An exclusive zone is held until `zsm_return_active_zone_batch`, shared zones keep taking
+ *    other writers
+ *  - In append mode offsets aren't known up front, so runs are always a single chunk
  */
-GArray
-zsm_get_active_zone_batch(int chunks);
+enum zsm_get_active_zone_error
+zsm_get_active_zone_batch(struct zone_state_manager *state, uint32_t chunks, struct zn_pair *pair,
+                          uint32_t *nr_chunks);
 
-// Returns the active zone after it's written to
+/** @brief Same as `zsm_get_active_zone_batch`, but queues the caller instead of sleeping
+ *  @param[in]  waiter queued when ZSM_GET_ACTIVE_ZONE_RETRY is returned, the caller sleeps in
+ *              `zsm_wait` and asks again. The same waiter keeps its place across retries
+ *  Implementation notes:
+ *  - For threads that hold locks the writers need to return their zones, they drop them
+ *    before `zsm_wait`
+ */
+enum zsm_get_active_zone_error
+zsm_try_get_active_zone_batch(struct zone_state_manager *state, uint32_t chunks,
+                              struct zn_pair *pair, uint32_t *nr_chunks,
+                              struct zsm_waiter *waiter);
+
+/** @brief Sets up a waiter that isn't queued */
+void
+zsm_waiter_init(struct zsm_waiter *waiter);
+
+/** @brief Frees a waiter, it must not be queued */
+void
+zsm_waiter_clear(struct zsm_waiter *waiter);
+
+/** @brief Sleeps until the queued waiter is woken, returns right away if it already was */
+void
+zsm_wait(struct zone_state_manager *state, struct zsm_waiter *waiter);
+
+/** @brief Returns the zone of a run after it's written to
+ *  @param[in]  state zone_state data structure
+ *  @param[in]  pair location of the first chunk of the run
+ *  @param[in]  nr_chunks chunks written, can be fewer than were handed out but not 0. Shared
+ *              zones need every chunk handed out back, see `zsm_failed_to_write_batch`
+ *  @param[out] zone_full set to true if this write completed the zone
+ *  @return 0 on success, non-zero if the zone could not be closed
+ */
+int
+zsm_return_active_zone_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                             uint32_t nr_chunks, bool *zone_full);
+
+/** @brief Returns the active zone after it's written to
+ *  @param[in]  state zone_state data structure
+ *  @param[in]  pair location that was written, in append mode the offset the device assigned
+ *  @param[out] zone_full set to true if this write completed the zone
+ *  @return 0 on success, non-zero if the zone could not be closed
+ */
 int
-zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair);
+zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair, bool *zone_full);
+
+/** @brief Marks full zones that are only waiting for their readers before they are evicted
+ *  @param zones the zones, each one is passed to `zsm_evict_zones` later
+ *  @param nr_zones number of zones
+ *  Implementation notes
+ *  - Retired zones count as free soon, writers wait for them in the wait queue instead of
+ *    being told to evict
+ */
+void
+zsm_retire_zones(struct zone_state_manager *state, const uint32_t *zones, uint32_t nr_zones);
+
+/** @brief Returns true if threads wait for a zone while retired zones wait for their readers,
+ *  without taking the lock */
+bool
+zsm_waiting_for_retired(struct zone_state_manager *state);
+
+/** @brief Queues the waiter and sleeps until a zone is returned, closed or reset
+ *  Implementation notes:
+ *  - For threads that were told to evict but can't, it returns right away if a zone can be
+ *    taken already
+ */
+void
+zsm_wait_for_zone(struct zone_state_manager *state, struct zsm_waiter *waiter);
+
+/** @brief Wakes a waiter before a zone is available, so it can check if it still needs one.
+ *  Does nothing if it isn't queued */
+void
+zsm_wake_waiter(struct zone_state_manager *state, struct zsm_waiter *waiter);
 
 /** @brief Moves full zones to the free zone to make them available again
  *  @param zone_to_free the zone to make free again
  *  Implementation notes
  *  - Should be the one to perform the freeing operation
  *  - Does not manage zone eviction policy
+ *  - On zoned devices the zone is RESETTING until the worker reset it, it is free after that
  *  @return 0 if no error, -1 otherwise
  */
 int
 zsm_evict(struct zone_state_manager *state, int zone_to_free);
 
-void
+/** @brief Moves a set of full zones to the free zone, see `zsm_evict`
+ *  @param zones the zones to make free again, in any order
+ *  @param nr_zones number of zones
+ *  Implementation notes
+ *  - Runs of consecutive zones are reset with a single ranged command
+ *  @return 0 if no error, -1 otherwise
+ */
+int
+zsm_evict_zones(struct zone_state_manager *state, const uint32_t *zones, uint32_t nr_zones);
+
+/** @brief Gives back a chunk that couldn't be written
+ *  @return true if this completed a shared zone, it is full now
+ *  Implementation notes:
+ *  - Exclusive zones are released and the chunk is handed out again
+ *  - Other writers may have reserved chunks of a shared zone after it, so it is left empty
+ */
+bool
 zsm_failed_to_write(struct zone_state_manager *state, struct zn_pair pair);
 
+/** @brief Gives back a run of chunks that couldn't be written
+ *  @param[in]  pair location of the first chunk of the run
+ *  @param[in]  nr_chunks chunks handed out for the run
+ *  @return same as `zsm_failed_to_write`
+ */
+bool
+zsm_failed_to_write_batch(struct zone_state_manager *state, struct zn_pair pair,
+                          uint32_t nr_chunks);
+
 /** @brief Returns the active zone count */
 uint32_t
 zsm_get_num_active_zones(struct zone_state_manager *state);
 
-/** @brief Returns the free zone count */
+/** @brief Returns the free zone count, zones being reset included */
 uint32_t
 zsm_get_num_free_zones(struct zone_state_manager *state);
 
@@ -135,10 +339,26 @@ zsm_get_num_free_zones(struct zone_state_manager *state);
 uint32_t
 zsm_get_num_full_zones(struct zone_state_manager *state);
 
-/** @brief Mark a chunk as invalid */
+/** @brief Mark a chunk as holding cached data, it must not be marked already */
+void
+zsm_mark_chunk_valid(struct zone_state_manager *state, struct zn_pair *location);
+
+/** @brief Mark a chunk as invalid, it no longer holds cached data */
 void
 zsm_mark_chunk_invalid(struct zone_state_manager *state, struct zn_pair *location);
 
-/** @brief Returns invalid chunks in a zone */
+/** @brief Mark a valid chunk as no longer holding cached data without invalidating it,
+ *  used when its data moved to another zone */
+void
+zsm_clear_chunk_valid(struct zone_state_manager *state, struct zn_pair *location);
+
+/** @brief Returns the valid chunks of a zone
+ *  Implementation notes:
+ *  - Bits can be read without a lock, they only change under the eviction policy's lock
+ */
+const struct zn_bitmap *
+zsm_get_valid_chunks(struct zone_state_manager *state, uint32_t zone);
+
+/** @brief Returns invalid chunks in a zone, without taking the lock */
 uint32_t
 zsm_get_num_invalid_chunks(struct zone_state_manager *state, uint32_t zone);
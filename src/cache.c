@@ -8,35 +8,111 @@
 
 
 #include <assert.h>
+#include <limits.h>
 #include <linux/fs.h>
 
 #include "libzbd/zbd.h"
 #include <inttypes.h>
 
+/**
+ * @brief Writes an insert for every chunk in the cache map, fills a compacted journal
+ */
+static void
+zn_cache_journal_fill(struct zn_journal *journal, void *user_data) {
+    struct zn_cache *cache = user_data;
+
+    uint32_t *ids = g_new(uint32_t, cache->max_zone_chunks);
+    for (uint32_t zone = 0; zone < cache->nr_zones; zone++) {
+        zn_cachemap_zone_ids(&cache->cache_map, zone, ids);
+        for (uint32_t i = 0; i < cache->max_zone_chunks; i++) {
+            struct zn_pair location = {.zone = zone, .chunk_offset = i, .id = ids[i]};
+            // Staged chunks are journaled by the flush that writes them
+            if (ids[i] != ZN_CACHEMAP_NO_ID && !zn_stage_holds(cache, location)) {
+                zn_journal_put_locked(journal, ZN_JOURNAL_INSERT, ids[i], location, 0);
+            }
+        }
+    }
+    g_free(ids);
+}
+
+/**
+ * @brief Resets retired zones, called once no reader can use them anymore
+ */
+static void
+zn_cache_reset_zones(const uint32_t *zones, uint32_t nr_zones, void *user_data) {
+    struct zn_cache *cache = user_data;
+
+    // We can assume that no threads will create entries to the zones in the cache map,
+    // because they are full.
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        zn_stage_drop(cache, zones[i]);
+    }
+
+    // The evictions must be durable before the zones are written again, or a replay would map
+    // their IDs to new chunks
+    // If that fails the journal is removed, so a stale one is never replayed
+    if (zn_journal_sync(&cache->journal) != 0) {
+        dbg_printf( "Couldn't sync the journal before resetting %u zones\n", nr_zones);
+    }
+
+    int ret = zsm_evict_zones(&cache->zone_state, zones, nr_zones);
+    if (ret != 0) {
+        assert(!"Issue occurred with evicting zones\n");
+    }
+
+    if (zn_journal_should_compact(&cache->journal)) {
+        (void) zn_journal_compact(&cache->journal, NULL, cache->chunk_sz, cache->zone_cap,
+                                  cache->nr_zones, zn_cache_journal_fill, cache);
+    }
+}
+
+void
+zn_cache_retire_zone(struct zn_cache *cache, uint32_t zone) {
+    zn_cache_retire_zones(cache, &zone, 1);
+}
+
+void
+zn_cache_retire_zones(struct zn_cache *cache, const uint32_t *zones, uint32_t nr_zones) {
+    // Readers that entered an epoch before this may still be reading the zones
+    zn_cachemap_clear_zones(&cache->cache_map, zones, nr_zones);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        struct zn_pair location = {.zone = zones[i]};
+        zn_journal_append(&cache->journal, ZN_JOURNAL_CLEAR_ZONE, 0, location, 0);
+    }
+    // Writers wait for them from now on instead of evicting more, before the epochs can
+    // reclaim them
+    zsm_retire_zones(&cache->zone_state, zones, nr_zones);
+    zn_epoch_retire_zones(&cache->epoch, zones, nr_zones);
+    zn_cache_reclaim_zones(cache);
+}
+
+void
+zn_cache_reclaim_zones(struct zn_cache *cache) {
+    zn_epoch_reclaim(&cache->epoch, zn_cache_reset_zones, cache);
+}
+
 void
 zn_fg_evict(struct zn_cache *cache) {
-    uint32_t free_zones = zsm_get_num_free_zones(&cache->zone_state);
-    if (cache->eviction_policy.type == ZN_EVICT_PROMOTE_ZONE) {
-        for (uint32_t i = 0; i < EVICT_LOW_THRESH_ZONES - free_zones; i++) {
-            int zone =
-                cache->eviction_policy.do_evict(cache->eviction_policy.data);
-            if (zone == -1) {
-                dbg_printf("No zones to evict%s", "\n");
-                break;
-            }
+    zn_cache_reclaim_zones(cache);
 
-            zn_cachemap_clear_zone(&cache->cache_map, zone);
-            while (cache->active_readers[zone] > 0) {
-                g_thread_yield();
-            }
+    if (cache->eviction_policy.type == ZN_EVICT_PROMOTE_ZONE) {
+        // Retired zones are free as soon as their readers are done, don't evict more for them
+        uint32_t free_zones =
+            zsm_get_num_free_zones(&cache->zone_state) + zn_epoch_nr_retired(&cache->epoch);
+        if (free_zones >= EVICT_LOW_THRESH_ZONES) {
+            return;
+        }
 
-            // We can assume that no threads will create entries to the zone in the cache map,
-            // because it is full.
-            int ret = zsm_evict(&cache->zone_state, zone);
-            if (ret != 0) {
-                assert(!"Issue occurred with evicting zones\n");
-            }
+        // The victims are taken as a set, cleared in one pass and reset together
+        uint32_t zones[EVICT_LOW_THRESH_ZONES];
+        uint32_t nr_zones = cache->eviction_policy.do_evict_zones(
+            cache->eviction_policy.data, zones, EVICT_LOW_THRESH_ZONES - free_zones);
+        if (nr_zones == 0) {
+            dbg_printf("No zones to evict%s", "\n");
+            return;
         }
+
+        zn_cache_retire_zones(cache, zones, nr_zones);
     } else if (cache->eviction_policy.type == ZN_EVICT_CHUNK) {
         (void)cache->eviction_policy.do_evict(cache->eviction_policy.data);
     } else {
@@ -44,113 +120,933 @@ zn_fg_evict(struct zn_cache *cache) {
     }
 }
 
-unsigned char *
-zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_buffer) {
-    unsigned char *data = NULL;
+/**
+ * @brief Copies `len` bytes of `src` into a scatter-gather list starting at `offset`
+ */
+static void
+zn_iov_fill(const struct iovec *iov, int iovcnt, size_t offset, const unsigned char *src,
+            size_t len) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t n = MIN(len, iov[i].iov_len - offset);
+        memcpy((unsigned char *) iov[i].iov_base + offset, src, n);
+        src += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+/**
+ * @brief Leaves the epoch entered by the cache map
+ *
+ * The last reader of a retired zone resets it if writers are waiting for a zone, they would
+ * sleep until the eviction thread comes around otherwise.
+ */
+static void
+zn_cache_exit_epoch(struct zn_cache *cache) {
+    zn_epoch_exit(&cache->epoch);
+    if (zsm_waiting_for_retired(&cache->zone_state)) {
+        zn_cache_reclaim_zones(cache);
+    }
+}
+
+/**
+ * @brief Bookkeeping after a hit was read, leaves the epoch entered by the cache map
+ */
+static void
+zn_cache_hit_done(struct zn_cache *cache, struct zn_pair location,
+                  struct timespec *total_start_time) {
+    cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_READ);
+
+    // Sadly, we have to remember to leave the epoch here
+    zn_cache_exit_epoch(cache);
+
+    g_mutex_lock(&cache->ratio.lock);
+    cache->ratio.hits++;
+    g_mutex_unlock(&cache->ratio.lock);
+
+    struct timespec total_end_time;
+    TIME_NOW(&total_end_time);
+    struct timespec total_start = *total_start_time;
+    double t = TIME_DIFFERENCE_NSEC(total_start, total_end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_HIT_LATENCY, t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT, cache->chunk_sz);
+}
+
+/**
+ * @brief Leaves the epoch entered by the cache map after a hit couldn't be read
+ *
+ * The read never happened, so neither the policy nor the hit ratio sees it.
+ */
+static void
+zn_cache_hit_failed(struct zn_cache *cache) {
+    zn_cache_exit_epoch(cache);
+}
+
+/**
+ * @brief Writes a batch of fetched misses and publishes them, run by the leader
+ *
+ * The batch is spread over as few zone runs as possible, every run is a
+ * single write. Each request's `ret` is set, failed requests are released in
+ * the cache map.
+ */
+static void
+zn_coalescer_write_batch(struct zn_cache *cache, GPtrArray *batch) {
+    struct iovec *iov = NULL;
+    int iov_cap = 0;
+
+    uint32_t next = 0;
+    while (next < batch->len) {
+        struct zn_pair location;
+        uint32_t nr_chunks = 0;
+        enum zsm_get_active_zone_error zret =
+            zsm_get_active_zone_batch(&cache->zone_state, batch->len - next, &location, &nr_chunks);
+
+        if (zret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            zn_fg_evict(cache);
+            continue;
+        } else if (zret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            for (; next < batch->len; next++) {
+                struct zn_write_req *req = g_ptr_array_index(batch, next);
+                zn_cachemap_fail(&cache->cache_map, req->id);
+                req->ret = -1;
+            }
+            break;
+        }
+
+        // Chain the chunks of the run into one write
+        int iovcnt = 0;
+        for (uint32_t i = 0; i < nr_chunks; i++) {
+            iovcnt += ((struct zn_write_req *) g_ptr_array_index(batch, next + i))->iovcnt;
+        }
+        if (iovcnt > iov_cap) {
+            iov_cap = iovcnt;
+            iov = g_renew(struct iovec, iov, iov_cap);
+        }
+        int pos = 0;
+        for (uint32_t i = 0; i < nr_chunks; i++) {
+            struct zn_write_req *req = g_ptr_array_index(batch, next + i);
+            memcpy(&iov[pos], req->iov, sizeof(struct iovec) * req->iovcnt);
+            pos += req->iovcnt;
+        }
+
+        struct timespec start_time, end_time;
+        TIME_NOW(&start_time);
+        int ret = zn_cache_write_chunk(cache, &location, iov, iovcnt);
+        TIME_NOW(&end_time);
+        double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+        ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+
+        if (ret != 0) {
+            dbg_printf("Couldn't write %u chunks to fd at zone=%u, chunk=%u\n", nr_chunks,
+                       location.zone, location.chunk_offset);
+            if (zsm_failed_to_write_batch(&cache->zone_state, location, nr_chunks)) {
+                cache->eviction_policy.zone_full(cache->eviction_policy.data, location.zone);
+            }
+            for (uint32_t i = 0; i < nr_chunks; i++) {
+                struct zn_write_req *req = g_ptr_array_index(batch, next + i);
+                zn_cachemap_fail(&cache->cache_map, req->id);
+                req->ret = -1;
+            }
+            next += nr_chunks;
+            continue;
+        }
+
+        // Publish every chunk before the zone is returned, see zn_cache_miss
+        for (uint32_t i = 0; i < nr_chunks; i++) {
+            struct zn_write_req *req = g_ptr_array_index(batch, next + i);
+            struct zn_pair chunk = {
+                .zone = location.zone,
+                .chunk_offset = location.chunk_offset + i,
+                .id = req->id,
+            };
+            zn_cachemap_insert(&cache->cache_map, req->id, chunk, req->iov, req->iovcnt);
+            zn_journal_append(&cache->journal, ZN_JOURNAL_INSERT, req->id, chunk, req->generation);
+            cache->eviction_policy.update_policy(cache->eviction_policy.data, chunk, ZN_WRITE);
+            req->ret = 0;
+        }
+
+        g_mutex_lock(&cache->ratio.lock);
+        cache->ratio.misses += nr_chunks;
+        g_mutex_unlock(&cache->ratio.lock);
+
+        bool zone_full = false;
+        zsm_return_active_zone_batch(&cache->zone_state, &location, nr_chunks, &zone_full);
+        if (zone_full) {
+            cache->eviction_policy.zone_full(cache->eviction_policy.data, location.zone);
+        }
+
+        next += nr_chunks;
+    }
+
+    g_free(iov);
+}
+
+/**
+ * @brief Writes a fetched miss through the coalescer
+ *
+ * The caller must have announced the fetch with `fetching` beforehand.
+ *
+ * @return Non-zero on error, the cache map claim is released either way
+ */
+static int
+zn_coalescer_write(struct zn_cache *cache, const uint32_t id, uint64_t generation,
+                   const struct iovec *iov, int iovcnt) {
+    struct zn_write_coalescer *wc = &cache->coalescer;
+    struct zn_write_req req = {
+        .id = id, .generation = generation, .iov = iov, .iovcnt = iovcnt, .ret = -1, .done = false};
+
+    g_mutex_lock(&wc->lock);
+    assert(wc->fetching > 0);
+    wc->fetching--;
+    g_ptr_array_add(wc->pending, &req);
+
+    if (wc->leading) {
+        // The leader writes it for us
+        g_cond_broadcast(&wc->cond);
+        while (!req.done) {
+            g_cond_wait(&wc->cond, &wc->lock);
+        }
+        g_mutex_unlock(&wc->lock);
+        return req.ret;
+    }
+
+    // Lead this batch, wait for misses that are about to join it
+    wc->leading = true;
+    gint64 deadline = g_get_monotonic_time() + wc->window_us;
+    while (wc->pending->len < wc->max_chunks && wc->fetching > 0) {
+        if (!g_cond_wait_until(&wc->cond, &wc->lock, deadline)) {
+            break;
+        }
+    }
+
+    // Later arrivals start the next batch while this one is written
+    GPtrArray *batch = wc->pending;
+    wc->pending = g_ptr_array_new();
+    wc->leading = false;
+    g_mutex_unlock(&wc->lock);
+
+    zn_coalescer_write_batch(cache, batch);
+
+    g_mutex_lock(&wc->lock);
+    for (uint32_t i = 0; i < batch->len; i++) {
+        ((struct zn_write_req *) g_ptr_array_index(batch, i))->done = true;
+    }
+    g_cond_broadcast(&wc->cond);
+    g_mutex_unlock(&wc->lock);
+
+    g_ptr_array_free(batch, TRUE);
+    return req.ret;
+}
+
+/**
+ * @brief Takes an active zone for a new chunk, evicting when no zone is free
+ *
+ * @return Non-zero if no zone could be taken
+ */
+static int
+zn_cache_take_zone(struct zn_cache *cache, struct zn_pair *location) {
+    // Sleeps while all active zones are being written or retired zones wait for their readers,
+    // only evicting needs another attempt
+    while (true) {
+
+        enum zsm_get_active_zone_error ret = zsm_get_active_zone(&cache->zone_state, location);
+
+        if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            return -1;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            zn_fg_evict(cache);
+        } else {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Publishes a chunk written by a miss and gives its zone back
+ *
+ * @param generation Generation in the chunk's header
+ * @param staged The chunk is only staged, it is journaled once it is flushed
+ * @param iov The chunk, handed to threads waiting for it (may be NULL)
+ * @param iovcnt Number of segments of `iov`
+ */
+static void
+zn_cache_miss_done(struct zn_cache *cache, struct zn_pair location, uint64_t generation,
+                   bool staged, const struct iovec *iov, int iovcnt,
+                   struct timespec *total_start_time) {
+    g_mutex_lock(&cache->ratio.lock);
+    cache->ratio.misses++;
+    g_mutex_unlock(&cache->ratio.lock);
+
+    // Update metadata. The chunk is published before the zone is returned, so that a zone
+    // is never handed to eviction while one of its chunks is still missing from the map.
+    zn_cachemap_insert(&cache->cache_map, location.id, location, iov, iovcnt);
+
+    // Journaled before the policy sees the chunk, so its eviction is always journaled after it.
+    // A replay must never find a chunk that was only in DRAM, staged chunks wait for their flush.
+    if (!staged) {
+        zn_journal_append(&cache->journal, ZN_JOURNAL_INSERT, location.id, location, generation);
+    }
+
+    cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_WRITE);
+
+    bool zone_full = false;
+    zsm_return_active_zone(&cache->zone_state, &location, &zone_full);
+    if (zone_full) {
+        cache->eviction_policy.zone_full(cache->eviction_policy.data, location.zone);
+    }
+
+    struct timespec total_end_time;
+    TIME_NOW(&total_end_time);
+    struct timespec total_start = *total_start_time;
+    double t = TIME_DIFFERENCE_NSEC(total_start, total_end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT, cache->chunk_sz);
+}
+
+/**
+ * @brief Fetches a missing chunk into `iov` and writes it to flash
+ *
+ * The caller must have claimed `id` in the cache map.
+ *
+ * @return Non-zero on error, the claim is released either way
+ */
+static int
+zn_cache_miss(struct zn_cache *cache, const uint32_t id, const struct iovec *iov, int iovcnt,
+              unsigned char *random_buffer, struct timespec *total_start_time) {
+    if (cache->coalescer.max_chunks > 1) {
+        g_mutex_lock(&cache->coalescer.lock);
+        cache->coalescer.fetching++;
+        g_mutex_unlock(&cache->coalescer.lock);
+
+        uint64_t generation = zn_gen_write_data(cache, id, iov, iovcnt, random_buffer);
+
+        int ret = zn_coalescer_write(cache, id, generation, iov, iovcnt);
+        if (ret == 0) {
+            struct timespec total_start = *total_start_time, total_end_time;
+            TIME_NOW(&total_end_time);
+            double t = TIME_DIFFERENCE_NSEC(total_start, total_end_time);
+            ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
+            ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT,
+                               cache->chunk_sz);
+        }
+        return ret;
+    }
+
+    struct zn_pair location;
+    if (zn_cache_take_zone(cache, &location) != 0) {
+        goto UNDO_MAP;
+    }
+    location.id = id;
+
+    // Emulates pulling in data from a remote source, the payload is copied once from
+    // random_buffer into the caller's buffer and the chunk is written to flash from there
+    uint64_t generation = zn_gen_write_data(cache, id, iov, iovcnt, random_buffer);
+
+    bool staged = zn_stage_enabled(cache);
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    int ret = staged ? zn_stage_put(cache, location, iov, iovcnt)
+                     : zn_cache_write_chunk(cache, &location, iov, iovcnt);
+
+    // The stage is written out once it fills up or the zone is complete, before the chunk is
+    // published, a zone is only returned full once all of its chunks are on the device. If the
+    // flush fails this chunk is given back like a failed write, the ones before it stay staged
+    // and the next put to the zone retries the flush.
+    if (ret == 0 && staged &&
+        (zn_stage_full(cache, location.zone) ||
+         location.chunk_offset + 1 == cache->max_zone_chunks)) {
+        ret = zn_stage_flush(cache, location.zone);
+        if (ret != 0) {
+            zn_stage_unput(cache, location);
+        } else {
+            staged = false;
+        }
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+
+    if (ret != 0) {
+        dbg_printf("Couldn't write to fd at zone=%u, chunk=%u\n", location.zone, location.chunk_offset);
+        goto UNDO_ZONE_GET;
+    }
+
+    zn_cache_miss_done(cache, location, generation, staged, iov, iovcnt, total_start_time);
+    return 0;
+
+UNDO_ZONE_GET:
+    if (zsm_failed_to_write(&cache->zone_state, location)) {
+        cache->eviction_policy.zone_full(cache->eviction_policy.data, location.zone);
+    }
+UNDO_MAP:
+    zn_cachemap_fail(&cache->cache_map, id);
+
+    return -1;
+}
+
+int
+zn_cache_get_into(struct zn_cache *cache, const uint32_t id, const struct iovec *iov, int iovcnt,
+                  unsigned char *random_buffer) {
+    assert(zn_io_iov_len(iov, iovcnt) == cache->chunk_sz);
 
     // PROFILE
-    struct timespec total_start_time, total_end_time;
+    struct timespec total_start_time;
     TIME_NOW(&total_start_time);
 
+    // Hot chunks are served from DRAM without touching flash
+    struct zn_pair dram_location;
+    GBytes *dram_data = zn_dram_get(&cache->dram, id, &dram_location);
+    if (dram_data != NULL) {
+        zn_iov_fill(iov, iovcnt, 0, g_bytes_get_data(dram_data, NULL), cache->chunk_sz);
+        g_bytes_unref(dram_data);
+        zn_cache_hit_done(cache, dram_location, &total_start_time);
+        return 0;
+    }
+
     struct zone_map_result result = zn_cachemap_find(&cache->cache_map, id);
+    if (result.type == RESULT_FULL) {
+        return -1;
+    }
+
+    // Waited for the writer, which handed over its copy of the chunk
+    if (result.type == RESULT_DATA) {
+        zn_iov_fill(iov, iovcnt, 0, g_bytes_get_data(result.data, NULL), cache->chunk_sz);
+        g_bytes_unref(result.data);
+        zn_cache_hit_done(cache, result.value.location, &total_start_time);
+        return 0;
+    }
 
     // Found the entry, read it from disk, update eviction, and decrement reader.
     if (result.type == RESULT_LOC) {
+        // Concurrent hits of the same chunk share one flash read
+        int ret;
+        struct zn_inflight_read *read;
+        if (!zn_inflight_begin(&cache->inflight, result.value.location, iov, iovcnt, &read, &ret)) {
+            if (ret == 0) {
+                zn_cache_hit_done(cache, result.value.location, &total_start_time);
+            } else {
+                zn_cache_hit_failed(cache);
+            }
+            return ret;
+        }
+
         struct timespec start_time, end_time;
         TIME_NOW(&start_time);
-        unsigned char *data = zn_read_from_disk(cache, &result.value.location);
+        ret = zn_read_from_disk(cache, &result.value.location, iov, iovcnt);
         TIME_NOW(&end_time);
         double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
         ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
         ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
 
-        cache->eviction_policy.update_policy(cache->eviction_policy.data, result.value.location,
-                                             ZN_READ);
+        zn_inflight_end(&cache->inflight, read, iov, iovcnt, ret);
 
-        // Sadly, we have to remember to decrement the reader count here
-        g_atomic_int_dec_and_test(&cache->active_readers[result.value.location.zone]);
+        // Still in the epoch, so the zone can't have been reset yet
+        if (ret == 0) {
+            zn_cachemap_admit(&cache->cache_map, result.value.location, iov, iovcnt);
+            zn_cache_hit_done(cache, result.value.location, &total_start_time);
+        } else {
+            zn_cache_hit_failed(cache);
+        }
 
-        g_mutex_lock(&cache->ratio.lock);
-        cache->ratio.hits++;
-        g_mutex_unlock(&cache->ratio.lock);
+        return ret;
+    } else { // result.type == RESULT_COND
+        return zn_cache_miss(cache, id, iov, iovcnt, random_buffer, &total_start_time);
+    }
+}
 
-        TIME_NOW(&total_end_time);
-        t = TIME_DIFFERENCE_NSEC(total_start_time, total_end_time);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_HIT_LATENCY, t);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT, cache->chunk_sz);
+/**
+ * @struct zn_mget_batch
+ * @brief Tracks the misses of one `zn_cache_mget` call running on the miss pool
+ */
+struct zn_mget_batch {
+    GMutex lock;
+    GCond done;
+    uint32_t remaining; /**< Misses still being fetched */
+    uint32_t failed;    /**< Misses that couldn't be fetched */
+};
 
-        return data;
-    } else { // result.type == RESULT_COND
+/**
+ * @struct zn_mget_miss
+ * @brief A single miss of a `zn_cache_mget` call
+ */
+struct zn_mget_miss {
+    struct zn_mget_batch *batch;
+    uint32_t id;
+    const struct iovec *iov;
+    unsigned char *random_buffer;
+    struct timespec *start_time;
+};
 
-        // Repeatedly attempt to get an active zone. This function can fail when there all active
-        // zones are writing, so put this into a while loop.
-        struct zn_pair location;
-        while (true) {
+static void
+zn_cache_mget_miss_task(gpointer data, gpointer user_data) {
+    struct zn_cache *cache = user_data;
+    struct zn_mget_miss *miss = data;
 
-            enum zsm_get_active_zone_error ret = zsm_get_active_zone(&cache->zone_state, &location);
+    int ret = zn_cache_miss(cache, miss->id, miss->iov, 1, miss->random_buffer, miss->start_time);
 
-            if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
-                g_thread_yield();
-            } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
-                goto UNDO_MAP;
-            } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
-                zn_fg_evict(cache);
-            } else {
+    struct zn_mget_batch *batch = miss->batch;
+    g_mutex_lock(&batch->lock);
+    if (ret != 0) {
+        batch->failed++;
+    }
+    batch->remaining--;
+    if (batch->remaining == 0) {
+        g_cond_signal(&batch->done);
+    }
+    g_mutex_unlock(&batch->lock);
+}
+
+/**
+ * @struct zn_mget_hit
+ * @brief A hit of a `zn_cache_mget` call, sorted by its location
+ */
+struct zn_mget_hit {
+    struct zn_pair location;
+    uint32_t index; /**< Index of the item in the call */
+    uint32_t req;   /**< Read request the chunk is part of */
+};
+
+/**
+ * @brief Orders hits by their location on disk
+ */
+static int
+zn_mget_location_cmp(const void *a, const void *b) {
+    const struct zn_pair *la = &((const struct zn_mget_hit *) a)->location;
+    const struct zn_pair *lb = &((const struct zn_mget_hit *) b)->location;
+
+    if (la->zone != lb->zone) {
+        return la->zone < lb->zone ? -1 : 1;
+    }
+    if (la->chunk_offset != lb->chunk_offset) {
+        return la->chunk_offset < lb->chunk_offset ? -1 : 1;
+    }
+    return 0;
+}
+
+int
+zn_cache_mget(struct zn_cache *cache, const uint32_t *ids, uint32_t nr, const struct iovec *bufs,
+              unsigned char *random_buffer) {
+    struct timespec total_start_time;
+    TIME_NOW(&total_start_time);
+
+    struct zone_map_result *results = g_new(struct zone_map_result, nr);
+    zn_cachemap_find_batch(&cache->cache_map, ids, nr, results);
+
+    struct zn_mget_batch batch = {.remaining = 0, .failed = 0};
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.done);
+
+    struct zn_mget_hit *hits = g_new(struct zn_mget_hit, nr);
+    struct zn_mget_miss *misses = g_new(struct zn_mget_miss, nr);
+    uint32_t nr_hits = 0, nr_misses = 0;
+    for (uint32_t i = 0; i < nr; i++) {
+        assert(bufs[i].iov_len == cache->chunk_sz);
+        if (results[i].type == RESULT_LOC &&
+            zn_stage_read(cache, results[i].value.location, 0, &bufs[i], 1)) {
+            // Still staged, served from DRAM
+            zn_cache_hit_done(cache, results[i].value.location, &total_start_time);
+        } else if (results[i].type == RESULT_LOC) {
+            hits[nr_hits++] = (struct zn_mget_hit) {
+                .location = results[i].value.location,
+                .index = i,
+            };
+        } else if (results[i].type == RESULT_FULL) {
+            batch.failed++;
+        } else if (results[i].type == RESULT_COND) {
+            misses[nr_misses++] = (struct zn_mget_miss) {
+                .batch = &batch,
+                .id = ids[i],
+                .iov = &bufs[i],
+                .random_buffer = random_buffer,
+                .start_time = &total_start_time,
+            };
+        }
+    }
+
+    // Fetch the misses in the background while the hits are read
+    batch.remaining = nr_misses;
+    for (uint32_t i = 0; i < nr_misses; i++) {
+        g_thread_pool_push(cache->miss_pool, &misses[i], NULL);
+    }
+
+    // Read hits in disk order, chunks that are next to each other are read together
+    qsort(hits, nr_hits, sizeof(*hits), zn_mget_location_cmp);
+
+    struct zn_io_req *reqs = g_new0(struct zn_io_req, nr_hits);
+    struct iovec *hit_iov = g_new(struct iovec, nr_hits);
+    uint32_t nr_reqs = 0;
+    for (uint32_t h = 0; h < nr_hits;) {
+        struct zn_pair *start = &hits[h].location;
+        uint32_t run = 1;
+        hit_iov[h] = bufs[hits[h].index];
+        hits[h].req = nr_reqs;
+        while (h + run < nr_hits && run < IOV_MAX) {
+            struct zn_pair *next = &hits[h + run].location;
+            if (next->zone != start->zone || next->chunk_offset != start->chunk_offset + run) {
                 break;
             }
+            hit_iov[h + run] = bufs[hits[h + run].index];
+            hits[h + run].req = nr_reqs;
+            run++;
         }
 
-        // Emulates pulling in data from a remote source by filling in a cache entry with random
-        // bytes
-        data = zn_gen_write_buffer(cache, id, random_buffer);
+        reqs[nr_reqs++] = (struct zn_io_req) {
+            .op = ZN_IO_OP_READV,
+            .iov = &hit_iov[h],
+            .iovcnt = run,
+            .len = (size_t) run * cache->chunk_sz,
+            .offset = CHUNK_POINTER(cache->zone_size, cache->chunk_sz, start->chunk_offset,
+                                    start->zone),
+        };
+        h += run;
+    }
 
-        // Write buffer to disk, 4kb blocks at a time
-        unsigned long long wp =
-            CHUNK_POINTER(cache->zone_size, cache->chunk_sz, location.chunk_offset, location.zone);
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    int ret = zn_io_run(&cache->io, reqs, nr_reqs);
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
+    if (ret != 0) {
+        fprintf(stderr, "Couldn't read batch of %u chunks from fd\n", nr_hits);
+    }
 
-        struct timespec start_time, end_time;
-        TIME_NOW(&start_time);
-        int ret = zn_write_out(cache->fd, cache->chunk_sz, data, WRITE_GRANULARITY, wp);
-        TIME_NOW(&end_time);
-        double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
-        ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+    // Only hits whose read completed are accounted
+    for (uint32_t h = 0; h < nr_hits; h++) {
+        if (zn_io_req_ok(&reqs[hits[h].req])) {
+            zn_cache_hit_done(cache, hits[h].location, &total_start_time);
+        } else {
+            zn_cache_hit_failed(cache);
+        }
+    }
+
+    g_mutex_lock(&batch.lock);
+    while (batch.remaining > 0) {
+        g_cond_wait(&batch.done, &batch.lock);
+    }
+    g_mutex_unlock(&batch.lock);
+
+    // Entries someone else was writing, now that our own writes are done nothing can deadlock
+    for (uint32_t i = 0; i < nr; i++) {
+        if (results[i].type == RESULT_PENDING &&
+            zn_cache_get_into(cache, ids[i], &bufs[i], 1, random_buffer) != 0) {
+            batch.failed++;
+        }
+    }
+
+    if (batch.failed > 0) {
+        dbg_printf("Couldn't fetch %u misses\n", batch.failed);
+        ret = -1;
+    }
 
+    g_mutex_clear(&batch.lock);
+    g_cond_clear(&batch.done);
+    g_free(hit_iov);
+    g_free(reqs);
+    g_free(misses);
+    g_free(hits);
+    g_free(results);
+    return ret;
+}
+
+unsigned char *
+zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_buffer) {
+    unsigned char *data = zn_buffer_pool_get(&cache->buffers);
+    struct iovec iov = {.iov_base = data, .iov_len = cache->chunk_sz};
+
+    if (zn_cache_get_into(cache, id, &iov, 1, random_buffer) != 0) {
+        zn_buffer_pool_put(&cache->buffers, data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * @brief Fills `len` bytes of the emulated remote copy of a chunk, starting at byte `offset`
+ *
+ * Produces the same bytes as `zn_gen_write_data` without the remote read delay.
+ */
+static void
+zn_gen_write_range(struct zn_cache *cache, const struct zn_chunk_header *header, size_t offset,
+                   unsigned char *dst, size_t len, unsigned char *buffer) {
+    assert(offset + len <= cache->chunk_sz);
+    memcpy(dst, buffer + offset, len);
+    if (offset < sizeof(*header)) {
+        memcpy(dst, (const unsigned char *) header + offset, MIN(len, sizeof(*header) - offset));
+    }
+}
+
+/**
+ * @brief Fetches a missing chunk one segment at a time and streams part of it to `fn`
+ *
+ * The caller must have claimed `id` in the cache map. Each segment is written
+ * to the zone as soon as it is fetched, so only one segment of the chunk is in
+ * memory at a time. With zone append the chunk has to be written with a single
+ * command, so it is fetched into a whole chunk buffer instead.
+ *
+ * @return Non-zero on error, the claim is released either way
+ */
+static int
+zn_cache_stream_miss(struct zn_cache *cache, const uint32_t id, size_t offset, size_t len,
+                     unsigned char *segment, size_t segment_sz, zn_cache_stream_fn fn,
+                     void *user_data, unsigned char *random_buffer,
+                     struct timespec *total_start_time) {
+    if (cache->zone_append) {
+        unsigned char *data = zn_buffer_pool_get(&cache->buffers);
+        struct iovec iov = {.iov_base = data, .iov_len = cache->chunk_sz};
+        int ret = zn_cache_miss(cache, id, &iov, 1, random_buffer, total_start_time);
+        for (size_t pos = offset; ret == 0 && pos < offset + len; pos += segment_sz) {
+            ret = fn(data + pos, pos, MIN(segment_sz, offset + len - pos), user_data);
+        }
+        zn_buffer_pool_put(&cache->buffers, data);
+        return ret;
+    }
+
+    struct zn_pair location;
+    if (zn_cache_take_zone(cache, &location) != 0) {
+        goto UNDO_MAP;
+    }
+    location.id = id;
+
+    // Chunks staged in front of this one have to reach the zone first
+    if (zn_stage_flush(cache, location.zone) != 0) {
+        goto UNDO_ZONE_GET;
+    }
+
+    unsigned long long wp =
+        CHUNK_POINTER(cache->zone_size, cache->chunk_sz, location.chunk_offset, location.zone);
+    struct iovec seg_iov = {.iov_base = segment, .iov_len = segment_sz};
+    struct zn_io_req *reqs = g_new(struct zn_io_req, zn_io_iov_reqs(&cache->io, &seg_iov, 1));
+
+    // Emulates pulling in data from a remote source, the delay is paid once per chunk
+    g_usleep(ZN_READ_SLEEP_US);
+    struct zn_chunk_header header;
+    zn_chunk_header_init(&header, id, (uint32_t) cache->chunk_sz,
+                         zn_journal_next_generation(&cache->journal));
+
+    int ret = 0, fn_ret = 0;
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    for (size_t pos = 0; pos < cache->chunk_sz; pos += seg_iov.iov_len) {
+        seg_iov.iov_len = MIN(segment_sz, cache->chunk_sz - pos);
+        zn_gen_write_range(cache, &header, pos, segment, seg_iov.iov_len, random_buffer);
+
+        // Hand out the requested part of the segment before it is written. An error from `fn`
+        // only stops the streaming, the chunk is still cached.
+        if (fn_ret == 0 && pos < offset + len && pos + seg_iov.iov_len > offset) {
+            size_t from = MAX(pos, offset);
+            size_t to = MIN(pos + seg_iov.iov_len, offset + len);
+            fn_ret = fn(segment + (from - pos), from, to - from, user_data);
+        }
+
+        uint32_t nr = zn_io_prep_iov(&cache->io, reqs, ZN_IO_OP_WRITE, &seg_iov, 1, wp + pos, true);
+        ret = zn_io_run(&cache->io, reqs, nr);
         if (ret != 0) {
-            dbg_printf("Couldn't write to fd at wp=%llu, zone=%u, chunk=%u\n", wp, location.chunk_offset, location.zone);
-            goto UNDO_ZONE_GET;
+            break;
         }
+    }
+    if (ret == 0) {
+        ret = zn_io_sync(&cache->io);
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+    g_free(reqs);
 
-        g_mutex_lock(&cache->ratio.lock);
-        cache->ratio.misses++;
-        g_mutex_unlock(&cache->ratio.lock);
+    if (ret != 0) {
+        dbg_printf("Couldn't write to fd at zone=%u, chunk=%u\n", location.zone, location.chunk_offset);
+        goto UNDO_ZONE_GET;
+    }
 
-        // Update metadata
-        zsm_return_active_zone(&cache->zone_state, &location);
+    zn_cache_miss_done(cache, location, header.generation, false, NULL, 0, total_start_time);
+    return fn_ret;
 
-        cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_WRITE);
+UNDO_ZONE_GET:
+    if (zsm_failed_to_write(&cache->zone_state, location)) {
+        cache->eviction_policy.zone_full(cache->eviction_policy.data, location.zone);
+    }
+UNDO_MAP:
+    zn_cachemap_fail(&cache->cache_map, id);
 
-        zn_cachemap_insert(&cache->cache_map, id, location);
+    return -1;
+}
 
-        TIME_NOW(&total_end_time);
-        t = TIME_DIFFERENCE_NSEC(total_start_time, total_end_time);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT, cache->chunk_sz);
+int
+zn_cache_get_stream(struct zn_cache *cache, const uint32_t id, size_t offset, size_t len,
+                    unsigned char *segment, size_t segment_sz, zn_cache_stream_fn fn,
+                    void *user_data, unsigned char *random_buffer) {
+    assert(offset + len <= cache->chunk_sz);
+    assert(segment_sz > 0);
+#ifdef ZN_DIRECT_IO
+    // A miss writes the chunk to flash from `segment`
+    assert((uintptr_t) segment % ZN_BUFFER_ALIGN == 0 && segment_sz % ZN_BUFFER_ALIGN == 0);
+#endif
 
-        return data;
+    // PROFILE
+    struct timespec total_start_time;
+    TIME_NOW(&total_start_time);
 
-    UNDO_ZONE_GET:
-        zsm_failed_to_write(&cache->zone_state, location);
-    UNDO_MAP:
-        zn_cachemap_fail(&cache->cache_map, id);
+    struct zone_map_result result = zn_cachemap_find(&cache->cache_map, id);
+    if (result.type == RESULT_FULL) {
+        return -1;
+    }
+    if (result.type == RESULT_COND) {
+        return zn_cache_stream_miss(cache, id, offset, len, segment, segment_sz, fn, user_data,
+                                    random_buffer, &total_start_time);
+    }
 
-        return NULL;
+    if (result.type == RESULT_DATA) {
+        const unsigned char *data = g_bytes_get_data(result.data, NULL);
+        int ret = 0;
+        for (size_t pos = offset; ret == 0 && pos < offset + len; pos += segment_sz) {
+            size_t n = MIN(segment_sz, offset + len - pos);
+            memcpy(segment, data + pos, n);
+            ret = fn(segment, pos, n, user_data);
+        }
+        g_bytes_unref(result.data);
+        zn_cache_hit_done(cache, result.value.location, &total_start_time);
+        return ret;
+    }
+
+    // The epoch keeps the zone from being reset until the last segment is read
+    int ret = 0, read_ret = 0;
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    for (size_t pos = offset; ret == 0 && pos < offset + len; pos += segment_sz) {
+        struct iovec iov = {.iov_base = segment, .iov_len = MIN(segment_sz, offset + len - pos)};
+        ret = read_ret = zn_read_range_from_disk(cache, &result.value.location, pos, &iov, 1);
+        if (ret == 0) {
+            ret = fn(segment, pos, iov.iov_len, user_data);
+        }
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
+
+    // Only a failed read isn't accounted, an error from `fn` still read the chunk
+    if (read_ret == 0) {
+        zn_cache_hit_done(cache, result.value.location, &total_start_time);
+    } else {
+        zn_cache_hit_failed(cache);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Destination of a range get that missed
+ */
+struct zn_range_dest {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t offset; /**< Chunk offset of the first byte of `iov` */
+};
+
+static int
+zn_range_copy(const unsigned char *data, size_t offset, size_t len, void *user_data) {
+    struct zn_range_dest *dest = user_data;
+    zn_iov_fill(dest->iov, dest->iovcnt, offset - dest->offset, data, len);
+    return 0;
+}
+
+int
+zn_cache_get_range(struct zn_cache *cache, const uint32_t id, size_t offset,
+                   const struct iovec *iov, int iovcnt, unsigned char *random_buffer) {
+    size_t len = zn_io_iov_len(iov, iovcnt);
+    assert(offset + len <= cache->chunk_sz);
+
+    // PROFILE
+    struct timespec total_start_time;
+    TIME_NOW(&total_start_time);
+
+    struct zone_map_result result = zn_cachemap_find(&cache->cache_map, id);
+    if (result.type == RESULT_FULL) {
+        return -1;
+    }
+
+    if (result.type == RESULT_DATA) {
+        const unsigned char *data = g_bytes_get_data(result.data, NULL);
+        zn_iov_fill(iov, iovcnt, 0, data + offset, len);
+        g_bytes_unref(result.data);
+        zn_cache_hit_done(cache, result.value.location, &total_start_time);
+        return 0;
+    }
+
+    // Hits read only the requested bytes straight into `iov`
+    if (result.type == RESULT_LOC) {
+        struct timespec start_time, end_time;
+        TIME_NOW(&start_time);
+        int ret = zn_read_range_from_disk(cache, &result.value.location, offset, iov, iovcnt);
+        TIME_NOW(&end_time);
+        double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
+        ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
+
+        if (ret == 0) {
+            zn_cache_hit_done(cache, result.value.location, &total_start_time);
+        } else {
+            zn_cache_hit_failed(cache);
+        }
+
+        return ret;
     }
+
+    // Misses still cache the whole chunk, it passes through one bounded segment buffer
+    size_t segment_sz = MIN(cache->io.max_write, cache->chunk_sz);
+    unsigned char *segment = zn_buffer_alloc_aligned(segment_sz);
+    struct zn_range_dest dest = {.iov = iov, .iovcnt = iovcnt, .offset = offset};
+    int ret = zn_cache_stream_miss(cache, id, offset, len, segment, segment_sz, zn_range_copy,
+                                   &dest, random_buffer, &total_start_time);
+    free(segment);
+    return ret;
 }
 
+#ifdef ZN_ZONE_APPEND
+/**
+ * @brief Checks if chunks can be written to the device with a single zone append each
+ *
+ * @return true if zone append was enabled on the I/O engine
+ */
+static bool
+zn_cache_setup_zone_append(struct zn_cache *cache, struct zbd_info *info) {
+    uint64_t max_append = 0;
+    if (zone_append_max_bytes(cache->fd, &max_append) != 0 || max_append < cache->chunk_sz) {
+        fprintf(stderr,
+                "Zone append can't write a %zu byte chunk (limit %" PRIu64 "), "
+                "writers will take zones exclusively\n",
+                cache->chunk_sz, max_append);
+        return false;
+    }
+
+    if (info->lblock_size == 0 || cache->chunk_sz % info->lblock_size != 0) {
+        fprintf(stderr, "Chunk size is not a multiple of the logical block size, "
+                        "writers will take zones exclusively\n");
+        return false;
+    }
+
+    if (zn_io_zone_append_init(&cache->io, info->lblock_size) != 0) {
+        fprintf(stderr, "Zone append requires an NVMe namespace, "
+                        "writers will take zones exclusively\n");
+        return false;
+    }
+
+    return true;
+}
+#endif
+
 void
 zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, uint64_t zone_cap,
-              int fd, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
+              int fd, uint32_t nr_threads, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
               uint64_t workload_max, char *metrics_file) {
     cache->fd = fd;
     cache->chunk_sz = chunk_sz;
@@ -162,9 +1058,46 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
     cache->zone_size = info->zone_size;
     cache->max_zone_chunks = zone_cap / chunk_sz;
     cache->backend = backend;
-    cache->active_readers = malloc(sizeof(gint) * cache->nr_zones);
+    // Every chunk starts with its header
+    assert(chunk_sz > sizeof(struct zn_chunk_header));
+    zn_epoch_init(&cache->epoch);
+    zn_journal_init(&cache->journal);
     cache->reader.workload_buffer = workload_buffer;
     cache->reader.workload_max = workload_max;
+    zn_io_init(&cache->io, fd, ZN_IO_QUEUE_DEPTH);
+    zn_buffer_pool_init(&cache->buffers, chunk_sz, MAX(nr_threads, 1) * ZN_BUFFERS_PER_THREAD);
+
+    cache->miss_pool =
+        g_thread_pool_new(zn_cache_mget_miss_task, cache, MAX(nr_threads, 1), FALSE, NULL);
+    assert(cache->miss_pool);
+
+    cache->zone_append = false;
+#ifdef ZN_ZONE_APPEND
+    if (backend == ZE_BACKEND_ZNS) {
+        cache->zone_append = zn_cache_setup_zone_append(cache, info);
+    }
+#endif
+
+    // Without a write pointer, writers can fill a zone in parallel at the offsets they reserved
+    cache->shared_zones = cache->zone_append;
+#ifdef ZN_SHARED_ZONES
+    if (backend == ZE_BACKEND_BLOCK) {
+        cache->shared_zones = true;
+    }
+#endif
+
+    // Shared zones are written out of order, so they can't be staged in order
+    zn_stage_init(cache, cache->shared_zones ? 0 : ZN_STAGE_BUFFER_BYTES);
+
+    g_mutex_init(&cache->coalescer.lock);
+    g_cond_init(&cache->coalescer.cond);
+    cache->coalescer.pending = g_ptr_array_new();
+    cache->coalescer.leading = false;
+    cache->coalescer.fetching = 0;
+    // Appends can't be combined into one write, and staged chunks are already flushed together
+    cache->coalescer.max_chunks =
+        (cache->zone_append || zn_stage_enabled(cache)) ? 1 : ZN_WRITE_BATCH_CHUNKS;
+    cache->coalescer.window_us = ZN_WRITE_BATCH_WINDOW_US;
 
 #ifdef DEBUG
     printf("Initialized cache:\n");
@@ -173,13 +1106,27 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
     printf("\tzone_cap=%" PRIu64 "\n", cache->zone_cap);
     printf("\tmax_zone_chunks=%" PRIu64 "\n", cache->max_zone_chunks);
     printf("\tmax_nr_active_zones=%u\n", cache->max_nr_active_zones);
+    printf("\tzone_append=%s\n", cache->zone_append ? "true" : "false");
+    printf("\tshared_zones=%s\n", cache->shared_zones ? "true" : "false");
+    printf("\twrite_batch_chunks=%u\n", cache->coalescer.max_chunks);
+    printf("\tstage_chunks=%u\n", cache->stage_chunks);
+    printf("\tdram_tier_bytes=%llu\n", (unsigned long long) ZN_DRAM_TIER_BYTES);
+#endif
+
+    bool zone_affinity = false;
+#ifdef ZN_ZONE_AFFINITY
+    zone_affinity = true;
 #endif
 
     // Set up the data structures
-    zn_cachemap_init(&cache->cache_map, cache->nr_zones, cache->active_readers);
+    zn_dram_init(&cache->dram, ZN_DRAM_TIER_BYTES, chunk_sz, &cache->epoch);
+    zn_inflight_init(&cache->inflight);
+    zn_cachemap_init(&cache->cache_map, cache->nr_zones, cache->max_zone_chunks,
+                     &cache->epoch, &cache->dram);
     zn_evict_policy_init(&cache->eviction_policy, policy, cache);
     zsm_init(&cache->zone_state, cache->nr_zones, fd, zone_cap, cache->zone_size, chunk_sz,
-             cache->max_nr_active_zones, cache->backend);
+             cache->max_nr_active_zones, cache->backend, cache->shared_zones, cache->zone_append,
+             zone_affinity);
 
     cache->ratio.hits = 0;
     cache->ratio.misses = 0;
@@ -205,6 +1152,16 @@ zn_destroy_cache(struct zn_cache *cache) {
         zn_profiler_close(cache->profiler);
     }
 
+    g_thread_pool_free(cache->miss_pool, FALSE, TRUE);
+    zsm_destroy(&cache->zone_state);
+    zn_stage_destroy(cache);
+    // Staged chunks were flushed, the journal may refer to them
+    zn_journal_destroy(&cache->journal);
+    zn_dram_destroy(&cache->dram);
+    zn_inflight_destroy(&cache->inflight);
+    zn_epoch_destroy(&cache->epoch);
+    zn_buffer_pool_destroy(&cache->buffers);
+
     // TODO assert(!"Todo: clean up cache");
 
     /* g_hash_table_destroy(cache->zone_map); */
@@ -224,78 +1181,484 @@ zn_destroy_cache(struct zn_cache *cache) {
     /* g_mutex_clear(&cache->reader.lock); */
 }
 
-unsigned char *
-zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair) {
-    unsigned char *data = malloc(cache->chunk_sz);
-    if (data == NULL) {
-        nomem();
+/**
+ * @brief State of a journal replay
+ */
+struct zn_cache_replay {
+    struct zn_cache *cache;
+    uint32_t *written; /**< Per zone, one past the last chunk the journal wrote since its reset */
+};
+
+/**
+ * @brief Applies one journal record to the cache map
+ */
+static void
+zn_cache_replay_record(const struct zn_journal_record *record, void *user_data) {
+    struct zn_cache_replay *replay = user_data;
+    struct zn_cache *cache = replay->cache;
+
+    if (record->zone >= cache->nr_zones || record->chunk_offset >= cache->max_zone_chunks) {
+        dbg_printf("Skipping journal record for [%u,%u]\n", record->zone, record->chunk_offset);
+        return;
+    }
+
+    struct zn_pair location = {
+        .zone = record->zone, .chunk_offset = record->chunk_offset, .id = record->id};
+    switch (record->op) {
+        case ZN_JOURNAL_INSERT:
+            zn_cachemap_restore(&cache->cache_map, record->id, location);
+            replay->written[record->zone] =
+                MAX(replay->written[record->zone], record->chunk_offset + 1);
+            break;
+        case ZN_JOURNAL_CLEAR_CHUNK:
+            zn_cachemap_forget(&cache->cache_map, record->id, location);
+            break;
+        case ZN_JOURNAL_CLEAR_ZONE:
+            zn_cachemap_clear_zone(&cache->cache_map, record->zone);
+            replay->written[record->zone] = 0;
+            break;
+        default:
+            assert(!"Unknown journal record");
+    }
+}
+
+/**
+ * @brief Rebuilds the zone states and the eviction policy from the replayed cache map
+ *
+ * @return Number of chunks restored, -1 on error
+ */
+static int64_t
+zn_cache_restore_zones(struct zn_cache *cache, uint32_t *written) {
+    if (zsm_restore(&cache->zone_state, written) != 0) {
+        return -1;
+    }
+
+    int64_t nr_chunks = 0;
+    uint32_t *ids = g_new(uint32_t, cache->max_zone_chunks);
+    for (uint32_t zone = 0; zone < cache->nr_zones; zone++) {
+        zn_cachemap_zone_ids(&cache->cache_map, zone, ids);
+        for (uint32_t i = 0; i < cache->max_zone_chunks; i++) {
+            struct zn_pair location = {.zone = zone, .chunk_offset = i, .id = ids[i]};
+            if (i >= written[zone]) {
+                // Never reached the device, or the zone wasn't kept
+                if (ids[i] != ZN_CACHEMAP_NO_ID) {
+                    zn_cachemap_forget(&cache->cache_map, ids[i], location);
+                }
+            } else if (ids[i] != ZN_CACHEMAP_NO_ID) {
+                cache->eviction_policy.update_policy(cache->eviction_policy.data, location,
+                                                     ZN_WRITE);
+                nr_chunks++;
+            } else {
+                zsm_mark_chunk_invalid(&cache->zone_state, &location);
+            }
+        }
+
+        // Restored zones are full, they enter the policy in zone order
+        if (written[zone] > 0) {
+            cache->eviction_policy.zone_full(cache->eviction_policy.data, zone);
+        }
+    }
+    g_free(ids);
+    return nr_chunks;
+}
+
+int
+zn_cache_open_journal(struct zn_cache *cache, const char *path, bool warm) {
+    if (warm) {
+        struct timespec start_time, end_time;
+        TIME_NOW(&start_time);
+
+        struct zn_cache_replay replay = {
+            .cache = cache,
+            .written = g_new0(uint32_t, cache->nr_zones),
+        };
+        uint64_t generation = 0;
+        bool torn;
+        int64_t nr_records =
+            zn_journal_replay(path, zn_cache_replay_record, &replay, &generation, &torn);
+        int64_t nr_chunks = nr_records < 0 ? -1 : zn_cache_restore_zones(cache, replay.written);
+        g_free(replay.written);
+        if (nr_chunks < 0) {
+            fprintf(stderr, "Couldn't restore the cache from journal %s\n", path);
+            return -1;
+        }
+        // Chunks written from now on are newer than any chunk on the device
+        cache->journal.generation = generation;
+
+        TIME_NOW(&end_time);
+        printf("Restored %" PRId64 " chunks from %" PRId64 " journal records in %0.2fs\n",
+               nr_chunks, nr_records, TIME_DIFFERENCE_SEC(start_time, end_time));
+    }
+
+    return zn_journal_compact(&cache->journal, path, cache->chunk_sz, cache->zone_cap,
+                              cache->nr_zones, zn_cache_journal_fill, cache);
+}
+
+/**
+ * @struct zn_cache_scan
+ * @brief State shared by the threads of a zone scan
+ */
+struct zn_cache_scan {
+    struct zn_cache *cache;
+    const uint32_t *extent; /**< Per zone, chunks that may have been written */
+    uint32_t *written;      /**< Per zone, one past the last chunk with a valid header */
+    uint64_t *generations;  /**< Generation of the mapped copy at each location */
+    gint nr_failed;         /**< Zones that couldn't be read */
+};
+
+/**
+ * @brief Finds how many chunks of each zone can hold data
+ *
+ * Zones are only read up to their write pointer. The block backend has no
+ * write pointers, every chunk is read.
+ *
+ * @return Non-zero if the zones couldn't be reported
+ */
+static int
+zn_cache_scan_extents(struct zn_cache *cache, uint32_t *extent) {
+    if (cache->backend != ZE_BACKEND_ZNS) {
+        for (uint32_t zone = 0; zone < cache->nr_zones; zone++) {
+            extent[zone] = cache->max_zone_chunks;
+        }
+        return 0;
+    }
+
+    struct zbd_zone *zones = g_new(struct zbd_zone, cache->nr_zones);
+    unsigned int nr_zones = cache->nr_zones;
+    if (zbd_report_zones(cache->fd, 0, (off_t) cache->nr_zones * cache->zone_size, ZBD_RO_ALL,
+                         zones, &nr_zones) != 0 ||
+        nr_zones < cache->nr_zones) {
+        fprintf(stderr, "Couldn't report zones to scan\n");
+        g_free(zones);
+        return -1;
+    }
+
+    for (uint32_t zone = 0; zone < cache->nr_zones; zone++) {
+        // A chunk cut off by the write pointer was never completed
+        uint64_t on_device =
+            zbd_zone_full(&zones[zone])
+                ? cache->max_zone_chunks
+                : (zbd_zone_wp(&zones[zone]) - zbd_zone_start(&zones[zone])) / cache->chunk_sz;
+        extent[zone] = (uint32_t) MIN(on_device, cache->max_zone_chunks);
+    }
+    g_free(zones);
+    return 0;
+}
+
+/**
+ * @brief Reads the chunk headers of one zone and maps the chunks they describe
+ *
+ * Small chunks are read whole in large sequential reads, of large chunks
+ * only the block holding the header is read. Either way the reads of a zone
+ * are submitted together, so each thread keeps its queue full.
+ */
+static void
+zn_cache_scan_zone(gpointer data, gpointer user_data) {
+    uint32_t zone = *(uint32_t *) data;
+    struct zn_cache_scan *scan = user_data;
+    struct zn_cache *cache = scan->cache;
+    uint32_t extent = scan->extent[zone];
+
+    bool headers_only = cache->chunk_sz >= ZN_SCAN_HEADER_READ_MIN;
+    size_t stride = headers_only ? ZN_BUFFER_ALIGN : cache->chunk_sz;
+    uint32_t per_read = headers_only ? MAX(cache->io.queue_depth, 1)
+                                     : MAX(ZN_SCAN_READ_BYTES / cache->chunk_sz, 1);
+    per_read = MIN(per_read, extent);
+
+    unsigned char *buf = zn_buffer_alloc_aligned(per_read * stride);
+    struct iovec iov = {.iov_base = buf, .iov_len = per_read * stride};
+    struct zn_io_req *reqs =
+        g_new(struct zn_io_req, headers_only ? per_read : zn_io_iov_reqs(&cache->io, &iov, 1));
+
+    for (uint32_t first = 0; first < extent; first += per_read) {
+        uint32_t nr_chunks = MIN(per_read, extent - first);
+        uint32_t nr = nr_chunks;
+        if (headers_only) {
+            for (uint32_t i = 0; i < nr_chunks; i++) {
+                reqs[i] = (struct zn_io_req) {
+                    .op = ZN_IO_OP_READ,
+                    .buf = buf + i * stride,
+                    .len = ZN_BUFFER_ALIGN,
+                    .offset = CHUNK_POINTER(cache->zone_size, cache->chunk_sz, first + i, zone),
+                };
+            }
+        } else {
+            iov.iov_len = nr_chunks * stride;
+            nr = zn_io_prep_iov(&cache->io, reqs, ZN_IO_OP_READ, &iov, 1,
+                                CHUNK_POINTER(cache->zone_size, cache->chunk_sz, first, zone),
+                                false);
+        }
+
+        if (zn_io_run(&cache->io, reqs, nr) != 0) {
+            fprintf(stderr, "Couldn't scan zone %u\n", zone);
+            g_atomic_int_inc(&scan->nr_failed);
+            break;
+        }
+
+        for (uint32_t i = 0; i < nr_chunks; i++) {
+            struct zn_chunk_header header;
+            memcpy(&header, buf + i * stride, sizeof(header));
+            if (!zn_chunk_header_valid(&header) || header.length != cache->chunk_sz ||
+                header.id == ZN_CACHEMAP_NO_ID) {
+                continue;
+            }
+
+            // A copy that loses to a newer one is left as an invalid chunk
+            struct zn_pair location = {.zone = zone, .chunk_offset = first + i, .id = header.id};
+            (void) zn_cachemap_restore_newest(&cache->cache_map, header.id, location,
+                                              header.generation, scan->generations);
+            scan->written[zone] = first + i + 1;
+        }
+    }
+
+    g_free(reqs);
+    free(buf);
+}
+
+int
+zn_cache_scan(struct zn_cache *cache) {
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+
+    uint32_t *extent = g_new0(uint32_t, cache->nr_zones);
+    if (zn_cache_scan_extents(cache, extent) != 0) {
+        g_free(extent);
+        return -1;
+    }
+
+    struct zn_cache_scan scan = {
+        .cache = cache,
+        .extent = extent,
+        .written = g_new0(uint32_t, cache->nr_zones),
+        .generations = g_new0(uint64_t, cache->nr_zones * cache->max_zone_chunks),
+        .nr_failed = 0,
+    };
+
+    uint32_t *zones = g_new(uint32_t, cache->nr_zones);
+    uint64_t bytes_read = 0;
+    size_t stride = cache->chunk_sz >= ZN_SCAN_HEADER_READ_MIN ? ZN_BUFFER_ALIGN : cache->chunk_sz;
+    GThreadPool *pool = g_thread_pool_new(zn_cache_scan_zone, &scan, ZN_SCAN_ZONES, FALSE, NULL);
+    uint32_t nr_scanned = 0;
+    for (uint32_t zone = 0; zone < cache->nr_zones; zone++) {
+        if (extent[zone] == 0) {
+            continue;
+        }
+        zones[nr_scanned++] = zone;
+        bytes_read += (uint64_t) extent[zone] * stride;
+        g_thread_pool_push(pool, &zones[nr_scanned - 1], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    int64_t nr_chunks = -1;
+    if (scan.nr_failed == 0) {
+        nr_chunks = zn_cache_restore_zones(cache, scan.written);
+    }
+
+    // Chunks written from now on are newer than any chunk on the device
+    uint64_t generation = cache->journal.generation;
+    for (uint64_t i = 0; i < cache->nr_zones * cache->max_zone_chunks; i++) {
+        generation = MAX(generation, scan.generations[i] + 1);
+    }
+    cache->journal.generation = generation;
+
+    g_free(zones);
+    g_free(scan.generations);
+    g_free(scan.written);
+    g_free(extent);
+    if (nr_chunks < 0) {
+        fprintf(stderr, "Couldn't rebuild the cache from the device\n");
+        return -1;
+    }
+
+    TIME_NOW(&end_time);
+    double seconds = TIME_DIFFERENCE_SEC(start_time, end_time);
+    printf("Rebuilt %" PRId64 " chunks from %u zones in %0.2fs (%0.2f MiB/s)\n", nr_chunks,
+           nr_scanned, seconds, seconds > 0 ? (double) bytes_read / (1024 * 1024) / seconds : 0);
+    return 0;
+}
+
+void
+zn_cache_release(struct zn_cache *cache, unsigned char *data) {
+    zn_buffer_pool_put(&cache->buffers, data);
+}
+
+int
+zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair, const struct iovec *iov,
+                  int iovcnt) {
+    return zn_read_range_from_disk(cache, zone_pair, 0, iov, iovcnt);
+}
+
+#ifdef ZN_DIRECT_IO
+/**
+ * @brief Checks if a read can be passed to an O_DIRECT fd as it is
+ */
+static bool
+zn_read_aligned(size_t offset, const struct iovec *iov, int iovcnt) {
+    if (offset % ZN_BUFFER_ALIGN != 0) {
+        return false;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if ((uintptr_t) iov[i].iov_base % ZN_BUFFER_ALIGN != 0 ||
+            iov[i].iov_len % ZN_BUFFER_ALIGN != 0) {
+            return false;
+        }
     }
+    return true;
+}
+
+/**
+ * @brief Reads the aligned blocks around a range into a pooled buffer and copies the range out
+ */
+static int
+zn_read_range_bounced(struct zn_cache *cache, struct zn_pair *zone_pair, size_t offset,
+                      const struct iovec *iov, int iovcnt) {
+    size_t len = zn_io_iov_len(iov, iovcnt);
+    size_t start = offset - (offset % ZN_BUFFER_ALIGN);
+    size_t end = MIN((offset + len + ZN_BUFFER_ALIGN - 1) / ZN_BUFFER_ALIGN * ZN_BUFFER_ALIGN,
+                     cache->chunk_sz);
+
+    unsigned char *bounce = zn_buffer_pool_get(&cache->buffers);
+    struct iovec bounce_iov = {.iov_base = bounce, .iov_len = end - start};
+    int ret = zn_read_range_from_disk(cache, zone_pair, start, &bounce_iov, 1);
+    if (ret == 0) {
+        zn_iov_fill(iov, iovcnt, 0, bounce + (offset - start), len);
+    }
+    zn_buffer_pool_put(&cache->buffers, bounce);
+    return ret;
+}
+#endif
+
+int
+zn_read_range_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair, size_t offset,
+                        const struct iovec *iov, int iovcnt) {
+    assert(offset + zn_io_iov_len(iov, iovcnt) <= cache->chunk_sz);
+
+    // Chunks that haven't been flushed yet are served from DRAM
+    if (zn_stage_read(cache, *zone_pair, offset, iov, iovcnt)) {
+        return 0;
+    }
+
+#ifdef ZN_DIRECT_IO
+    // O_DIRECT rejects transfers that aren't block aligned, those go through a bounce buffer
+    if (!zn_read_aligned(offset, iov, iovcnt)) {
+        return zn_read_range_bounced(cache, zone_pair, offset, iov, iovcnt);
+    }
+#endif
 
     unsigned long long wp =
-        CHUNK_POINTER(cache->zone_size, cache->chunk_sz, zone_pair->chunk_offset, zone_pair->zone);
+        CHUNK_POINTER(cache->zone_size, cache->chunk_sz, zone_pair->chunk_offset, zone_pair->zone) +
+        offset;
 
     dbg_printf("[%u,%u] read from write pointer: %llu\n", zone_pair->zone, zone_pair->chunk_offset,
                wp);
 
-    size_t b = pread(cache->fd, data, cache->chunk_sz, wp);
-    if (b != cache->chunk_sz) {
+    struct zn_io_req *reqs = g_new(struct zn_io_req, zn_io_iov_reqs(&cache->io, iov, iovcnt));
+    uint32_t nr = zn_io_prep_iov(&cache->io, reqs, ZN_IO_OP_READ, iov, iovcnt, wp, false);
+
+    int ret = zn_io_run(&cache->io, reqs, nr);
+    if (ret != 0) {
         fprintf(stderr, "Couldn't read from fd\n");
-        free(data);
-        return NULL;
     }
 
-    return data;
+    g_free(reqs);
+    return ret;
+}
+
+int
+zn_write_out(struct zn_io *io, const struct iovec *iov, int iovcnt, unsigned long long wp_start) {
+    struct zn_io_req *reqs = g_new(struct zn_io_req, zn_io_iov_reqs(io, iov, iovcnt));
+    uint32_t nr = zn_io_prep_iov(io, reqs, ZN_IO_OP_WRITE, iov, iovcnt, wp_start, true);
+
+    int ret = zn_io_run(io, reqs, nr);
+    if (ret == 0) {
+        ret = zn_io_sync(io);
+    }
+
+    if (ret != 0) {
+        dbg_printf("Couldn't write to fd=%d at offset=%llu\n", io->fd, wp_start);
+    }
+
+    g_free(reqs);
+    return ret;
 }
 
 int
-zn_write_out(int fd, size_t to_write, const unsigned char *buffer, ssize_t write_size,
-             unsigned long long wp_start) {
-    ssize_t bytes_written;
-    size_t total_written = 0;
-
-    errno = 0;
-    while (total_written < to_write) {
-        bytes_written = pwrite(fd, buffer + total_written, write_size, wp_start + total_written);
-        fsync(fd);
-        // dbg_printf("Wrote %ld bytes to fd at offset=%llu\n", bytes_written,
-        // wp_start+total_written);
-        if ((bytes_written == -1) || (errno != 0)) {
-            dbg_printf("Error: %s\n", strerror(errno));
-            dbg_printf("Couldn't write to fd=%d\n", fd);
+zn_cache_write_chunk(struct zn_cache *cache, struct zn_pair *location, const struct iovec *iov,
+                     int iovcnt) {
+    if (cache->zone_append) {
+        assert(zn_io_iov_len(iov, iovcnt) == cache->chunk_sz);
+
+        // A zone append takes a single buffer, gather scattered chunks first
+        unsigned char *data = iov[0].iov_base;
+        if (iovcnt > 1) {
+            data = zn_buffer_pool_get(&cache->buffers);
+            size_t copied = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                memcpy(data + copied, iov[i].iov_base, iov[i].iov_len);
+                copied += iov[i].iov_len;
+            }
+        }
+
+        uint64_t zone_start = CHUNK_POINTER(cache->zone_size, cache->chunk_sz, 0, location->zone);
+        uint64_t written = 0;
+        int ret = zn_io_zone_append(&cache->io, data, cache->chunk_sz, zone_start, &written);
+        if (iovcnt > 1) {
+            zn_buffer_pool_put(&cache->buffers, data);
+        }
+        if (ret != 0) {
             return -1;
         }
-        total_written += bytes_written;
-        // dbg_printf("total_written=%ld bytes of %zu\n", total_written, to_write);
+
+        assert(written >= zone_start);
+        assert((written - zone_start) % cache->chunk_sz == 0);
+        location->chunk_offset = (written - zone_start) / cache->chunk_sz;
+        if (zn_io_sync(&cache->io) != 0) {
+            return -1;
+        }
+        dbg_printf("[%u,%u] appended at %" PRIu64 "\n", location->zone, location->chunk_offset,
+                   written);
+        return 0;
     }
-    return 0;
-}
 
-unsigned char *
-zn_gen_write_buffer(struct zn_cache *cache, uint32_t zone_id, unsigned char *buffer) {
-    unsigned char *data = malloc(cache->chunk_sz);
-    if (data == NULL) {
-        nomem();
+    // Staged chunks come first in the zone
+    if (zn_stage_flush(cache, location->zone) != 0) {
+        return -1;
     }
 
-    memcpy(data, buffer, cache->chunk_sz);
+    unsigned long long wp =
+        CHUNK_POINTER(cache->zone_size, cache->chunk_sz, location->chunk_offset, location->zone);
+    return zn_write_out(&cache->io, iov, iovcnt, wp);
+}
+
+uint64_t
+zn_gen_write_data(struct zn_cache *cache, uint32_t id, const struct iovec *iov, int iovcnt,
+                  unsigned char *buffer) {
     // Metadata
-    memcpy(data, &zone_id, sizeof(uint32_t));
+    struct zn_chunk_header header;
+    zn_chunk_header_init(&header, id, (uint32_t) cache->chunk_sz,
+                         zn_journal_next_generation(&cache->journal));
+    zn_iov_fill(iov, iovcnt, 0, (const unsigned char *) &header, sizeof(header));
+    zn_iov_fill(iov, iovcnt, sizeof(header), buffer + sizeof(header),
+                cache->chunk_sz - sizeof(header));
 
     g_usleep(ZN_READ_SLEEP_US);
-
-    return data;
+    return header.generation;
 }
 
 int
 zn_validate_read(struct zn_cache *cache, unsigned char *data, uint32_t id, unsigned char *compare_buffer) {
-    uint32_t read_id;
-    memcpy(&read_id, data, sizeof(uint32_t));
+    struct zn_chunk_header header;
+    memcpy(&header, data, sizeof(header));
+    uint32_t read_id = header.id;
+    if (!zn_chunk_header_valid(&header) || header.length != cache->chunk_sz) {
+        dbg_printf("Invalid chunk header for id(%u)\n", id);
+        return -1;
+    }
     if (read_id != id) {
         dbg_printf("Invalid read_id(%u)!=id(%u)\n", read_id, id);
         return -1;
     }
-    // 4 bytes for int
-    for (uint32_t i = sizeof(uint32_t); i < cache->chunk_sz; i++) {
+    for (uint32_t i = sizeof(header); i < cache->chunk_sz; i++) {
         if (data[i] != compare_buffer[i]) {
             dbg_printf("data[%d]!=RANDOM_DATA[%d]\n", read_id, id);
             return -1;
@@ -7,197 +7,683 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <znutil.h>
 
 void
-zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr) {
-    g_mutex_init(&map->cache_map_mutex);
-
-    map->zone_map = g_hash_table_new(g_direct_hash, g_direct_equal);
-    assert(map->zone_map);
+zn_cachemap_init(struct zn_cachemap *map, const int num_zones, uint64_t max_zone_chunks,
+                 struct zn_epoch *epoch, struct zn_dram_tier *dram) {
+    // Every chunk the cache can hold, with headroom for shards that get more than their share
+    // and for entries that are still being written
+    uint64_t per_shard = ((uint64_t) num_zones * max_zone_chunks) / ZN_CACHEMAP_SHARDS;
+    per_shard += per_shard / 4 + 64;
+
+    for (uint32_t i = 0; i < ZN_CACHEMAP_SHARDS; i++) {
+        struct zn_cachemap_shard *shard = &map->shards[i];
+        g_mutex_init(&shard->lock);
+        zn_index_init(&shard->index, per_shard);
+        assert(shard->index.slots);
+
+        for (uint32_t w = 0; w <= ZN_CACHEMAP_WAIT_SLOTS; w++) {
+            g_cond_init(&shard->waits[w].cond);
+            shard->waits[w].waiters = 0;
+            shard->waits[w].resolved = false;
+            shard->waits[w].data = NULL;
+        }
+        for (uint32_t w = 0; w < ZN_CACHEMAP_WAIT_SLOTS; w++) {
+            shard->free_waits[w] = w;
+        }
+        shard->nr_free_waits = ZN_CACHEMAP_WAIT_SLOTS;
+    }
 
-    map->data_map = g_new(GHashTable *, num_zones);
+    // Zone, chunk → Data ID
+    map->max_zone_chunks = max_zone_chunks;
+    map->data_map = g_new(uint32_t, (uint64_t) num_zones * max_zone_chunks);
     assert(map->data_map);
+    for (uint64_t i = 0; i < (uint64_t) num_zones * max_zone_chunks; i++) {
+        map->data_map[i] = ZN_CACHEMAP_NO_ID;
+    }
 
-    // Zone → Data ID
+    map->zone_locks = g_new(GMutex, num_zones);
+    assert(map->zone_locks);
     for (int i = 0; i < num_zones; i++) {
-        map->data_map[i] = g_hash_table_new(g_direct_hash, g_direct_equal); // Chunk -> data ID
-        assert(map->data_map[i]);
+        g_mutex_init(&map->zone_locks[i]);
     }
 
-    map->active_readers = active_readers_arr;
+    map->epoch = epoch;
+    map->dram = dram;
+}
+
+/**
+ * @brief Shard responsible for a data ID
+ *
+ * IDs are multiplied by a large odd constant first, so sequential IDs spread over all shards.
+ */
+static inline uint32_t
+zn_cachemap_shard_index(const uint32_t data_id) {
+    return (data_id * 2654435761u) >> (32 - ZN_CACHEMAP_SHARD_BITS);
+}
+
+static inline struct zn_cachemap_shard *
+zn_cachemap_shard(struct zn_cachemap *map, const uint32_t data_id) {
+    return &map->shards[zn_cachemap_shard_index(data_id)];
+}
+
+/**
+ * @brief Reverse map entry of a chunk
+ */
+static inline uint32_t *
+zn_cachemap_data_id(struct zn_cachemap *map, uint32_t zone, uint32_t chunk_offset) {
+    assert(chunk_offset < map->max_zone_chunks);
+    return &map->data_map[(uint64_t) zone * map->max_zone_chunks + chunk_offset];
+}
+
+static inline struct zone_map_result
+zn_cachemap_loc_result(const uint32_t data_id, const struct zn_index_entry *entry) {
+    return (struct zone_map_result) {
+        .value.location = {.zone = entry->zone, .chunk_offset = entry->chunk_offset, .id = data_id},
+        .type = RESULT_LOC,
+    };
 }
 
+/**
+ * @brief Looks up a cached ID without the shard lock, entering an epoch on a hit
+ *
+ * @return true if the ID is on disk
+ */
+static bool
+zn_cachemap_find_fast(struct zn_cachemap *map, struct zn_cachemap_shard *shard,
+                      const uint32_t data_id, struct zone_map_result *result) {
+    struct zn_index_entry entry;
+    uint64_t slot;
+
+    // Entered before the lookup, so a zone cleared after it is found isn't reset under us
+    zn_epoch_enter(map->epoch);
+    if (zn_index_lookup(&shard->index, data_id, &entry, &slot) &&
+        zn_index_entry_state(&entry) == ZN_INDEX_LOC) {
+        *result = zn_cachemap_loc_result(data_id, &entry);
+        return true;
+    }
+    zn_epoch_exit(map->epoch);
+    return false;
+}
+
+/**
+ * @brief Returns a wait slot to the pool
+ */
 static void
-free_cond_var(GCond *cond) {
-    g_cond_clear(cond);
+zn_cachemap_free_wait(struct zn_cachemap_shard *shard, uint32_t w) {
+    struct zn_wait_slot *slot = &shard->waits[w];
+    if (slot->data != NULL) {
+        g_bytes_unref(slot->data);
+        slot->data = NULL;
+    }
+    shard->free_waits[shard->nr_free_waits++] = w;
+}
+
+/**
+ * @brief Sleeps until the pending entry of `data_id` is resolved, or a spurious wakeup
+ *
+ * Called with the shard lock held, which is released while sleeping.
+ *
+ * @param[out] location Where the entry was written, if its writer published the data
+ * @return Reference to the data published by the writer, or NULL
+ */
+static GBytes *
+zn_cachemap_wait(struct zn_cachemap_shard *shard, const uint32_t data_id,
+                 const struct zn_index_entry *entry, struct zn_pair *location) {
+    uint32_t w = entry->zone;
+    if (w == ZN_CACHEMAP_NO_WAIT) {
+        // First waiter, attach a slot to the entry
+        w = shard->nr_free_waits > 0 ? shard->free_waits[--shard->nr_free_waits]
+                                     : ZN_CACHEMAP_WAIT_OVERFLOW;
+        shard->waits[w].resolved = false;
+        zn_index_update(&shard->index, data_id, ZN_INDEX_PENDING, w, 0);
+    }
+
+    struct zn_wait_slot *slot = &shard->waits[w];
+    slot->waiters++;
+    g_cond_wait(&slot->cond, &shard->lock);
+    slot->waiters--;
+
+    GBytes *data = NULL;
+    if (w != ZN_CACHEMAP_WAIT_OVERFLOW && slot->resolved) {
+        if (slot->data != NULL) {
+            data = g_bytes_ref(slot->data);
+            *location = slot->location;
+        }
+        if (slot->waiters == 0) {
+            zn_cachemap_free_wait(shard, w);
+        }
+    }
+    return data;
+}
+
+/**
+ * @brief Checks if anyone waits for a pending entry on a slot that can carry its data
+ */
+static bool
+zn_cachemap_has_waiters(struct zn_cachemap_shard *shard, const struct zn_index_entry *entry) {
+    uint32_t w = entry->zone;
+    return w != ZN_CACHEMAP_NO_WAIT && w != ZN_CACHEMAP_WAIT_OVERFLOW &&
+           shard->waits[w].waiters > 0;
+}
+
+/**
+ * @brief Wakes the threads waiting for a pending entry that was just written or failed
+ *
+ * Called with the shard lock held.
+ *
+ * @param data Copy of the chunk for the waiters (may be NULL), the slot takes the reference
+ * @param location Where the chunk was written
+ */
+static void
+zn_cachemap_wake(struct zn_cachemap_shard *shard, const struct zn_index_entry *entry,
+                 GBytes *data, struct zn_pair location) {
+    uint32_t w = entry->zone;
+    if (w == ZN_CACHEMAP_NO_WAIT || w == ZN_CACHEMAP_WAIT_OVERFLOW) {
+        // Overflow waiters belong to different entries, they read the data themselves
+        if (data != NULL) {
+            g_bytes_unref(data);
+        }
+        if (w == ZN_CACHEMAP_WAIT_OVERFLOW) {
+            g_cond_broadcast(&shard->waits[w].cond);
+        }
+        return;
+    }
+
+    struct zn_wait_slot *slot = &shard->waits[w];
+    slot->data = data;
+    slot->location = location;
+    slot->resolved = true;
+    g_cond_broadcast(&slot->cond);
+    if (slot->waiters == 0) {
+        zn_cachemap_free_wait(shard, w);
+    }
 }
 
 struct zone_map_result
 zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id) {
     assert(map);
 
-    g_mutex_lock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+
+    // Hits don't take a lock
+    struct zone_map_result result;
+    if (zn_cachemap_find_fast(map, shard, data_id, &result)) {
+        return result;
+    }
+
+    g_mutex_lock(&shard->lock);
 
     // Loop for spurious wakeups
     while (true) {
+        struct zn_index_entry entry;
+        uint64_t slot;
 
         // We found an entry
-        if (g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id))) {
-
-            struct zone_map_result *lookup =
-                g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-
-            // Releases the lock and waits until it is signalled again
-            if (lookup->type == RESULT_COND) {
-
-                // Increment the rc before sleeping on it
-                GCond *cond = lookup->value.write_finished;
-                g_atomic_rc_box_acquire(cond);
-                g_cond_wait(cond, &map->cache_map_mutex);
-                g_atomic_rc_box_release_full(cond, (GDestroyNotify) free_cond_var);
-
+        if (zn_index_lookup(&shard->index, data_id, &entry, &slot)) {
+
+            // Releases the lock and waits until it is signalled again, then checks the index
+            // again since the entry may have been written, failed or evicted in the meantime
+            if (zn_index_entry_state(&entry) == ZN_INDEX_PENDING) {
+                struct zn_pair location;
+                GBytes *data = zn_cachemap_wait(shard, data_id, &entry, &location);
+                if (data == NULL) {
+                    continue;
+                }
+
+                // Only use the copy while the chunk is still cached where it was written, so
+                // the caller's epoch and eviction bookkeeping stay accurate
+                if (zn_index_lookup(&shard->index, data_id, &entry, &slot) &&
+                    zn_index_entry_state(&entry) == ZN_INDEX_LOC && entry.zone == location.zone &&
+                    entry.chunk_offset == location.chunk_offset) {
+                    zn_epoch_enter(map->epoch);
+                    g_mutex_unlock(&shard->lock);
+                    struct zone_map_result result = zn_cachemap_loc_result(data_id, &entry);
+                    result.type = RESULT_DATA;
+                    result.data = data;
+                    return result;
+                }
+                g_bytes_unref(data);
                 continue;
-            } else { // Found the entry, increment reader and return it
-                g_atomic_int_inc(&map->active_readers[lookup->value.location.zone]);
-                g_mutex_unlock(&map->cache_map_mutex);
-                return *lookup;
+            } else { // Found the entry, enter an epoch and return it
+                // The zone can only be cleared after the shard lock is dropped, so it is
+                // retired after the epoch was entered
+                zn_epoch_enter(map->epoch);
+                g_mutex_unlock(&shard->lock);
+                return zn_cachemap_loc_result(data_id, &entry);
             }
 
         } else { // The thread needs to write an entry.
 
-            // Insert a temporary condition for now, and the thread now needs to write it
-            struct zone_map_result *wait_cond = g_new0(struct zone_map_result, 1);
-            wait_cond->type = RESULT_COND;
-
-            // Create a reference counted condition variable
-            wait_cond->value.write_finished = g_atomic_rc_box_new(GCond);
-            g_cond_init(wait_cond->value.write_finished);
-
-            g_hash_table_insert(map->zone_map, GINT_TO_POINTER(data_id), wait_cond);
-            g_mutex_unlock(&map->cache_map_mutex);
-            return *wait_cond;
-
-            // Note that the lifetimes of the condition variable and
-            // zone_map_result are different.
-            //
-            // It is unknown how many threads are waiting for the
-            // entry at the same time, so the cv in general cannot be
-            // freed deterministically. So we decouple the lifetimes
-            // by creating an rc'ed cv.
-            //
-            // There are two situations in which the cv outlives the
-            // zone_map_result. The first situation is when the
-            // writing thread calls zn_cachemap_insert and overwrites
-            // the entry while there are threads still waiting on the
-            // cv. The second situation occurs when the eviction
-            // thread erases the zone_map_result during eviction. To
-            // avoid checking a freed zone_map_result, threads recheck
-            // the entire hash table for the data, not the entry that
-            // contained the initial zone_map_result.
+            // Insert a pending entry for now, and the thread now needs to write it
+            int ret =
+                zn_index_insert(&shard->index, data_id, ZN_INDEX_PENDING, ZN_CACHEMAP_NO_WAIT, 0);
+            g_mutex_unlock(&shard->lock);
+            if (ret != 0) {
+                fprintf(stderr, "Cache map shard is full, can't claim id=%u\n", data_id);
+                return (struct zone_map_result) {.type = RESULT_FULL};
+            }
+            return (struct zone_map_result) {.type = RESULT_COND};
         }
     };
 }
 
 void
-zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location) {
+zn_cachemap_find_batch(struct zn_cachemap *map, const uint32_t *data_ids, uint32_t nr,
+                       struct zone_map_result *results) {
     assert(map);
 
-    g_mutex_lock(&map->cache_map_mutex);
+    for (uint32_t i = 0; i < nr; i++) {
+        struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_ids[i]);
+        if (zn_cachemap_find_fast(map, shard, data_ids[i], &results[i])) {
+            continue;
+        }
+
+        g_mutex_lock(&shard->lock);
+
+        struct zn_index_entry entry;
+        uint64_t slot;
+        if (!zn_index_lookup(&shard->index, data_ids[i], &entry, &slot)) {
+            // Claim it, same as zn_cachemap_find
+            if (zn_index_insert(&shard->index, data_ids[i], ZN_INDEX_PENDING,
+                                ZN_CACHEMAP_NO_WAIT, 0) != 0) {
+                fprintf(stderr, "Cache map shard is full, can't claim id=%u\n", data_ids[i]);
+                results[i] = (struct zone_map_result) {.type = RESULT_FULL};
+            } else {
+                results[i] = (struct zone_map_result) {.type = RESULT_COND};
+            }
+        } else if (zn_index_entry_state(&entry) == ZN_INDEX_PENDING) {
+            results[i] = (struct zone_map_result) {.type = RESULT_PENDING};
+        } else {
+            zn_epoch_enter(map->epoch);
+            results[i] = zn_cachemap_loc_result(data_ids[i], &entry);
+        }
+
+        g_mutex_unlock(&shard->lock);
+    }
+}
+
+void
+zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location,
+                   const struct iovec *iov, int iovcnt) {
+    assert(map);
 
-    dbg_print_g_hash_table("map->data_map[location.zone]", map->data_map[location.zone], PRINT_G_HASH_TABLE_GINT);
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
 
     // It must contain an entry if the thread called zn_cachemap_find beforehand
-    assert(g_hash_table_contains(map->zone_map, GUINT_TO_POINTER(data_id)));
+    struct zn_index_entry entry;
+    uint64_t slot;
+    bool found = zn_index_lookup(&shard->index, data_id, &entry, &slot);
+    assert(found);
+    assert(zn_index_entry_state(&entry) == ZN_INDEX_PENDING);
+
+    // Hand the data to the threads waiting for it. It's copied without the lock, threads that
+    // start waiting in the meantime get it too.
+    GBytes *data = NULL;
+    if (iov != NULL && zn_cachemap_has_waiters(shard, &entry)) {
+        g_mutex_unlock(&shard->lock);
+
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            len += iov[i].iov_len;
+        }
+        unsigned char *copy = g_malloc(len);
+        for (size_t off = 0, i = 0; i < (size_t) iovcnt; off += iov[i].iov_len, i++) {
+            memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+        }
+        data = g_bytes_new_take(copy, len);
+
+        g_mutex_lock(&shard->lock);
+        found = zn_index_lookup(&shard->index, data_id, &entry, &slot);
+        assert(found);
+    }
+    (void) found;
 
-    struct zone_map_result *result = g_hash_table_lookup(map->zone_map, GUINT_TO_POINTER(data_id));
-    assert(result->type == RESULT_COND);
+    zn_index_update(&shard->index, data_id, ZN_INDEX_LOC, location.zone, location.chunk_offset);
 
-    GCond *condition = result->value.write_finished;
-    result->value.location = location; // Does this mutate the entry in the hash table?
-    result->type = RESULT_LOC;
-    assert(map->data_map[location.zone]);
-    g_hash_table_insert(map->data_map[location.zone], GUINT_TO_POINTER(location.chunk_offset), GINT_TO_POINTER(data_id));
-    g_cond_broadcast(condition);            // Wake up threads waiting for it
-    g_atomic_rc_box_release_full(condition, // Decrement the writing thread's ref
-                                 (GDestroyNotify) free_cond_var);
+    g_mutex_lock(&map->zone_locks[location.zone]);
+    uint32_t *reverse = zn_cachemap_data_id(map, location.zone, location.chunk_offset);
+    assert(*reverse == ZN_CACHEMAP_NO_ID);
+    assert(data_id != ZN_CACHEMAP_NO_ID); // Reserved as the sentinel
+    *reverse = data_id;
+    g_mutex_unlock(&map->zone_locks[location.zone]);
 
-    dbg_print_g_hash_table("map->data_map[location.zone]", map->data_map[location.zone], PRINT_G_HASH_TABLE_GINT);
+    zn_cachemap_wake(shard, &entry, data, location); // Wake up threads waiting for it
 
-    g_mutex_unlock(&map->cache_map_mutex);
+    g_mutex_unlock(&shard->lock);
 }
 
 void
-zn_cachemap_clear_chunk(struct zn_cachemap *map, struct zn_pair *location) {
+zn_cachemap_relocate(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location) {
     assert(map);
 
-    g_mutex_lock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
+
+    struct zn_index_entry old;
+    uint64_t slot;
+    bool found = zn_index_lookup(&shard->index, data_id, &old, &slot);
+    assert(found);
+    assert(zn_index_entry_state(&old) == ZN_INDEX_LOC);
+    (void) found;
+
+    g_mutex_lock(&map->zone_locks[old.zone]);
+    uint32_t *reverse = zn_cachemap_data_id(map, old.zone, old.chunk_offset);
+    // The old zone may already be being cleared, in which case its entries are gone
+    if (*reverse == data_id) {
+        *reverse = ZN_CACHEMAP_NO_ID;
+    }
+    g_mutex_unlock(&map->zone_locks[old.zone]);
+
+    g_mutex_lock(&map->zone_locks[location.zone]);
+    *zn_cachemap_data_id(map, location.zone, location.chunk_offset) = data_id;
+    g_mutex_unlock(&map->zone_locks[location.zone]);
 
-    dbg_print_g_hash_table("map->data_map[location.zone] before", map->data_map[location->zone], PRINT_G_HASH_TABLE_GINT);
+    zn_index_update(&shard->index, data_id, ZN_INDEX_LOC, location.zone, location.chunk_offset);
+    zn_dram_relocate_locked(map->dram, data_id, location);
+
+    g_mutex_unlock(&shard->lock);
+}
+
+void
+zn_cachemap_clear_chunk(struct zn_cachemap *map, struct zn_pair *location) {
+    assert(map);
 
     dbg_printf("Looking up zone=%u, chunk=%u\n", location->zone, location->chunk_offset);
-    int data_id = GPOINTER_TO_INT(g_hash_table_lookup(map->data_map[location->zone], GUINT_TO_POINTER(location->chunk_offset)));
+    g_mutex_lock(&map->zone_locks[location->zone]);
+    uint32_t data_id = *zn_cachemap_data_id(map, location->zone, location->chunk_offset);
+    g_mutex_unlock(&map->zone_locks[location->zone]);
+
+    dbg_printf("Got data_id=%u\n", data_id);
+    assert(data_id != ZN_CACHEMAP_NO_ID);
+
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+    bool found = zn_index_lookup(&shard->index, data_id, &entry, &slot);
+    assert(found);
+    assert(zn_index_entry_state(&entry) == ZN_INDEX_LOC);
+    assert(entry.zone == location->zone);
+    assert(entry.chunk_offset == location->chunk_offset);
+    (void) found;
+
+    // Erase the entry
+    zn_index_remove(&shard->index, data_id);
+    zn_dram_invalidate_locked(map->dram, data_id);
+
+    g_mutex_lock(&map->zone_locks[location->zone]);
+    *zn_cachemap_data_id(map, location->zone, location->chunk_offset) = ZN_CACHEMAP_NO_ID;
+    g_mutex_unlock(&map->zone_locks[location->zone]);
+
+    g_mutex_unlock(&shard->lock);
+}
+
+void
+zn_cachemap_clear_zone(struct zn_cachemap *map, uint32_t zone) {
+    zn_cachemap_clear_zones(map, &zone, 1);
+}
+
+/**
+ * @brief An ID taken from a zone that is being cleared
+ */
+struct zn_cachemap_cleared {
+    uint32_t shard;
+    uint32_t data_id;
+    uint32_t zone;
+};
+
+static int
+zn_cachemap_cleared_cmp(const void *a, const void *b) {
+    uint32_t sa = ((const struct zn_cachemap_cleared *) a)->shard;
+    uint32_t sb = ((const struct zn_cachemap_cleared *) b)->shard;
+    return (sa > sb) - (sa < sb);
+}
+
+void
+zn_cachemap_clear_zones(struct zn_cachemap *map, const uint32_t *zones, uint32_t nr_zones) {
+    assert(map);
+
+    // Take the zones' IDs, lookups of other zones and IDs aren't held up while they are removed
+    struct zn_cachemap_cleared *ids =
+        g_new(struct zn_cachemap_cleared, (uint64_t) nr_zones * map->max_zone_chunks);
+    uint64_t nr_ids = 0;
+    for (uint32_t z = 0; z < nr_zones; z++) {
+        uint32_t *row = zn_cachemap_data_id(map, zones[z], 0);
+        g_mutex_lock(&map->zone_locks[zones[z]]);
+        for (uint64_t i = 0; i < map->max_zone_chunks; i++) {
+            if (row[i] != ZN_CACHEMAP_NO_ID) {
+                ids[nr_ids++] = (struct zn_cachemap_cleared) {
+                    .shard = zn_cachemap_shard_index(row[i]),
+                    .data_id = row[i],
+                    .zone = zones[z],
+                };
+                row[i] = ZN_CACHEMAP_NO_ID;
+            }
+        }
+        g_mutex_unlock(&map->zone_locks[zones[z]]);
+    }
 
-    dbg_printf("Got data_id=%d\n", data_id);
+    // Group them by shard, so every shard lock is taken once for all the zones
+    qsort(ids, nr_ids, sizeof(struct zn_cachemap_cleared), zn_cachemap_cleared_cmp);
 
-    assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id)));
-    struct zone_map_result *res = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-    assert(res->type == RESULT_LOC);
-    assert(res->value.location.zone == location->zone);
-    assert(res->value.location.chunk_offset == location->chunk_offset);
+    struct zn_cachemap_shard *locked = NULL;
+    for (uint64_t i = 0; i < nr_ids; i++) {
+        struct zn_cachemap_shard *shard = &map->shards[ids[i].shard];
+        if (shard != locked) {
+            if (locked != NULL) {
+                g_mutex_unlock(&locked->lock);
+            }
+            g_mutex_lock(&shard->lock);
+            locked = shard;
+        }
 
-    // Erase the entry and free the zone_map_result memory
-    g_hash_table_remove(map->zone_map, GINT_TO_POINTER(data_id));
-    g_free(res);
+        struct zn_index_entry entry;
+        uint64_t slot;
+        bool found = zn_index_lookup(&shard->index, ids[i].data_id, &entry, &slot);
+        assert(found);
+        assert(zn_index_entry_state(&entry) == ZN_INDEX_LOC);
+        (void) found;
+
+        // GC may have moved the chunk out of the zone after the IDs were taken
+        if (entry.zone == ids[i].zone) {
+            // Erase the entry
+            zn_index_remove(&shard->index, ids[i].data_id);
+            zn_dram_invalidate_locked(map->dram, ids[i].data_id);
+        }
+    }
+    if (locked != NULL) {
+        g_mutex_unlock(&locked->lock);
+    }
+
+    g_free(ids);
+}
+
+/**
+ * @brief Maps an ID to a location with its shard locked
+ *
+ * If the shard is full the ID is left unmapped, the location then holds an invalid chunk.
+ *
+ * @param[out] old_id The ID that was left at `location`, unmap it with
+ *                    `zn_cachemap_unmap_replaced`
+ * @return true if the ID is now mapped to `location`
+ */
+static bool
+zn_cachemap_restore_locked(struct zn_cachemap *map, struct zn_cachemap_shard *shard,
+                           const uint32_t data_id, struct zn_pair location, uint32_t *old_id) {
+    // An older copy of the ID is no longer at its location
+    bool mapped = true;
+    struct zn_index_entry entry;
+    uint64_t slot;
+    if (zn_index_lookup(&shard->index, data_id, &entry, &slot)) {
+        assert(zn_index_entry_state(&entry) == ZN_INDEX_LOC);
+        g_mutex_lock(&map->zone_locks[entry.zone]);
+        uint32_t *reverse = zn_cachemap_data_id(map, entry.zone, entry.chunk_offset);
+        if (*reverse == data_id) {
+            *reverse = ZN_CACHEMAP_NO_ID;
+        }
+        g_mutex_unlock(&map->zone_locks[entry.zone]);
+        zn_index_update(&shard->index, data_id, ZN_INDEX_LOC, location.zone, location.chunk_offset);
+    } else if (zn_index_insert(&shard->index, data_id, ZN_INDEX_LOC, location.zone,
+                               location.chunk_offset) != 0) {
+        fprintf(stderr, "Cache map shard is full, dropping id=%u at zone=%u, chunk=%u\n", data_id,
+                location.zone, location.chunk_offset);
+        mapped = false;
+    }
 
-    g_hash_table_remove(map->data_map[location->zone], GUINT_TO_POINTER(location->chunk_offset));
+    g_mutex_lock(&map->zone_locks[location.zone]);
+    uint32_t *reverse = zn_cachemap_data_id(map, location.zone, location.chunk_offset);
+    *old_id = *reverse;
+    *reverse = mapped ? data_id : ZN_CACHEMAP_NO_ID;
+    g_mutex_unlock(&map->zone_locks[location.zone]);
+    return mapped;
+}
 
-    dbg_print_g_hash_table("map->data_map[location.zone] after", map->data_map[location->zone], PRINT_G_HASH_TABLE_GINT);
+/**
+ * @brief Unmaps the ID a restored ID replaced, if it still points at the location
+ */
+static void
+zn_cachemap_unmap_replaced(struct zn_cachemap *map, const uint32_t data_id, uint32_t old_id,
+                           struct zn_pair location) {
+    // Replaced an ID whose eviction wasn't journaled before the location was written again
+    if (old_id == ZN_CACHEMAP_NO_ID || old_id == data_id) {
+        return;
+    }
 
-    g_mutex_unlock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *old_shard = zn_cachemap_shard(map, old_id);
+    struct zn_index_entry entry;
+    uint64_t slot;
+    g_mutex_lock(&old_shard->lock);
+    if (zn_index_lookup(&old_shard->index, old_id, &entry, &slot) &&
+        entry.zone == location.zone && entry.chunk_offset == location.chunk_offset) {
+        zn_index_remove(&old_shard->index, old_id);
+    }
+    g_mutex_unlock(&old_shard->lock);
 }
 
 void
-zn_cachemap_clear_zone(struct zn_cachemap *map, uint32_t zone) {
+zn_cachemap_restore(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location) {
     assert(map);
+    assert(data_id != ZN_CACHEMAP_NO_ID); // Reserved as the sentinel
+
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
+    uint32_t old_id;
+    (void) zn_cachemap_restore_locked(map, shard, data_id, location, &old_id);
+    g_mutex_unlock(&shard->lock);
+
+    zn_cachemap_unmap_replaced(map, data_id, old_id, location);
+}
 
-    g_mutex_lock(&map->cache_map_mutex);
+bool
+zn_cachemap_restore_newest(struct zn_cachemap *map, const uint32_t data_id,
+                           struct zn_pair location, uint64_t generation, uint64_t *generations) {
+    assert(map);
+    assert(data_id != ZN_CACHEMAP_NO_ID); // Reserved as the sentinel
+
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
+
+    // Copies of the same ID are only compared under its shard lock
+    struct zn_index_entry entry;
+    uint64_t slot;
+    if (zn_index_lookup(&shard->index, data_id, &entry, &slot) &&
+        generations[entry.zone * map->max_zone_chunks + entry.chunk_offset] >= generation) {
+        g_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    generations[location.zone * map->max_zone_chunks + location.chunk_offset] = generation;
+    uint32_t old_id;
+    bool mapped = zn_cachemap_restore_locked(map, shard, data_id, location, &old_id);
+    g_mutex_unlock(&shard->lock);
+
+    zn_cachemap_unmap_replaced(map, data_id, old_id, location);
+    return mapped;
+}
+
+void
+zn_cachemap_forget(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location) {
+    assert(map);
 
-    GHashTableIter iter;
-    gpointer key, value;
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, data_id);
+    g_mutex_lock(&shard->lock);
 
-    g_hash_table_iter_init(&iter, map->data_map[zone]);
-    while (g_hash_table_iter_next(&iter, &key, &value)) {
-        int data_id = GPOINTER_TO_INT(value);
-        assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id)));
-        struct zone_map_result *res = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-        assert(res->type == RESULT_LOC);
-        assert(res->value.location.zone == zone);
+    struct zn_index_entry entry;
+    uint64_t slot;
+    if (zn_index_lookup(&shard->index, data_id, &entry, &slot) &&
+        entry.zone == location.zone && entry.chunk_offset == location.chunk_offset) {
+        zn_index_remove(&shard->index, data_id);
+        zn_dram_invalidate_locked(map->dram, data_id);
 
-        // Erase the entry and free the zone_map_result memory
-        g_hash_table_remove(map->zone_map, GINT_TO_POINTER(data_id));
-        g_free(res);
+        g_mutex_lock(&map->zone_locks[location.zone]);
+        *zn_cachemap_data_id(map, location.zone, location.chunk_offset) = ZN_CACHEMAP_NO_ID;
+        g_mutex_unlock(&map->zone_locks[location.zone]);
     }
 
-    g_hash_table_remove_all(map->data_map[zone]);
+    g_mutex_unlock(&shard->lock);
+}
 
-    g_mutex_unlock(&map->cache_map_mutex);
+void
+zn_cachemap_zone_ids(struct zn_cachemap *map, uint32_t zone, uint32_t *ids) {
+    g_mutex_lock(&map->zone_locks[zone]);
+    memcpy(ids, zn_cachemap_data_id(map, zone, 0), map->max_zone_chunks * sizeof(uint32_t));
+    g_mutex_unlock(&map->zone_locks[zone]);
 }
 
 void
 zn_cachemap_fail(struct zn_cachemap *map, const uint32_t id) {
-    g_mutex_lock(&map->cache_map_mutex);
-
-    assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(id)));
-    struct zone_map_result *entry = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(id));
-    assert(entry->type == RESULT_COND);
-    g_cond_broadcast(entry->value.write_finished);            // Wake up threads waiting for it
-    g_atomic_rc_box_release_full(entry->value.write_finished, // Decrement the writing thread's ref
-                                 (GDestroyNotify) free_cond_var);
-    g_hash_table_remove(map->zone_map,
-                        GINT_TO_POINTER(id)); // Threads waiting for it must write to a new location
-    g_free(entry);
-
-    g_mutex_unlock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, id);
+    g_mutex_lock(&shard->lock);
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+    bool found = zn_index_lookup(&shard->index, id, &entry, &slot);
+    assert(found);
+    assert(zn_index_entry_state(&entry) == ZN_INDEX_PENDING);
+    (void) found;
+
+    // Threads waiting for it must write to a new location
+    zn_index_remove(&shard->index, id);
+    zn_cachemap_wake(shard, &entry, NULL, (struct zn_pair) {0}); // Wake up threads waiting for it
+
+    g_mutex_unlock(&shard->lock);
+}
+
+void
+zn_cachemap_admit(struct zn_cachemap *map, struct zn_pair location, const struct iovec *iov,
+                  int iovcnt) {
+    if (!zn_dram_should_admit(map->dram, location.id)) {
+        return;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    unsigned char *copy = g_malloc(len);
+    for (size_t off = 0, i = 0; i < (size_t) iovcnt; off += iov[i].iov_len, i++) {
+        memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+    }
+    GBytes *data = g_bytes_new_take(copy, len);
+
+    struct zn_cachemap_shard *shard = zn_cachemap_shard(map, location.id);
+    g_mutex_lock(&shard->lock);
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+    if (zn_index_lookup(&shard->index, location.id, &entry, &slot) &&
+        zn_index_entry_state(&entry) == ZN_INDEX_LOC && entry.zone == location.zone &&
+        entry.chunk_offset == location.chunk_offset) {
+        zn_dram_insert_locked(map->dram, location, data);
+    } else {
+        g_bytes_unref(data);
+    }
+
+    g_mutex_unlock(&shard->lock);
 }
@@ -1,6 +1,7 @@
 #include "eviction_policy.h"
 #include "eviction_policy_chunk.h"
 #include "znutil.h"
+#include "zncache.h"
 #include "minheap.h"
 #include "zone_state_manager.h"
 
@@ -8,6 +9,7 @@
 #include <stdint.h>
 #include <stdbool.h> // Cortes
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <glibconfig.h>
 
@@ -22,35 +24,30 @@ zn_policy_chunk_update(policy_data_t _policy, struct zn_pair location,
 
     dbg_printf("State before chunk update%s", "\n");
 
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_g_queue("lru_queue (zone,chunk,id)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
+    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
 
     struct eviction_policy_chunk_zone * zpc = &p->zone_pool[location.zone];
     struct zn_pair * zp = &zpc->chunks[location.chunk_offset];
 
-    GList *node;
+    GList *node = NULL;
     // Should always be present (might be NULL)
-    assert(g_hash_table_lookup_extended(p->chunk_to_lru_map, zp, NULL, (gpointer *)&node));
+    gboolean found = g_hash_table_lookup_extended(p->chunk_to_lru_map, zp, NULL, (gpointer *)&node);
+    assert(found);
+    (void) found;
 
     if (io_type == ZN_WRITE) {
-        assert(!zp->in_use);
         zp->chunk_offset = location.chunk_offset;
         zp->zone = location.zone;
         zp->id = location.id;
-        zp->in_use = true;
+        zsm_mark_chunk_valid(&p->cache->zone_state, zp);
         zpc->chunks_in_use++; // Need to update here on SSD incase invalidated then re-written
         zpc->zone_id = location.zone;
         g_queue_push_tail(&p->lru_queue, zp);
         GList *node = g_queue_peek_tail_link(&p->lru_queue);
         g_hash_table_insert(p->chunk_to_lru_map, zp, node);
 
-        if (location.chunk_offset == p->cache->max_zone_chunks-1) {
-            // We only add zones to the minheap when they are full.
-            dbg_printf("Adding %p (zone=%u) to pqueue\n", (void *)zp, location.zone);
-            zpc->pqueue_entry = zn_minheap_insert(p->invalid_pqueue, zpc, zpc->chunks_in_use);
-            assert(zpc->pqueue_entry);
-            zpc->filled = true;
-        }
+        // We only add zones to the minheap when they are full, see zn_policy_chunk_zone_full
     } else if (io_type == ZN_READ) {
 
         if (node) {
@@ -70,79 +67,219 @@ zn_policy_chunk_update(policy_data_t _policy, struct zn_pair location,
 
 
     dbg_printf("State after chunk update%s", "\n");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_g_queue("lru_queue (zone,chunk,id)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
+    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+
+    g_mutex_unlock(&p->policy_mutex);
+}
+
+/**
+ * @brief Adds a filled zone to the GC candidates, the policy lock must be held
+ */
+static void
+zn_policy_chunk_zone_full_locked(struct zn_policy_chunk *p, uint32_t zone) {
+    struct eviction_policy_chunk_zone *zpc = &p->zone_pool[zone];
+    zpc->zone_id = zone;
+    dbg_printf("Adding %p (zone=%u) to pqueue\n", (void *)zpc, zone);
+    zpc->pqueue_entry = zn_minheap_insert(p->invalid_pqueue, zpc, zpc->chunks_in_use);
+    assert(zpc->pqueue_entry);
+    zpc->filled = true;
+}
+
+void
+zn_policy_chunk_zone_full(policy_data_t _policy, uint32_t zone) {
+    struct zn_policy_chunk *p = _policy;
+    assert(p);
 
+    g_mutex_lock(&p->policy_mutex);
+    zn_policy_chunk_zone_full_locked(p, zone);
     g_mutex_unlock(&p->policy_mutex);
 }
 
+/**
+ * @brief Moves the policy state of a chunk that GC copied to a new location
+ *
+ * The chunk keeps its place in the LRU queue.
+ */
+static void
+zn_policy_chunk_relocate(struct zn_policy_chunk *p, struct zn_pair *old_zp,
+                         struct zn_pair new_location) {
+    struct eviction_policy_chunk_zone *old_zone = &p->zone_pool[old_zp->zone];
+    struct eviction_policy_chunk_zone *new_zone = &p->zone_pool[new_location.zone];
+    struct zn_pair *new_zp = &new_zone->chunks[new_location.chunk_offset];
+
+    *new_zp = new_location;
+    zsm_mark_chunk_valid(&p->cache->zone_state, new_zp);
+    new_zone->chunks_in_use++;
+    new_zone->zone_id = new_location.zone;
+
+    GList *node = NULL;
+    gboolean found = g_hash_table_lookup_extended(p->chunk_to_lru_map, old_zp, NULL,
+                                                  (gpointer *) &node);
+    assert(found);
+    (void) found;
+    if (node) {
+        node->data = new_zp;
+    }
+    g_hash_table_replace(p->chunk_to_lru_map, new_zp, node);
+    g_hash_table_replace(p->chunk_to_lru_map, old_zp, NULL);
+
+    zsm_clear_chunk_valid(&p->cache->zone_state, old_zp);
+    old_zone->chunks_in_use--;
+}
+
 static void
 zn_policy_chunk_gc(policy_data_t policy) {
-    // TODO: If later separated from evict, lock here
+    // Called from zn_policy_chunk_evict with the policy lock held
     struct zn_policy_chunk *p = policy;
+    struct zn_cache *cache = p->cache;
 
-    uint32_t free_zones = zsm_get_num_free_zones(&p->cache->zone_state);
+    uint32_t free_zones = zsm_get_num_free_zones(&cache->zone_state);
     if (free_zones > EVICT_HIGH_THRESH_ZONES) {
         return;
     }
 
+    // The lock is dropped while waiting for zones, a second run would overwrite the chunks
+    // this one has read. The running collection frees the zones for both.
+    if (p->gc_running) {
+        return;
+    }
+    p->gc_running = true;
+
+    // Keeps its place in the zone state manager's wait queue across the zones it relocates
+    struct zsm_waiter waiter;
+    zsm_waiter_init(&waiter);
+    p->gc_waiter = &waiter;
+
     while (free_zones < EVICT_LOW_THRESH_ZONES) {
         struct zn_minheap_entry *ent = zn_minheap_extract_min(p->invalid_pqueue);
+        assert(ent);
         struct eviction_policy_chunk_zone * old_zone = ent->data;
         assert(old_zone);
         dbg_printf("Found minheap_entry priority=%u, chunks_in_use=%u, zone=%u\n",
             ent->priority,  old_zone->chunks_in_use, old_zone->zone_id);
         dbg_printf("zone[%u] chunks:\n", old_zone->zone_id);
-        dbg_print_zn_pair_list(old_zone->chunks, p->cache->max_zone_chunks);
+        dbg_print_zn_pair_list(old_zone->chunks, cache->max_zone_chunks);
+        free(ent);
+
+        // Scanned a word at a time, only the valid chunks are visited
+        const struct zn_bitmap *valid = zsm_get_valid_chunks(&cache->zone_state, old_zone->zone_id);
+        old_zone->pqueue_entry = NULL;
+
+        // A zone only fills up once its staged chunks are flushed, they are all on the device
+        assert(!zn_stage_holds(cache, (struct zn_pair) {.zone = old_zone->zone_id,
+                                                        .chunk_offset = cache->max_zone_chunks - 1}));
+
+        // Read every valid chunk of the zone in one batch, so the device sees
+        // all of them at once instead of one at a time
+        uint32_t nr_valid = 0;
+        for (uint32_t i = zn_bitmap_next_set(valid, 0); i < cache->max_zone_chunks;
+             i = zn_bitmap_next_set(valid, i + 1)) {
+            p->gc_index[nr_valid] = i;
+            p->gc_reqs[nr_valid] = (struct zn_io_req) {
+                .op = ZN_IO_OP_READ,
+                .buf = p->chunk_buf + ((size_t) nr_valid * cache->chunk_sz),
+                .len = cache->chunk_sz,
+                .offset = CHUNK_POINTER(cache->zone_size, cache->chunk_sz,
+                                        old_zone->chunks[i].chunk_offset, old_zone->chunks[i].zone),
+            };
+            nr_valid++;
+        }
 
-        // Naive?
-        for (uint32_t i = 0; i < p->cache->max_zone_chunks; i++) {
-            if (!old_zone->chunks[i].in_use) {
-                continue;
+        if (zn_io_run(&cache->io, p->gc_reqs, nr_valid) != 0) {
+            assert(!"Failed to read chunks from old zone");
+        }
+
+        // Write them back out in runs of consecutive chunks, each run is a single write
+        uint32_t next = 0;
+        while (next < nr_valid) {
+            // Chunks can be evicted while the lock was dropped, only ask for those still valid.
+            // Chunks of shared zones can't be handed back, so every chunk asked for is written.
+            uint32_t nr_left = 0;
+            for (uint32_t i = next; i < nr_valid; i++) {
+                nr_left += zn_bitmap_test(valid, p->gc_index[i]);
+            }
+            if (nr_left == 0) {
+                break;
             }
 
             struct zn_pair new_location;
-            enum zsm_get_active_zone_error ret = zsm_get_active_zone(&p->cache->zone_state, &new_location);
-            if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
-                assert(!"TODO");
-                // TODO: ???
+            uint32_t nr_chunks = 0;
+            enum zsm_get_active_zone_error ret = zsm_try_get_active_zone_batch(
+                &cache->zone_state, nr_left, &new_location, &nr_chunks, &waiter);
+            if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
+                // Writers holding the active zones need the policy lock to return them
+                g_mutex_unlock(&p->policy_mutex);
+                zsm_wait(&cache->zone_state, &waiter);
+                g_mutex_lock(&p->policy_mutex);
+                continue;
+            } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+                // Every zone is full and none is retired or being reset. Evictions while the
+                // lock is dropped can empty the rest of this zone, or another zone is freed.
+                g_mutex_unlock(&p->policy_mutex);
+                zsm_wait_for_zone(&cache->zone_state, &waiter);
+                g_mutex_lock(&p->policy_mutex);
+                continue;
+            } else if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+                assert(!"Failed to get a zone to relocate chunks to");
             }
 
-            // Read the chunk from the old zone
-            unsigned char *data = zn_read_from_disk(p->cache, &old_zone->chunks[i]);
-            assert(data);
-
-            // Write the chunk to the new zone
-            unsigned long long wp = CHUNK_POINTER(p->cache->zone_size, p->cache->chunk_sz,
-                                                  new_location.chunk_offset, new_location.zone);
-            if (zn_write_out(p->cache->fd, p->cache->chunk_sz, data, WRITE_GRANULARITY, wp) != 0) {
-                assert(!"Failed to write chunk to new zone");
+            // Skip the chunks that were evicted, the lock was held since the rest were counted
+            uint32_t n = 0;
+            for (; next < nr_valid && n < nr_chunks; next++) {
+                if (zn_bitmap_test(valid, p->gc_index[next])) {
+                    p->gc_iov[n] = (struct iovec) {
+                        .iov_base = p->gc_reqs[next].buf,
+                        .iov_len = cache->chunk_sz,
+                    };
+                    p->gc_moved[n++] = p->gc_index[next];
+                }
             }
 
-            // Update the cache map
-            zn_cachemap_insert(&p->cache->cache_map, old_zone->chunks[i].id, new_location); // Add new mapping
+            assert(n == nr_chunks);
 
-            // Update the eviction policy metadata
-            old_zone->chunks[i].in_use = false;
-            old_zone->chunks_in_use--;
-
-            // Update the new zone's metadata
-            struct eviction_policy_chunk_zone *new_zone = &p->zone_pool[new_location.zone];
-            new_zone->chunks[new_location.chunk_offset] = old_zone->chunks[i];
-            new_zone->chunks[new_location.chunk_offset].in_use = true;
-            new_zone->chunks_in_use++;
+            if (zn_cache_write_chunk(cache, &new_location, p->gc_iov, n) != 0) {
+                assert(!"Failed to write chunks to new zone");
+            }
 
-            // Update the LRU queue
-            g_queue_push_tail(&p->lru_queue, &new_zone->chunks[new_location.chunk_offset]);
+            for (uint32_t i = 0; i < n; i++) {
+                struct zn_pair *old_zp = &old_zone->chunks[p->gc_moved[i]];
+                struct zn_pair chunk = {
+                    .zone = new_location.zone,
+                    .chunk_offset = new_location.chunk_offset + i,
+                    .id = old_zp->id,
+                };
+
+                zn_cachemap_relocate(&cache->cache_map, old_zp->id, chunk);
+
+                // The copy keeps the chunk's header, and with it its generation
+                struct zn_chunk_header header;
+                memcpy(&header, p->gc_iov[i].iov_base, sizeof(header));
+                zn_journal_append(&cache->journal, ZN_JOURNAL_INSERT, old_zp->id, chunk,
+                                  header.generation);
+                zn_policy_chunk_relocate(p, old_zp, chunk);
+            }
 
-            // Free the data buffer
-            free(data);
+            bool zone_full = false;
+            zsm_return_active_zone_batch(&cache->zone_state, &new_location, n, &zone_full);
+            if (zone_full) {
+                zn_policy_chunk_zone_full_locked(p, new_location.zone);
+            }
         }
-        zn_cachemap_clear_zone(&p->cache->cache_map, old_zone->zone_id);
-        // Reset the old zone
-        zsm_evict(&p->cache->zone_state, old_zone->zone_id);
-        free_zones = zsm_get_num_free_zones(&p->cache->zone_state);
+
+        assert(old_zone->chunks_in_use == 0);
+        old_zone->filled = false;
+
+        // Readers that found a chunk before it moved may still be reading the old zone, it is
+        // reset once they are done
+        zn_cache_retire_zone(cache, old_zone->zone_id);
+        free_zones =
+            zsm_get_num_free_zones(&cache->zone_state) + zn_epoch_nr_retired(&cache->epoch);
     }
+
+    zsm_waiter_clear(&waiter);
+    p->gc_waiter = NULL;
+    p->gc_running = false;
 }
 
 int
@@ -161,8 +298,8 @@ zn_policy_chunk_evict(policy_data_t policy) {
     }
 
     dbg_printf("State before chunk evict%s", "\n");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_g_queue("lru_queue (zone,chunk,id)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
+    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
     uint32_t free_zones = zsm_get_num_free_zones(&p->cache->zone_state);
     (void)free_zones;
 
@@ -179,8 +316,7 @@ zn_policy_chunk_evict(policy_data_t policy) {
         struct zn_pair * zp = g_queue_pop_head(&p->lru_queue);
         g_hash_table_replace(p->chunk_to_lru_map, zp, NULL);
 
-        // Invalidate chunk
-        p->zone_pool[zp->zone].chunks[zp->chunk_offset].in_use = false;
+        // Invalidate chunk, the ZSM's bitmaps are updated below
         p->zone_pool[zp->zone].chunks_in_use--;
 
         // Update priority
@@ -193,19 +329,25 @@ zn_policy_chunk_evict(policy_data_t policy) {
         // Update ZSM, cachemap
         zsm_mark_chunk_invalid(&p->cache->zone_state, zp);
         zn_cachemap_clear_chunk(&p->cache->cache_map, zp);
+        zn_journal_append(&p->cache->journal, ZN_JOURNAL_CLEAR_CHUNK, zp->id, *zp, 0);
 
         // TODO: SSD look at invalid (not here, on write)
     }
 
     dbg_printf("State after chunk evict%s\n", "");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_g_queue("lru_queue (zone,chunk,id)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
+    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
 
     in_lru = g_queue_get_length(&p->lru_queue);
     free_chunks = p->total_chunks - in_lru;
     dbg_printf("Free chunks=%u, Chunks in lru=%u, EVICT_HIGH_THRESH_CHUNKS=%u\n",
                free_chunks, in_lru, EVICT_HIGH_THRESH_CHUNKS);
 
+    // A collection waiting for a zone to relocate to may not have to relocate those anymore
+    if (p->gc_running) {
+        zsm_wake_waiter(&p->cache->zone_state, p->gc_waiter);
+    }
+
     // Do GC
     zn_policy_chunk_gc(p);
 
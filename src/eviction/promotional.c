@@ -24,12 +24,8 @@ zn_policy_promotional_update(policy_data_t _policy, struct zn_pair location,
     dbg_print_g_queue("lru_queue", &policy->lru_queue, PRINT_G_QUEUE_GINT);
     dbg_print_g_hash_table("zone_to_lru_map", policy->zone_to_lru_map, PRINT_G_HASH_TABLE_PROM_LRU_NODE);
 
-    // We only add zones to the LRU when they are full.
-    if (io_type == ZN_WRITE && location.chunk_offset == policy->zone_max_chunks-1) {
-        g_queue_push_tail(&policy->lru_queue, zone_ptr);
-        GList *node = g_queue_peek_tail_link(&policy->lru_queue);
-        g_hash_table_insert(policy->zone_to_lru_map, zone_ptr, node);
-    } else if (io_type == ZN_READ) {
+    // We only add zones to the LRU when they are full, see zn_policy_promotional_zone_full
+    if (io_type == ZN_READ) {
 
         GList *node = g_hash_table_lookup(policy->zone_to_lru_map, zone_ptr);
         if (node) {
@@ -54,6 +50,23 @@ zn_policy_promotional_update(policy_data_t _policy, struct zn_pair location,
     g_mutex_unlock(&policy->policy_mutex);
 }
 
+void
+zn_policy_promotional_zone_full(policy_data_t _policy, uint32_t zone) {
+    struct zn_policy_promotional *policy = _policy;
+    assert(policy);
+
+    g_mutex_lock(&policy->policy_mutex);
+
+    gpointer zone_ptr = GUINT_TO_POINTER(zone);
+    g_queue_push_tail(&policy->lru_queue, zone_ptr);
+    GList *node = g_queue_peek_tail_link(&policy->lru_queue);
+    g_hash_table_insert(policy->zone_to_lru_map, zone_ptr, node);
+
+    dbg_print_g_queue("lru_queue after zone full", &policy->lru_queue, PRINT_G_QUEUE_GINT);
+
+    g_mutex_unlock(&policy->policy_mutex);
+}
+
 int
 zn_policy_promotional_get_zone_to_evict(policy_data_t policy) {
     struct zn_policy_promotional *promote_policy = policy;
@@ -75,3 +88,24 @@ zn_policy_promotional_get_zone_to_evict(policy_data_t policy) {
     g_mutex_unlock(&promote_policy->policy_mutex);
     return zone_id;
 }
+
+uint32_t
+zn_policy_promotional_get_zones_to_evict(policy_data_t policy, uint32_t *zones, uint32_t max) {
+    struct zn_policy_promotional *promote_policy = policy;
+
+    g_mutex_lock(&promote_policy->policy_mutex);
+
+    dbg_print_g_queue("lru_queue", &promote_policy->lru_queue, PRINT_G_QUEUE_GINT);
+
+    uint32_t nr = 0;
+    while (nr < max && g_queue_get_length(&promote_policy->lru_queue) > 0) {
+        // Remove from LRU and hash map
+        uint32_t zone_id = GPOINTER_TO_UINT(g_queue_pop_head(&promote_policy->lru_queue));
+        g_hash_table_replace(promote_policy->zone_to_lru_map, GUINT_TO_POINTER(zone_id), NULL);
+        dbg_printf("Evicted zone=%u\n", zone_id);
+        zones[nr++] = zone_id;
+    }
+
+    g_mutex_unlock(&promote_policy->policy_mutex);
+    return nr;
+}
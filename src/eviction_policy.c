@@ -67,7 +67,9 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
                 .type = ZN_EVICT_PROMOTE_ZONE,
                 .data = data,
                 .update_policy = zn_policy_promotional_update,
-                .do_evict = zn_policy_promotional_get_zone_to_evict
+                .zone_full = zn_policy_promotional_zone_full,
+                .do_evict = zn_policy_promotional_get_zone_to_evict,
+                .do_evict_zones = zn_policy_promotional_get_zones_to_evict
             };
             break;
         }
@@ -79,9 +81,18 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
 
             data->cache = cache;
 
-            data->chunk_buf = malloc(cache->max_zone_chunks * cache->chunk_sz);
+            // Aligned so GC can read and write through an O_DIRECT fd
+            data->chunk_buf = zn_buffer_alloc_aligned(cache->max_zone_chunks * cache->chunk_sz);
             assert(data->chunk_buf);
 
+            data->gc_reqs = g_new(struct zn_io_req, cache->max_zone_chunks);
+            assert(data->gc_reqs);
+            data->gc_index = g_new(uint32_t, cache->max_zone_chunks);
+            data->gc_moved = g_new(uint32_t, cache->max_zone_chunks);
+            data->gc_iov = g_new(struct iovec, cache->max_zone_chunks);
+            data->gc_running = false;
+            data->gc_waiter = NULL;
+
             data->total_chunks = cache->nr_zones * cache->max_zone_chunks;
 
             // zn_pair to lru_map
@@ -95,16 +106,18 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
             for (uint32_t z = 0; z < cache->nr_zones; z++) {
                 data->zone_pool[z].chunks_in_use = 0;
                 data->zone_pool[z].filled = false;
+                data->zone_pool[z].pqueue_entry = NULL;
                 data->zone_pool[z].chunks = g_new(struct zn_pair, cache->max_zone_chunks);
                 assert(data->zone_pool[z].chunks);
                 for (uint32_t c = 0; c < cache->max_zone_chunks; c++) {
                     data->zone_pool[z].chunks[c].chunk_offset = 0;
-                    data->zone_pool[z].chunks[c].in_use = false;
-                    assert(g_hash_table_insert(
+                    gboolean added = g_hash_table_insert(
                         data->chunk_to_lru_map,
                         &data->zone_pool[z].chunks[c],
                         NULL
-                    ));
+                    );
+                    assert(added);
+                    (void) added;
                 }
             }
 
@@ -121,7 +134,9 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
                 .type = ZN_EVICT_CHUNK,
                 .data = data,
                 .update_policy = zn_policy_chunk_update,
-                .do_evict = zn_policy_chunk_evict
+                .zone_full = zn_policy_chunk_zone_full,
+                .do_evict = zn_policy_chunk_evict,
+                .do_evict_zones = NULL
             };
             break;
         }
@@ -0,0 +1,88 @@
+#include "znbitmap.h"
+
+#include <assert.h>
+
+static inline uint32_t
+zn_bitmap_nr_words(uint32_t nr_bits) {
+    return (nr_bits + ZN_BITMAP_WORD_BITS - 1) / ZN_BITMAP_WORD_BITS;
+}
+
+static inline guint
+zn_bitmap_mask(uint32_t bit) {
+    return 1u << (bit % ZN_BITMAP_WORD_BITS);
+}
+
+void
+zn_bitmap_init(struct zn_bitmap *bitmap, uint32_t nr_bits) {
+    bitmap->nr_bits = nr_bits;
+    bitmap->words = g_new0(guint, zn_bitmap_nr_words(nr_bits));
+}
+
+void
+zn_bitmap_destroy(struct zn_bitmap *bitmap) {
+    g_free(bitmap->words);
+    bitmap->words = NULL;
+}
+
+bool
+zn_bitmap_set(struct zn_bitmap *bitmap, uint32_t bit) {
+    assert(bit < bitmap->nr_bits);
+    guint mask = zn_bitmap_mask(bit);
+    return (g_atomic_int_or(&bitmap->words[bit / ZN_BITMAP_WORD_BITS], mask) & mask) == 0;
+}
+
+bool
+zn_bitmap_clear(struct zn_bitmap *bitmap, uint32_t bit) {
+    assert(bit < bitmap->nr_bits);
+    guint mask = zn_bitmap_mask(bit);
+    return (g_atomic_int_and(&bitmap->words[bit / ZN_BITMAP_WORD_BITS], ~mask) & mask) != 0;
+}
+
+bool
+zn_bitmap_test(const struct zn_bitmap *bitmap, uint32_t bit) {
+    assert(bit < bitmap->nr_bits);
+    guint word = (guint) g_atomic_int_get((gint *) &bitmap->words[bit / ZN_BITMAP_WORD_BITS]);
+    return (word & zn_bitmap_mask(bit)) != 0;
+}
+
+void
+zn_bitmap_clear_all(struct zn_bitmap *bitmap) {
+    uint32_t nr_words = zn_bitmap_nr_words(bitmap->nr_bits);
+    for (uint32_t i = 0; i < nr_words; i++) {
+        g_atomic_int_set((gint *) &bitmap->words[i], 0);
+    }
+}
+
+uint32_t
+zn_bitmap_count(const struct zn_bitmap *bitmap) {
+    // Bits past `nr_bits` are never set, whole words can be counted
+    uint32_t nr_words = zn_bitmap_nr_words(bitmap->nr_bits);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < nr_words; i++) {
+        count += (uint32_t) __builtin_popcount((guint) g_atomic_int_get((gint *) &bitmap->words[i]));
+    }
+    return count;
+}
+
+uint32_t
+zn_bitmap_next_set(const struct zn_bitmap *bitmap, uint32_t from) {
+    if (from >= bitmap->nr_bits) {
+        return bitmap->nr_bits;
+    }
+
+    uint32_t i = from / ZN_BITMAP_WORD_BITS;
+    uint32_t nr_words = zn_bitmap_nr_words(bitmap->nr_bits);
+
+    // Ignore the bits before `from` in its word
+    guint word = (guint) g_atomic_int_get((gint *) &bitmap->words[i]);
+    word &= ~0u << (from % ZN_BITMAP_WORD_BITS);
+    while (word == 0) {
+        if (++i == nr_words) {
+            return bitmap->nr_bits;
+        }
+        word = (guint) g_atomic_int_get((gint *) &bitmap->words[i]);
+    }
+
+    uint32_t bit = i * ZN_BITMAP_WORD_BITS + (uint32_t) __builtin_ctz(word);
+    return bit < bitmap->nr_bits ? bit : bitmap->nr_bits;
+}
@@ -0,0 +1,94 @@
+// For posix_memalign and MAP_HUGETLB
+#define _GNU_SOURCE
+#include "znbuffer.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ROUND_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+unsigned char *
+zn_buffer_alloc_aligned(size_t size) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, ZN_BUFFER_ALIGN, ROUND_UP(size, ZN_BUFFER_ALIGN)) != 0) {
+        nomem();
+    }
+    return buffer;
+}
+
+void
+zn_buffer_pool_init(struct zn_buffer_pool *pool, size_t buffer_sz, uint32_t nr_buffers) {
+    assert(pool);
+    assert(buffer_sz > 0);
+    assert(nr_buffers > 0);
+
+    pool->buffer_sz = ROUND_UP(buffer_sz, ZN_BUFFER_ALIGN);
+    pool->nr_buffers = nr_buffers;
+    pool->region_sz = pool->buffer_sz * nr_buffers;
+    pool->region = NULL;
+    pool->huge_pages = false;
+
+#ifdef ZN_HUGE_PAGES
+    size_t huge_sz = ROUND_UP(pool->region_sz, ZN_BUFFER_HUGE_PAGE_SZ);
+    void *region = mmap(NULL, huge_sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+        pool->region = region;
+        pool->region_sz = huge_sz;
+        pool->huge_pages = true;
+    } else {
+        fprintf(stderr, "Couldn't map %zu bytes of huge pages for the buffer pool, "
+                        "using regular pages\n", huge_sz);
+    }
+#endif
+
+    if (pool->region == NULL) {
+        pool->region = zn_buffer_alloc_aligned(pool->region_sz);
+    }
+
+    pool->free_buffers = g_async_queue_new();
+    for (uint32_t i = 0; i < nr_buffers; i++) {
+        g_async_queue_push(pool->free_buffers, pool->region + ((size_t) i * pool->buffer_sz));
+    }
+}
+
+void
+zn_buffer_pool_destroy(struct zn_buffer_pool *pool) {
+    assert((uint32_t) g_async_queue_length(pool->free_buffers) == pool->nr_buffers);
+    g_async_queue_unref(pool->free_buffers);
+
+    if (pool->huge_pages) {
+        munmap(pool->region, pool->region_sz);
+    } else {
+        free(pool->region);
+    }
+    pool->region = NULL;
+}
+
+unsigned char *
+zn_buffer_pool_get(struct zn_buffer_pool *pool) {
+    unsigned char *buffer = g_async_queue_try_pop(pool->free_buffers);
+    if (buffer == NULL) {
+        dbg_printf("Buffer pool exhausted, allocating a %zu byte buffer\n", pool->buffer_sz);
+        buffer = zn_buffer_alloc_aligned(pool->buffer_sz);
+    }
+    return buffer;
+}
+
+void
+zn_buffer_pool_put(struct zn_buffer_pool *pool, unsigned char *buffer) {
+    assert(buffer);
+
+    bool pooled = buffer >= pool->region && buffer < pool->region + pool->region_sz;
+    if (!pooled) {
+        free(buffer);
+        return;
+    }
+
+    assert((size_t) (buffer - pool->region) % pool->buffer_sz == 0);
+    g_async_queue_push(pool->free_buffers, buffer);
+}
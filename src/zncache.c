@@ -1,6 +1,6 @@
-// For pread
+// For pread and O_DIRECT
+#define _GNU_SOURCE
 #include <bits/posix1_lim.h>
-#define _XOPEN_SOURCE 500
 #include <string.h>
 #include "zncache.h"
 
@@ -72,7 +72,10 @@ evict_task(gpointer user_data) {
             break;
         }
 
-        uint32_t free_zones = zsm_get_num_free_zones(&cache->zone_state);
+        // Retired zones are reset here too once their readers are done, they count as free
+        zn_cache_reclaim_zones(cache);
+        uint32_t free_zones =
+            zsm_get_num_free_zones(&cache->zone_state) + zn_epoch_nr_retired(&cache->epoch);
         if (free_zones > EVICT_HIGH_THRESH_ZONES) {
             g_usleep(EVICT_INTERVAL_US);
             continue;
@@ -97,6 +100,10 @@ task_function(gpointer data, gpointer user_data) {
 
     printf("Task %d started by thread %p\n", thread_data->tid, (void *) g_thread_self());
 
+    // Every request of this thread is read into the same buffer
+    unsigned char *buffer = zn_buffer_alloc_aligned(thread_data->cache->chunk_sz);
+    struct iovec iov = {.iov_base = buffer, .iov_len = thread_data->cache->chunk_sz};
+
     // Handles any cache read requests
     while (true) {
         g_mutex_lock(&thread_data->cache->reader.lock);
@@ -137,9 +144,9 @@ task_function(gpointer data, gpointer user_data) {
         // PROFILE START
         struct timespec start_time, end_time;
         TIME_NOW(&start_time);
-        unsigned char *data = zn_cache_get(thread_data->cache, data_id, RANDOM_DATA);
-        if (data == NULL) {
+        if (zn_cache_get_into(thread_data->cache, data_id, &iov, 1, RANDOM_DATA) != 0) {
             dbg_printf("ERROR: Couldn't get data for data_id=%u\n", data_id);
+            free(buffer);
             return;
         }
         TIME_NOW(&end_time);
@@ -149,9 +156,8 @@ task_function(gpointer data, gpointer user_data) {
         // PROFILE END
 
 #ifdef VERIFY
-        assert(zn_validate_read(thread_data->cache, data, data_id, RANDOM_DATA) == 0);
+        assert(zn_validate_read(thread_data->cache, buffer, data_id, RANDOM_DATA) == 0);
 #endif
-        free(data);
 
         // PROFILE METRICS
         // Throughput
@@ -175,11 +181,18 @@ task_function(gpointer data, gpointer user_data) {
             ZN_PROFILER_METRIC_CACHE_HITRATIO,
             hr
         );
+        // Update DRAM tier hitratio
+        ZN_PROFILER_SET(
+            thread_data->cache->profiler,
+            ZN_PROFILER_METRIC_DRAM_HITRATIO,
+            zn_dram_hit_ratio(&thread_data->cache->dram)
+        );
         // Show thread still active
         ZN_PROFILER_PRINTF(thread_data->cache->profiler, "THREADID_EVERY,%d\n", thread_data->tid);
         dbg_printf("Hitratio: %f\n", hr);
     }
     printf("Task %d finished by thread %p\n", thread_data->tid, (void *) g_thread_self());
+    free(buffer);
 
     g_mutex_lock(thread_data->thread_counter_lock);
     (*thread_data->nr_threads_completed)++;
@@ -209,7 +222,7 @@ profiling_task(gpointer user_data) {
 static void
 usage(FILE * file, char *progname) {
     fprintf(file,
-            "Usage: %s <DEVICE> <CHUNK_SZ> <THREADS> [-w workload_file] [-i iterations] [-m metrics_file ] [ -h]\n",
+            "Usage: %s <DEVICE> <CHUNK_SZ> <THREADS> [-w workload_file] [-i iterations] [-m metrics_file ] [-j journal_file] [-r] [ -h]\n",
             progname);
 }
 
@@ -259,7 +272,7 @@ main(int argc, char **argv) {
         return -1;
     }
 
-    if (argc < 4 || argc > 11) {
+    if (argc < 4 || argc > 14) {
         usage(stderr, argv[0]);
         return -1;
     }
@@ -272,13 +285,15 @@ main(int argc, char **argv) {
 
     char *metrics_file = NULL;
     char *workload_file = NULL;
+    char *journal_file = NULL;
+    bool recover = false;
     uint64_t workload_max = UINT64_MAX;
     uint32_t *workload_buffer;
 
     int c;
     opterr = 0;
     optind = 4;
-    while ((c = getopt(argc, argv, "w:i:m:h")) != -1) {
+    while ((c = getopt(argc, argv, "w:i:m:j:rh")) != -1) {
         switch (c) {
             case 'w':
                 workload_file = optarg;
@@ -289,6 +304,12 @@ main(int argc, char **argv) {
             case 'm':
                 metrics_file = optarg;
             break;
+            case 'j':
+                journal_file = optarg;
+            break;
+            case 'r':
+                recover = true;
+            break;
             case 'h':
                 usage(stdout, argv[0]);
                 exit(EXIT_SUCCESS);
@@ -340,11 +361,15 @@ main(int argc, char **argv) {
            "\tWorker threads: %u\n"
            "\tEviction threads: %u\n"
            "\tWorkload file: %s\n"
-           "\tMetrics file: %s\n",
+           "\tMetrics file: %s\n"
+           "\tJournal file: %s\n"
+           "\tRecover from device: %s\n",
            device, (device_type == ZE_BACKEND_ZNS) ? "ZNS" : "Block", chunk_sz,
            BLOCK_ZONE_CAPACITY, nr_threads, nr_eviction_threads,
            workload_file != NULL ? workload_file : "Simple generator",
-           metrics_file != NULL ? metrics_file : "NO");
+           metrics_file != NULL ? metrics_file : "NO",
+           journal_file != NULL ? journal_file : "NO",
+           recover ? "YES" : "NO");
 
 #ifdef DEBUG
     printf("\tDEBUG=on\n");
@@ -353,12 +378,25 @@ main(int argc, char **argv) {
     printf("\tVERIFY=on\n");
 #endif
 
+    int open_flags = O_RDWR;
+#ifdef ZN_DIRECT_IO
+    printf("\tDIRECT_IO=on\n");
+    if (chunk_sz % ZN_BUFFER_ALIGN != 0) {
+        fprintf(stderr, "Chunk size must be a multiple of %u with DIRECT_IO\n", ZN_BUFFER_ALIGN);
+        return -1;
+    }
+    open_flags |= O_DIRECT;
+#endif
+#ifdef ZN_HUGE_PAGES
+    printf("\tHUGE_PAGES=on\n");
+#endif
+
     struct zbd_info info = {0};
     int fd;
     if (device_type == ZE_BACKEND_ZNS) {
-        fd = zbd_open(device, O_RDWR, &info);
+        fd = zbd_open(device, open_flags, &info);
     } else {
-        fd = open(device, O_RDWR);
+        fd = open(device, open_flags);
 
         uint64_t size = 0;
         if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
@@ -383,13 +421,7 @@ main(int argc, char **argv) {
         if (MAX_ZONES_USED != 0) {
             info.nr_zones = MAX_ZONES_USED;
         }
-        int ret = zbd_reset_zones(fd, 0, 0);
-        if (ret != 0) {
-            fprintf(stderr, "Couldn't reset zones\n");
-            return -1;
-        }
-
-        ret = zone_cap(fd, &zone_capacity);
+        int ret = zone_cap(fd, &zone_capacity);
         if (ret != 0) {
             fprintf(stderr, "Couldn't report zone info\n");
             return ret;
@@ -399,13 +431,37 @@ main(int argc, char **argv) {
         info.zone_size = BLOCK_ZONE_CAPACITY;
     }
 
+    // A journal of the same device is replayed instead of starting from an empty cache
+    bool warm = journal_file != NULL &&
+                (recover ? zn_journal_intact(journal_file, chunk_sz, zone_capacity, info.nr_zones)
+                         : zn_journal_matches(journal_file, chunk_sz, zone_capacity, info.nr_zones));
+    // Without a journal to replay the cache is rebuilt from the chunks on the device
+    bool scan = !warm && recover;
+    printf("\tStart: %s\n", warm ? "warm" : (scan ? "scan" : "cold"));
+
+    if (device_type == ZE_BACKEND_ZNS && !warm && !scan) {
+        int ret = zbd_reset_zones(fd, 0, 0);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't reset zones\n");
+            return -1;
+        }
+    }
+
     RANDOM_DATA = generate_random_buffer(chunk_sz);
     if (RANDOM_DATA == NULL) {
         nomem();
     }
 
     struct zn_cache cache = {0};
-    zn_init_cache(&cache, &info, chunk_sz, zone_capacity, fd, EVICTION_POLICY, device_type, workload_buffer, workload_max, metrics_file);
+    zn_init_cache(&cache, &info, chunk_sz, zone_capacity, fd, nr_threads, EVICTION_POLICY, device_type, workload_buffer, workload_max, metrics_file);
+    if (scan && zn_cache_scan(&cache) != 0) {
+        fprintf(stderr, "Couldn't recover the cache from %s\n", device);
+        return -1;
+    }
+    if (journal_file != NULL && zn_cache_open_journal(&cache, journal_file, warm) != 0) {
+        fprintf(stderr, "Couldn't open journal %s\n", journal_file);
+        return -1;
+    }
 
     GError *error = NULL;
     // Create a thread pool with a maximum of nr_threads
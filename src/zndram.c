@@ -0,0 +1,219 @@
+#include "zndram.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+
+void
+zn_dram_init(struct zn_dram_tier *tier, uint64_t capacity, size_t chunk_sz,
+             struct zn_epoch *epoch) {
+    // A tier that can't hold a single chunk is off
+    tier->capacity = capacity < chunk_sz ? 0 : capacity;
+
+    // Every shard holds at least one chunk
+    uint64_t max_chunks = tier->capacity / chunk_sz;
+    tier->nr_shards = 1;
+    while (tier->nr_shards < ZN_DRAM_SHARDS && tier->nr_shards * 2 <= max_chunks) {
+        tier->nr_shards *= 2;
+    }
+    tier->shard_capacity = tier->capacity / tier->nr_shards;
+
+    // Remember twice as many IDs as fit, so a chunk's second read is still recognized after the
+    // tier turned over once
+    tier->max_seen = 2 * (tier->shard_capacity / chunk_sz);
+    tier->epoch = epoch;
+
+    for (uint32_t i = 0; i < ZN_DRAM_SHARDS; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        g_mutex_init(&shard->lock);
+        shard->entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_queue_init(&shard->lru);
+        shard->seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_queue_init(&shard->seen_order);
+        shard->used = 0;
+        shard->hits = 0;
+        shard->lookups = 0;
+    }
+}
+
+/**
+ * @brief Shard responsible for a data ID
+ *
+ * Hashed like the cache map's shards, so sequential IDs spread over all shards.
+ */
+static inline struct zn_dram_shard *
+zn_dram_shard(struct zn_dram_tier *tier, uint32_t id) {
+    return &tier->shards[((id * 2654435761u) >> (32 - ZN_DRAM_SHARD_BITS)) & (tier->nr_shards - 1)];
+}
+
+/**
+ * @brief Removes an entry from its shard and frees it
+ *
+ * Called with the shard lock held.
+ */
+static void
+zn_dram_remove_entry(struct zn_dram_shard *shard, struct zn_dram_entry *entry) {
+    g_queue_unlink(&shard->lru, &entry->link);
+    g_hash_table_remove(shard->entries, GUINT_TO_POINTER(entry->id));
+    shard->used -= g_bytes_get_size(entry->data);
+    g_bytes_unref(entry->data);
+    g_free(entry);
+}
+
+void
+zn_dram_destroy(struct zn_dram_tier *tier) {
+    for (uint32_t i = 0; i < ZN_DRAM_SHARDS; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        while (!g_queue_is_empty(&shard->lru)) {
+            zn_dram_remove_entry(shard, shard->lru.tail->data);
+        }
+        g_hash_table_destroy(shard->entries);
+        g_hash_table_destroy(shard->seen);
+        g_queue_clear(&shard->seen_order);
+        g_mutex_clear(&shard->lock);
+    }
+}
+
+bool
+zn_dram_enabled(struct zn_dram_tier *tier) {
+    return tier->capacity > 0;
+}
+
+GBytes *
+zn_dram_get(struct zn_dram_tier *tier, uint32_t id, struct zn_pair *location) {
+    if (!zn_dram_enabled(tier)) {
+        return NULL;
+    }
+
+    struct zn_dram_shard *shard = zn_dram_shard(tier, id);
+    g_mutex_lock(&shard->lock);
+    shard->lookups++;
+
+    struct zn_dram_entry *entry = g_hash_table_lookup(shard->entries, GUINT_TO_POINTER(id));
+    if (entry == NULL) {
+        g_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    shard->hits++;
+    g_queue_unlink(&shard->lru, &entry->link);
+    g_queue_push_head_link(&shard->lru, &entry->link);
+
+    // Invalidation takes this lock before the zone is retired, so the epoch holds off the reset
+    // of the zone
+    zn_epoch_enter(tier->epoch);
+    *location = entry->location;
+    GBytes *data = g_bytes_ref(entry->data);
+
+    g_mutex_unlock(&shard->lock);
+    return data;
+}
+
+bool
+zn_dram_should_admit(struct zn_dram_tier *tier, uint32_t id) {
+    if (!zn_dram_enabled(tier)) {
+        return false;
+    }
+
+    struct zn_dram_shard *shard = zn_dram_shard(tier, id);
+    g_mutex_lock(&shard->lock);
+
+    bool admit = false;
+    GList *seen = g_hash_table_lookup(shard->seen, GUINT_TO_POINTER(id));
+    if (seen != NULL) {
+        // Second read, forget it here since it moves into the tier
+        g_queue_delete_link(&shard->seen_order, seen);
+        g_hash_table_remove(shard->seen, GUINT_TO_POINTER(id));
+        admit = !g_hash_table_contains(shard->entries, GUINT_TO_POINTER(id));
+    } else if (!g_hash_table_contains(shard->entries, GUINT_TO_POINTER(id))) {
+        g_queue_push_head(&shard->seen_order, GUINT_TO_POINTER(id));
+        g_hash_table_insert(shard->seen, GUINT_TO_POINTER(id), shard->seen_order.head);
+
+        if (shard->seen_order.length > tier->max_seen) {
+            gpointer oldest = g_queue_pop_tail(&shard->seen_order);
+            g_hash_table_remove(shard->seen, oldest);
+        }
+    }
+
+    g_mutex_unlock(&shard->lock);
+    return admit;
+}
+
+void
+zn_dram_insert_locked(struct zn_dram_tier *tier, struct zn_pair location, GBytes *data) {
+    size_t len = g_bytes_get_size(data);
+    assert(len <= tier->shard_capacity);
+
+    struct zn_dram_shard *shard = zn_dram_shard(tier, location.id);
+    g_mutex_lock(&shard->lock);
+
+    // Another reader of the same chunk got here first
+    if (g_hash_table_contains(shard->entries, GUINT_TO_POINTER(location.id))) {
+        g_mutex_unlock(&shard->lock);
+        g_bytes_unref(data);
+        return;
+    }
+
+    while (shard->used + len > tier->shard_capacity) {
+        struct zn_dram_entry *victim = shard->lru.tail->data;
+        dbg_printf("DRAM tier evicting id=%u\n", victim->id);
+        zn_dram_remove_entry(shard, victim);
+    }
+
+    struct zn_dram_entry *entry = g_new0(struct zn_dram_entry, 1);
+    entry->id = location.id;
+    entry->location = location;
+    entry->data = data;
+    entry->link.data = entry;
+    g_queue_push_head_link(&shard->lru, &entry->link);
+    g_hash_table_insert(shard->entries, GUINT_TO_POINTER(location.id), entry);
+    shard->used += len;
+
+    g_mutex_unlock(&shard->lock);
+}
+
+void
+zn_dram_relocate_locked(struct zn_dram_tier *tier, uint32_t id, struct zn_pair location) {
+    if (!zn_dram_enabled(tier)) {
+        return;
+    }
+
+    struct zn_dram_shard *shard = zn_dram_shard(tier, id);
+    g_mutex_lock(&shard->lock);
+    struct zn_dram_entry *entry = g_hash_table_lookup(shard->entries, GUINT_TO_POINTER(id));
+    if (entry != NULL) {
+        entry->location = location;
+    }
+    g_mutex_unlock(&shard->lock);
+}
+
+void
+zn_dram_invalidate_locked(struct zn_dram_tier *tier, uint32_t id) {
+    if (!zn_dram_enabled(tier)) {
+        return;
+    }
+
+    struct zn_dram_shard *shard = zn_dram_shard(tier, id);
+    g_mutex_lock(&shard->lock);
+    struct zn_dram_entry *entry = g_hash_table_lookup(shard->entries, GUINT_TO_POINTER(id));
+    if (entry != NULL) {
+        zn_dram_remove_entry(shard, entry);
+    }
+    g_mutex_unlock(&shard->lock);
+}
+
+double
+zn_dram_hit_ratio(struct zn_dram_tier *tier) {
+    double num = 0, den = 0;
+    for (uint32_t i = 0; i < tier->nr_shards; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        g_mutex_lock(&shard->lock);
+        num += shard->hits;
+        den += shard->lookups;
+        g_mutex_unlock(&shard->lock);
+    }
+    if (den == 0) {
+        return 0;
+    }
+    return num / den;
+}
@@ -0,0 +1,145 @@
+#include "znepoch.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+
+void
+zn_epoch_init(struct zn_epoch *epoch) {
+    epoch->global = 2;
+    epoch->slots = g_new0(struct zn_epoch_slot, ZN_MAX_THREADS);
+    g_mutex_init(&epoch->lock);
+    g_mutex_init(&epoch->shared_lock);
+    g_queue_init(&epoch->retired);
+}
+
+void
+zn_epoch_destroy(struct zn_epoch *epoch) {
+    g_queue_clear_full(&epoch->retired, g_free);
+    g_mutex_clear(&epoch->lock);
+    g_mutex_clear(&epoch->shared_lock);
+    g_free(epoch->slots);
+    epoch->slots = NULL;
+}
+
+void
+zn_epoch_enter(struct zn_epoch *epoch) {
+    uint32_t index = zn_thread_index();
+    struct zn_epoch_slot *slot = &epoch->slots[index];
+
+    // Threads sharing the slot keep it in the oldest epoch one of them entered, until all of
+    // them left
+    bool shared = index == ZN_THREAD_SHARED;
+    if (shared) {
+        g_mutex_lock(&epoch->shared_lock);
+    }
+    if (slot->nest++ == 0) {
+        // A stale epoch is only more conservative. The store is ordered before the lookups that
+        // follow, so a reclaim that doesn't see it started after them.
+        g_atomic_int_set(&slot->epoch, g_atomic_int_get(&epoch->global) | 1);
+    }
+    if (shared) {
+        g_mutex_unlock(&epoch->shared_lock);
+    }
+}
+
+void
+zn_epoch_exit(struct zn_epoch *epoch) {
+    uint32_t index = zn_thread_index();
+    struct zn_epoch_slot *slot = &epoch->slots[index];
+
+    bool shared = index == ZN_THREAD_SHARED;
+    if (shared) {
+        g_mutex_lock(&epoch->shared_lock);
+    }
+    assert(slot->nest > 0);
+    if (--slot->nest == 0) {
+        g_atomic_int_set(&slot->epoch, 0);
+    }
+    if (shared) {
+        g_mutex_unlock(&epoch->shared_lock);
+    }
+}
+
+void
+zn_epoch_retire(struct zn_epoch *epoch, uint32_t zone) {
+    zn_epoch_retire_zones(epoch, &zone, 1);
+}
+
+void
+zn_epoch_retire_zones(struct zn_epoch *epoch, const uint32_t *zones, uint32_t nr_zones) {
+    g_mutex_lock(&epoch->lock);
+    // The zones were cleared before the epoch moves on, readers of the new epoch can't find them
+    gint retired_at = (gint) ((guint) g_atomic_int_add(&epoch->global, 2) + 2);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        struct zn_epoch_retired *r = g_new(struct zn_epoch_retired, 1);
+        r->zone = zones[i];
+        r->epoch = retired_at;
+        dbg_printf("Retired zone=%u at epoch=%d\n", r->zone, r->epoch);
+        g_queue_push_tail(&epoch->retired, r);
+    }
+    g_mutex_unlock(&epoch->lock);
+}
+
+uint32_t
+zn_epoch_nr_retired(struct zn_epoch *epoch) {
+    g_mutex_lock(&epoch->lock);
+    uint32_t nr = epoch->retired.length;
+    g_mutex_unlock(&epoch->lock);
+    return nr;
+}
+
+uint32_t
+zn_epoch_reclaim(struct zn_epoch *epoch,
+                 void (*reset)(const uint32_t *zones, uint32_t nr_zones, void *user_data),
+                 void *user_data) {
+    GQueue ready = G_QUEUE_INIT;
+
+    // Scan with the lock held, so every zone in the queue was retired before the scan
+    g_mutex_lock(&epoch->lock);
+    if (g_queue_is_empty(&epoch->retired)) {
+        g_mutex_unlock(&epoch->lock);
+        return 0;
+    }
+
+    bool active = false;
+    gint oldest = 0;
+    uint32_t bound = zn_thread_index_bound();
+    for (uint32_t i = 0; i < bound; i++) {
+        gint e = g_atomic_int_get(&epoch->slots[i].epoch);
+        if (e == 0) {
+            continue;
+        }
+        e &= ~1;
+        // Epochs wrap around, compare their distance
+        if (!active || (gint) ((guint) e - (guint) oldest) < 0) {
+            oldest = e;
+            active = true;
+        }
+    }
+
+    while (!g_queue_is_empty(&epoch->retired)) {
+        struct zn_epoch_retired *r = g_queue_peek_head(&epoch->retired);
+        if (active && (gint) ((guint) oldest - (guint) r->epoch) < 0) {
+            break;
+        }
+        g_queue_push_tail(&ready, g_queue_pop_head(&epoch->retired));
+    }
+    g_mutex_unlock(&epoch->lock);
+
+    // Zones that are reclaimed together are reset together
+    uint32_t nr = ready.length;
+    if (nr == 0) {
+        return 0;
+    }
+    uint32_t *zones = g_new(uint32_t, nr);
+    struct zn_epoch_retired *r;
+    for (uint32_t i = 0; (r = g_queue_pop_head(&ready)) != NULL; i++) {
+        dbg_printf("Reclaiming zone=%u retired at epoch=%d\n", r->zone, r->epoch);
+        zones[i] = r->zone;
+        g_free(r);
+    }
+    reset(zones, nr, user_data);
+    g_free(zones);
+    return nr;
+}
@@ -0,0 +1,209 @@
+#include "znindex.h"
+
+#include <assert.h>
+
+#define ZN_INDEX_VERSION_ONE (1u << ZN_INDEX_STATE_BITS)
+#define ZN_INDEX_MIN_SLOTS 64
+
+/**
+ * @brief Most entries an index with `mask + 1` slots takes, 15/16 of the slots
+ *
+ * Keeps probe sequences finite, a writer looking for a free slot always finds one.
+ */
+#define ZN_INDEX_MAX_ENTRIES(mask) ((mask) + 1 - ((mask) + 1) / 16)
+
+/**
+ * @brief Tells the CPU the thread is spinning on a value another thread writes
+ */
+static inline void
+zn_index_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/**
+ * @brief Home slot of a Data ID
+ *
+ * Uses the murmur3 finalizer, the cache map picks shards from a different hash of the ID so
+ * the IDs of one shard still spread over all slots.
+ */
+static inline uint64_t
+zn_index_home(const struct zn_index *index, uint32_t id) {
+    uint32_t h = id;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h & index->mask;
+}
+
+static inline bool
+zn_index_meta_writing(uint32_t meta) {
+    return (meta & ZN_INDEX_VERSION_ONE) != 0;
+}
+
+/**
+ * @brief Copies a slot, retrying until the copy is consistent
+ */
+static inline void
+zn_index_read_slot(struct zn_index_entry *slot, struct zn_index_entry *out) {
+    while (true) {
+        uint32_t meta = g_atomic_int_get((gint *) &slot->meta);
+        if (zn_index_meta_writing(meta)) {
+            zn_index_pause();
+            continue;
+        }
+        out->id = g_atomic_int_get((gint *) &slot->id);
+        out->zone = g_atomic_int_get((gint *) &slot->zone);
+        out->chunk_offset = g_atomic_int_get((gint *) &slot->chunk_offset);
+        if ((uint32_t) g_atomic_int_get((gint *) &slot->meta) == meta) {
+            out->meta = meta;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Overwrites a slot so concurrent readers never see it half written
+ */
+static inline void
+zn_index_write_slot(struct zn_index_entry *slot, uint32_t id, enum zn_index_state state,
+                    uint32_t zone, uint32_t chunk_offset) {
+    uint32_t old = slot->meta;
+    uint32_t version = old & ~ZN_INDEX_STATE_MASK;
+    g_atomic_int_set((gint *) &slot->meta,
+                     (version + ZN_INDEX_VERSION_ONE) | (old & ZN_INDEX_STATE_MASK));
+    g_atomic_int_set((gint *) &slot->id, id);
+    g_atomic_int_set((gint *) &slot->zone, zone);
+    g_atomic_int_set((gint *) &slot->chunk_offset, chunk_offset);
+    g_atomic_int_set((gint *) &slot->meta, (version + 2 * ZN_INDEX_VERSION_ONE) | state);
+}
+
+void
+zn_index_init(struct zn_index *index, uint64_t capacity) {
+    uint64_t nr_slots = ZN_INDEX_MIN_SLOTS;
+    while (nr_slots < 2 * capacity) {
+        nr_slots <<= 1;
+    }
+
+    index->slots = g_new0(struct zn_index_entry, nr_slots);
+    index->mask = nr_slots - 1;
+    index->count = 0;
+    index->shift_seq = 0;
+}
+
+void
+zn_index_destroy(struct zn_index *index) {
+    g_free(index->slots);
+    index->slots = NULL;
+}
+
+bool
+zn_index_lookup(struct zn_index *index, uint32_t id, struct zn_index_entry *entry, uint64_t *slot) {
+    while (true) {
+        gint seq = g_atomic_int_get(&index->shift_seq);
+        if (seq & 1) {
+            zn_index_pause();
+            continue;
+        }
+
+        bool found = false;
+        uint64_t pos = zn_index_home(index, id);
+        while (true) {
+            zn_index_read_slot(&index->slots[pos], entry);
+            if (zn_index_entry_state(entry) == ZN_INDEX_EMPTY) {
+                break;
+            }
+            if (entry->id == id) {
+                found = true;
+                *slot = pos;
+                break;
+            }
+            pos = (pos + 1) & index->mask;
+        }
+
+        // A removal may have moved the entry across the slots that were probed
+        if (g_atomic_int_get(&index->shift_seq) == seq) {
+            return found;
+        }
+    }
+}
+
+/**
+ * @brief Finds the slot of a Data ID, called by writers
+ *
+ * @return Slot of the ID, or of the empty slot that ends its probe sequence
+ */
+static uint64_t
+zn_index_find_slot(struct zn_index *index, uint32_t id) {
+    uint64_t pos = zn_index_home(index, id);
+    while ((index->slots[pos].meta & ZN_INDEX_STATE_MASK) != ZN_INDEX_EMPTY &&
+           index->slots[pos].id != id) {
+        pos = (pos + 1) & index->mask;
+    }
+    return pos;
+}
+
+int
+zn_index_insert(struct zn_index *index, uint32_t id, enum zn_index_state state, uint32_t zone,
+                uint32_t chunk_offset) {
+    assert(state != ZN_INDEX_EMPTY);
+    if (index->count >= ZN_INDEX_MAX_ENTRIES(index->mask)) {
+        return -1;
+    }
+
+    uint64_t pos = zn_index_find_slot(index, id);
+    assert((index->slots[pos].meta & ZN_INDEX_STATE_MASK) == ZN_INDEX_EMPTY);
+
+    zn_index_write_slot(&index->slots[pos], id, state, zone, chunk_offset);
+    index->count++;
+    return 0;
+}
+
+void
+zn_index_update(struct zn_index *index, uint32_t id, enum zn_index_state state, uint32_t zone,
+                uint32_t chunk_offset) {
+    assert(state != ZN_INDEX_EMPTY);
+
+    uint64_t pos = zn_index_find_slot(index, id);
+    assert((index->slots[pos].meta & ZN_INDEX_STATE_MASK) != ZN_INDEX_EMPTY);
+
+    zn_index_write_slot(&index->slots[pos], id, state, zone, chunk_offset);
+}
+
+bool
+zn_index_remove(struct zn_index *index, uint32_t id) {
+    uint64_t hole = zn_index_find_slot(index, id);
+    if ((index->slots[hole].meta & ZN_INDEX_STATE_MASK) == ZN_INDEX_EMPTY) {
+        return false;
+    }
+
+    g_atomic_int_inc(&index->shift_seq);
+
+    // Move back every following entry of the cluster whose home slot is at or before the hole,
+    // so no probe sequence is cut short by the hole
+    uint64_t pos = hole;
+    while (true) {
+        pos = (pos + 1) & index->mask;
+        struct zn_index_entry *next = &index->slots[pos];
+        if ((next->meta & ZN_INDEX_STATE_MASK) == ZN_INDEX_EMPTY) {
+            break;
+        }
+
+        uint64_t home = zn_index_home(index, next->id);
+        if (((pos - home) & index->mask) >= ((pos - hole) & index->mask)) {
+            zn_index_write_slot(&index->slots[hole], next->id, next->meta & ZN_INDEX_STATE_MASK,
+                                next->zone, next->chunk_offset);
+            hole = pos;
+        }
+    }
+    zn_index_write_slot(&index->slots[hole], 0, ZN_INDEX_EMPTY, 0, 0);
+    index->count--;
+
+    g_atomic_int_inc(&index->shift_seq);
+    return true;
+}
@@ -0,0 +1,118 @@
+#include "zninflight.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <string.h>
+
+/**
+ * @brief Packs a location into a table key
+ */
+static inline gint64
+zn_inflight_key(struct zn_pair location) {
+    return ((gint64) location.zone << 32) | location.chunk_offset;
+}
+
+void
+zn_inflight_init(struct zn_inflight *inflight) {
+    g_mutex_init(&inflight->lock);
+    inflight->reads = g_hash_table_new(g_int64_hash, g_int64_equal);
+}
+
+void
+zn_inflight_destroy(struct zn_inflight *inflight) {
+    assert(g_hash_table_size(inflight->reads) == 0);
+    g_hash_table_destroy(inflight->reads);
+    g_mutex_clear(&inflight->lock);
+}
+
+static void
+zn_inflight_free(struct zn_inflight_read *read) {
+    if (read->data != NULL) {
+        g_bytes_unref(read->data);
+    }
+    g_cond_clear(&read->cond);
+    g_free(read);
+}
+
+bool
+zn_inflight_begin(struct zn_inflight *inflight, struct zn_pair location, const struct iovec *iov,
+                  int iovcnt, struct zn_inflight_read **read, int *ret) {
+    gint64 key = zn_inflight_key(location);
+
+    g_mutex_lock(&inflight->lock);
+
+    struct zn_inflight_read *r = g_hash_table_lookup(inflight->reads, &key);
+    if (r == NULL) {
+        r = g_new0(struct zn_inflight_read, 1);
+        r->key = key;
+        g_cond_init(&r->cond);
+        g_hash_table_insert(inflight->reads, &r->key, r);
+        g_mutex_unlock(&inflight->lock);
+
+        *read = r;
+        return true;
+    }
+
+    // Another thread is reading this location already, wait for its copy
+    r->joiners++;
+    while (!r->done) {
+        g_cond_wait(&r->cond, &inflight->lock);
+    }
+    *ret = r->ret;
+    GBytes *data = r->data != NULL ? g_bytes_ref(r->data) : NULL;
+    bool last = --r->joiners == 0;
+    g_mutex_unlock(&inflight->lock);
+
+    if (last) {
+        zn_inflight_free(r);
+    }
+
+    if (data != NULL) {
+        const unsigned char *src = g_bytes_get_data(data, NULL);
+        for (size_t off = 0, i = 0; i < (size_t) iovcnt; off += iov[i].iov_len, i++) {
+            memcpy(iov[i].iov_base, src + off, iov[i].iov_len);
+        }
+        g_bytes_unref(data);
+    }
+
+    dbg_printf("[%u,%u] joined in-flight read\n", location.zone, location.chunk_offset);
+    *read = NULL;
+    return false;
+}
+
+void
+zn_inflight_end(struct zn_inflight *inflight, struct zn_inflight_read *read,
+                const struct iovec *iov, int iovcnt, int ret) {
+    // Once the read is out of the table nobody else joins, so the joiner count only drops
+    g_mutex_lock(&inflight->lock);
+    g_hash_table_remove(inflight->reads, &read->key);
+    uint32_t joiners = read->joiners;
+    g_mutex_unlock(&inflight->lock);
+
+    // Copy without the lock, reads of other locations don't wait for it
+    GBytes *data = NULL;
+    if (joiners > 0 && ret == 0) {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            len += iov[i].iov_len;
+        }
+        unsigned char *copy = g_malloc(len);
+        for (size_t off = 0, i = 0; i < (size_t) iovcnt; off += iov[i].iov_len, i++) {
+            memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+        }
+        data = g_bytes_new_take(copy, len);
+    }
+
+    g_mutex_lock(&inflight->lock);
+    read->ret = ret;
+    read->data = data;
+    read->done = true;
+    bool last = read->joiners == 0;
+    g_cond_broadcast(&read->cond);
+    g_mutex_unlock(&inflight->lock);
+
+    if (last) {
+        zn_inflight_free(read);
+    }
+}
@@ -0,0 +1,450 @@
+// For pread, and the full set of types liburing expects
+#define _GNU_SOURCE
+#include "znio.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/nvme_ioctl.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define NVME_CMD_ZONE_APPEND 0x7d
+#define NVME_MAX_NLB (1u << 16) /**< Number of logical blocks is a 0's based 16 bit field */
+#define ZN_IO_DEFAULT_MAX_WRITE (1024 * 1024) /**< Used when the device doesn't report a limit */
+
+void
+zn_io_init(struct zn_io *io, int fd, uint32_t queue_depth) {
+    assert(io);
+    assert(queue_depth > 0);
+
+    io->fd = fd;
+    io->queue_depth = queue_depth;
+    io->nsid = 0;
+    io->lba_size = 0;
+
+    uint64_t max_write = 0;
+    if (max_write_bytes(fd, &max_write) != 0) {
+        max_write = ZN_IO_DEFAULT_MAX_WRITE;
+    }
+    io->max_write = max_write;
+
+    g_mutex_init(&io->sync_lock);
+    g_cond_init(&io->sync_cond);
+    io->sync_requested = 0;
+    io->sync_completed = 0;
+    io->syncing = false;
+}
+
+uint32_t
+zn_io_iov_reqs(const struct zn_io *io, const struct iovec *iov, int iovcnt) {
+    return zn_io_prep_iov(io, NULL, ZN_IO_OP_READ, iov, iovcnt, 0, false);
+}
+
+uint32_t
+zn_io_prep_iov(const struct zn_io *io, struct zn_io_req *reqs, enum zn_io_op op,
+               const struct iovec *iov, int iovcnt, uint64_t offset, bool link) {
+    assert(op == ZN_IO_OP_READ || op == ZN_IO_OP_WRITE);
+    enum zn_io_op vop = (op == ZN_IO_OP_READ) ? ZN_IO_OP_READV : ZN_IO_OP_WRITEV;
+
+    // Only counts the requests when reqs is NULL
+    uint32_t nr = 0;
+    for (int i = 0; i < iovcnt;) {
+        // Large segments are split
+        if (iov[i].iov_len > io->max_write) {
+            unsigned char *base = iov[i].iov_base;
+            size_t done = 0;
+            while (done < iov[i].iov_len) {
+                size_t len = MIN(io->max_write, iov[i].iov_len - done);
+                if (reqs != NULL) {
+                    reqs[nr] = (struct zn_io_req) {
+                        .op = op,
+                        .buf = base + done,
+                        .len = len,
+                        .offset = offset,
+                        .link = link,
+                    };
+                }
+                nr++;
+                done += len;
+                offset += len;
+            }
+            i++;
+            continue;
+        }
+
+        // Small ones are combined
+        int count = 1;
+        size_t len = iov[i].iov_len;
+        while (i + count < iovcnt && count < IOV_MAX &&
+               len + iov[i + count].iov_len <= io->max_write) {
+            len += iov[i + count].iov_len;
+            count++;
+        }
+
+        if (reqs != NULL) {
+            reqs[nr] = (struct zn_io_req) {
+                .op = (count == 1) ? op : vop,
+                .buf = iov[i].iov_base,
+                .iov = &iov[i],
+                .iovcnt = count,
+                .len = len,
+                .offset = offset,
+                .link = link,
+            };
+        }
+        nr++;
+        offset += len;
+        i += count;
+    }
+
+    if (reqs != NULL && nr > 0) {
+        reqs[nr - 1].link = false;
+    }
+    return nr;
+}
+
+int
+zn_io_sync(struct zn_io *io) {
+    g_mutex_lock(&io->sync_lock);
+    uint64_t ticket = ++io->sync_requested;
+
+    while (io->sync_completed < ticket) {
+        if (io->syncing) {
+            g_cond_wait(&io->sync_cond, &io->sync_lock);
+            continue;
+        }
+
+        // Become the leader, the flush covers every request handed out so far
+        io->syncing = true;
+        uint64_t target = io->sync_requested;
+        g_mutex_unlock(&io->sync_lock);
+
+        int ret = fdatasync(io->fd);
+        int saved = errno;
+
+        g_mutex_lock(&io->sync_lock);
+        io->syncing = false;
+        if (ret == 0) {
+            io->sync_completed = MAX(io->sync_completed, target);
+        }
+        g_cond_broadcast(&io->sync_cond);
+
+        // Waiters covered by a failed flush retry it themselves
+        if (ret != 0) {
+            g_mutex_unlock(&io->sync_lock);
+            dbg_printf("Couldn't flush fd=%d: %s\n", io->fd, strerror(saved));
+            return -saved;
+        }
+    }
+
+    g_mutex_unlock(&io->sync_lock);
+    return 0;
+}
+
+int
+zn_io_zone_append_init(struct zn_io *io, uint32_t lba_size) {
+    assert(lba_size > 0);
+
+    int nsid = ioctl(io->fd, NVME_IOCTL_ID);
+    if (nsid <= 0) {
+        dbg_printf("Couldn't get NVMe namespace of fd=%d\n", io->fd);
+        return -1;
+    }
+
+    io->nsid = nsid;
+    io->lba_size = lba_size;
+    return 0;
+}
+
+int
+zn_io_zone_append(struct zn_io *io, const void *buf, size_t len, uint64_t zone_start,
+                  uint64_t *written_offset) {
+    assert(io->nsid != 0);
+    assert(len % io->lba_size == 0);
+    assert(zone_start % io->lba_size == 0);
+    assert(len / io->lba_size <= NVME_MAX_NLB);
+
+    uint64_t zslba = zone_start / io->lba_size;
+    uint32_t nlb = len / io->lba_size;
+
+    struct nvme_passthru_cmd64 cmd = {
+        .opcode = NVME_CMD_ZONE_APPEND,
+        .nsid = io->nsid,
+        .addr = (uint64_t) (uintptr_t) buf,
+        .data_len = len,
+        .cdw10 = zslba & 0xffffffff,
+        .cdw11 = zslba >> 32,
+        .cdw12 = nlb - 1,
+    };
+
+    // Negative on ioctl failure, positive for an NVMe status
+    int ret = ioctl(io->fd, NVME_IOCTL_IO64_CMD, &cmd);
+    if (ret != 0) {
+        dbg_printf("Zone append to zone at %" PRIu64 " failed: %d\n", zone_start, ret);
+        return -1;
+    }
+
+    // The completion carries the first LBA that was written
+    *written_offset = cmd.result * io->lba_size;
+    return 0;
+}
+
+#ifdef ZN_IO_URING
+#    include <liburing.h>
+
+/**
+ * @struct zn_io_ring
+ * @brief The io_uring owned by a single submitting thread
+ */
+struct zn_io_ring {
+    struct io_uring ring;
+    uint32_t depth;            /**< Maximum requests queued and in flight */
+    uint32_t queued;           /**< Prepared but not yet submitted */
+    uint32_t inflight;         /**< Submitted but not yet completed */
+    struct io_uring_sqe *last; /**< Last prepared sqe, chains are terminated here on submit */
+};
+
+static void
+zn_io_ring_free(gpointer data) {
+    struct zn_io_ring *r = data;
+    io_uring_queue_exit(&r->ring);
+    g_free(r);
+}
+
+static GPrivate zn_io_thread_ring = G_PRIVATE_INIT(zn_io_ring_free);
+
+/**
+ * @brief Gets the ring of the calling thread, creating it on first use
+ *
+ * @return 0 on success or -errno
+ */
+static int
+zn_io_get_ring(struct zn_io *io, struct zn_io_ring **ring) {
+    struct zn_io_ring *r = g_private_get(&zn_io_thread_ring);
+    if (r == NULL) {
+        r = g_new0(struct zn_io_ring, 1);
+        int ret = io_uring_queue_init(io->queue_depth, &r->ring, 0);
+        if (ret < 0) {
+            dbg_printf("Couldn't set up io_uring: %s\n", strerror(-ret));
+            g_free(r);
+            return ret;
+        }
+        r->depth = io->queue_depth;
+        g_private_set(&zn_io_thread_ring, r);
+    }
+
+    *ring = r;
+    return 0;
+}
+
+/**
+ * @brief Submits all prepared requests
+ */
+static int
+zn_io_flush(struct zn_io_ring *r) {
+    if (r->queued == 0) {
+        return 0;
+    }
+
+    // A chain can't span two submissions, it is continued by the caller
+    r->last->flags &= ~IOSQE_IO_LINK;
+
+    int ret = io_uring_submit(&r->ring);
+    if (ret < 0) {
+        return ret;
+    }
+    assert((uint32_t) ret == r->queued);
+
+    r->inflight += r->queued;
+    r->queued = 0;
+    r->last = NULL;
+    return 0;
+}
+
+/**
+ * @brief Reaps completions until at most `max_inflight` requests remain in flight
+ */
+static int
+zn_io_reap(struct zn_io_ring *r, uint32_t max_inflight) {
+    while (r->inflight > max_inflight) {
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&r->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        struct zn_io_req *req = io_uring_cqe_get_data(cqe);
+        req->res = cqe->res;
+        io_uring_cqe_seen(&r->ring, cqe);
+        r->inflight--;
+    }
+    return 0;
+}
+
+int
+zn_io_submit(struct zn_io *io, struct zn_io_req *reqs, uint32_t nr) {
+    struct zn_io_ring *r;
+    int ret = zn_io_get_ring(io, &r);
+    if (ret != 0) {
+        return ret;
+    }
+
+    bool cancel = false;
+    for (uint32_t i = 0; i < nr; i++) {
+        struct zn_io_req *req = &reqs[i];
+        bool chained = (i > 0) && reqs[i - 1].link;
+        if (!chained) {
+            cancel = false;
+        }
+
+        // Ring is full, make room. A chain that is split here is continued
+        // once all of its earlier members have completed.
+        if (!cancel && r->queued + r->inflight >= r->depth) {
+            ret = zn_io_flush(r);
+            if (ret == 0) {
+                ret = zn_io_reap(r, chained ? 0 : r->depth - 1);
+            }
+            if (ret != 0) {
+                return ret;
+            }
+            cancel = chained && !zn_io_req_ok(&reqs[i - 1]);
+        }
+
+        if (cancel) {
+            req->res = -ECANCELED;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+        assert(sqe);
+        switch (req->op) {
+            case ZN_IO_OP_READ:
+                io_uring_prep_read(sqe, io->fd, req->buf, req->len, req->offset);
+                break;
+            case ZN_IO_OP_WRITE:
+                io_uring_prep_write(sqe, io->fd, req->buf, req->len, req->offset);
+                break;
+            case ZN_IO_OP_FSYNC:
+                io_uring_prep_fsync(sqe, io->fd, 0);
+                break;
+            case ZN_IO_OP_READV:
+                io_uring_prep_readv(sqe, io->fd, req->iov, req->iovcnt, req->offset);
+                break;
+            case ZN_IO_OP_WRITEV:
+                io_uring_prep_writev(sqe, io->fd, req->iov, req->iovcnt, req->offset);
+                break;
+        }
+        io_uring_sqe_set_flags(sqe, req->link ? IOSQE_IO_LINK : 0);
+        io_uring_sqe_set_data(sqe, req);
+
+        r->queued++;
+        r->last = sqe;
+    }
+
+    return zn_io_flush(r);
+}
+
+int
+zn_io_wait(struct zn_io *io) {
+    struct zn_io_ring *r;
+    int ret = zn_io_get_ring(io, &r);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = zn_io_flush(r);
+    if (ret != 0) {
+        return ret;
+    }
+    return zn_io_reap(r, 0);
+}
+
+#else
+
+/**
+ * @brief Executes a single request synchronously
+ */
+static ssize_t
+zn_io_exec(struct zn_io *io, struct zn_io_req *req) {
+    ssize_t ret = -1;
+    errno = 0;
+    switch (req->op) {
+        case ZN_IO_OP_READ:
+            ret = pread(io->fd, req->buf, req->len, req->offset);
+            break;
+        case ZN_IO_OP_WRITE:
+            ret = pwrite(io->fd, req->buf, req->len, req->offset);
+            break;
+        case ZN_IO_OP_FSYNC:
+            ret = fsync(io->fd);
+            break;
+        case ZN_IO_OP_READV:
+            ret = preadv(io->fd, req->iov, req->iovcnt, req->offset);
+            break;
+        case ZN_IO_OP_WRITEV:
+            ret = pwritev(io->fd, req->iov, req->iovcnt, req->offset);
+            break;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+int
+zn_io_submit(struct zn_io *io, struct zn_io_req *reqs, uint32_t nr) {
+    bool cancel = false;
+    for (uint32_t i = 0; i < nr; i++) {
+        struct zn_io_req *req = &reqs[i];
+        bool chained = (i > 0) && reqs[i - 1].link;
+        if (!chained) {
+            cancel = false;
+        }
+
+        if (cancel) {
+            req->res = -ECANCELED;
+            continue;
+        }
+
+        req->res = zn_io_exec(io, req);
+        cancel = req->link && !zn_io_req_ok(req);
+    }
+    return 0;
+}
+
+int
+zn_io_wait(struct zn_io *io) {
+    (void) io;
+    // Everything completed on submission
+    return 0;
+}
+
+#endif
+
+int
+zn_io_run(struct zn_io *io, struct zn_io_req *reqs, uint32_t nr) {
+    int ret = zn_io_submit(io, reqs, nr);
+    // Always wait, a failed submission can still leave earlier requests in flight
+    int wait_ret = zn_io_wait(io);
+    if (ret == 0) {
+        ret = wait_ret;
+    }
+    if (ret != 0) {
+        dbg_printf("I/O engine error: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < nr; i++) {
+        if (!zn_io_req_ok(&reqs[i])) {
+            dbg_printf("Request %u failed: res=%zd, len=%zu\n", i, reqs[i].res, reqs[i].len);
+            return -1;
+        }
+    }
+    return 0;
+}
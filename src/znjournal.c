@@ -0,0 +1,432 @@
+#include "znjournal.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ZN_JOURNAL_READ_RECORDS 32768 /**< Records read at once during a replay */
+
+uint32_t
+zn_journal_checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void
+zn_chunk_header_init(struct zn_chunk_header *header, uint32_t id, uint32_t length,
+                     uint64_t generation) {
+    *header = (struct zn_chunk_header) {
+        .id = id,
+        .magic = ZN_CHUNK_MAGIC,
+        .generation = generation,
+        .length = length,
+    };
+    header->checksum = zn_journal_checksum(header, offsetof(struct zn_chunk_header, checksum));
+}
+
+bool
+zn_chunk_header_valid(const struct zn_chunk_header *header) {
+    return header->magic == ZN_CHUNK_MAGIC &&
+           header->checksum ==
+               zn_journal_checksum(header, offsetof(struct zn_chunk_header, checksum));
+}
+
+static bool
+zn_journal_record_valid(const struct zn_journal_record *record) {
+    return record->op >= ZN_JOURNAL_INSERT && record->op <= ZN_JOURNAL_CLEAR_ZONE &&
+           record->checksum ==
+               zn_journal_checksum(record, offsetof(struct zn_journal_record, checksum));
+}
+
+/**
+ * @brief Writes all of `len` bytes, retrying short writes
+ */
+static int
+zn_journal_write_all(int fd, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Couldn't write the journal: '%s'\n", strerror(errno));
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads up to `len` bytes, fewer only at the end of the file
+ *
+ * @return Bytes read, -1 on error
+ */
+static ssize_t
+zn_journal_read_all(int fd, void *data, size_t len) {
+    unsigned char *p = data;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, p + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Couldn't read the journal: '%s'\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += (size_t) n;
+    }
+    return (ssize_t) total;
+}
+
+/**
+ * @brief Stops journaling and removes the file, the lock must be held
+ *
+ * A journal with a hole, or one that isn't durable when it must be, can't be
+ * replayed. The next start is a cold one.
+ */
+static void
+zn_journal_stop_locked(struct zn_journal *journal) {
+    fprintf(stderr, "Journaling stopped, %s won't be replayed\n", journal->path);
+    journal->failed = true;
+    close(journal->fd);
+    journal->fd = -1;
+    unlink(journal->path);
+}
+
+/**
+ * @brief Writes the buffered records to the file, the lock must be held
+ */
+static int
+zn_journal_flush_locked(struct zn_journal *journal) {
+    if (journal->nr_buffered == 0) {
+        return 0;
+    }
+
+    int ret = zn_journal_write_all(journal->fd, journal->buffer,
+                                   journal->nr_buffered * sizeof(struct zn_journal_record));
+    journal->nr_buffered = 0;
+    if (ret != 0) {
+        zn_journal_stop_locked(journal);
+    }
+    return ret;
+}
+
+void
+zn_journal_init(struct zn_journal *journal) {
+    g_mutex_init(&journal->lock);
+    journal->fd = -1;
+    journal->path = NULL;
+    memset(&journal->header, 0, sizeof(journal->header));
+    journal->buffer = g_new(struct zn_journal_record, ZN_JOURNAL_BUFFER_RECORDS);
+    journal->nr_buffered = 0;
+    journal->nr_records = 0;
+    journal->compact_at = ZN_JOURNAL_MIN_COMPACT;
+    journal->generation = 1;
+    journal->failed = false;
+}
+
+void
+zn_journal_destroy(struct zn_journal *journal) {
+    if (journal->fd >= 0) {
+        (void) zn_journal_sync(journal);
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    g_free(journal->buffer);
+    journal->buffer = NULL;
+    g_free(journal->path);
+    journal->path = NULL;
+    g_mutex_clear(&journal->lock);
+}
+
+/**
+ * @brief Reads the header of a journal file and checks it against the device
+ *
+ * @return Open file positioned at the first record, -1 if it can't be replayed
+ */
+static int
+zn_journal_open_header(const char *path, struct zn_journal_header *header) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (zn_journal_read_all(fd, header, sizeof(*header)) != (ssize_t) sizeof(*header) ||
+        header->magic != ZN_JOURNAL_MAGIC || header->version != ZN_JOURNAL_VERSION ||
+        header->checksum !=
+            zn_journal_checksum(header, offsetof(struct zn_journal_header, checksum))) {
+        dbg_printf("%s is not a journal\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool
+zn_journal_matches(const char *path, size_t chunk_sz, uint64_t zone_cap, uint32_t nr_zones) {
+    struct zn_journal_header header;
+    int fd = zn_journal_open_header(path, &header);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+
+    if (header.chunk_sz != chunk_sz || header.zone_cap != zone_cap ||
+        header.nr_zones != nr_zones) {
+        fprintf(stderr, "Journal %s was written for another chunk size or device\n", path);
+        return false;
+    }
+    return true;
+}
+
+int64_t
+zn_journal_replay(const char *path, void (*apply)(const struct zn_journal_record *record,
+                                                  void *user_data),
+                  void *user_data, uint64_t *generation, bool *torn) {
+    *torn = false;
+    struct zn_journal_header header;
+    int fd = zn_journal_open_header(path, &header);
+    if (fd < 0) {
+        return -1;
+    }
+
+    *generation = MAX(header.generation, 1);
+    struct zn_journal_record *records = g_new(struct zn_journal_record, ZN_JOURNAL_READ_RECORDS);
+    int64_t nr_replayed = 0;
+    while (!*torn) {
+        ssize_t n = zn_journal_read_all(fd, records, ZN_JOURNAL_READ_RECORDS * sizeof(*records));
+        if (n < 0) {
+            nr_replayed = -1;
+            break;
+        }
+
+        size_t nr = (size_t) n / sizeof(*records);
+        for (size_t i = 0; i < nr; i++) {
+            if (!zn_journal_record_valid(&records[i])) {
+                dbg_printf("Journal torn after %" PRId64 " records\n", nr_replayed);
+                *torn = true;
+                break;
+            }
+            *generation = MAX(*generation, records[i].generation + 1);
+            apply(&records[i], user_data);
+            nr_replayed++;
+        }
+        if ((size_t) n < ZN_JOURNAL_READ_RECORDS * sizeof(*records)) {
+            // A partial record at the end was cut off by a crash
+            *torn = *torn || (size_t) n % sizeof(*records) != 0;
+            break;
+        }
+    }
+
+    // Chunks written after the last journaled insert have a generation no reader saw, skip them
+    *generation += ZN_JOURNAL_GENERATION_GAP;
+
+    g_free(records);
+    close(fd);
+    return nr_replayed;
+}
+
+static void
+zn_journal_skip_record(const struct zn_journal_record *record, void *user_data) {
+    (void) record;
+    (void) user_data;
+}
+
+bool
+zn_journal_intact(const char *path, size_t chunk_sz, uint64_t zone_cap, uint32_t nr_zones) {
+    if (!zn_journal_matches(path, chunk_sz, zone_cap, nr_zones)) {
+        return false;
+    }
+
+    uint64_t generation;
+    bool torn;
+    if (zn_journal_replay(path, zn_journal_skip_record, NULL, &generation, &torn) < 0 || torn) {
+        fprintf(stderr, "Journal %s is torn\n", path);
+        return false;
+    }
+    return true;
+}
+
+void
+zn_journal_put_locked(struct zn_journal *journal, enum zn_journal_op op, uint32_t id,
+                      struct zn_pair location, uint64_t generation) {
+    if (journal->fd < 0) {
+        return;
+    }
+
+    struct zn_journal_record *record = &journal->buffer[journal->nr_buffered++];
+    *record = (struct zn_journal_record) {
+        .op = op,
+        .id = id,
+        .zone = location.zone,
+        .chunk_offset = location.chunk_offset,
+        .generation = generation,
+    };
+    record->checksum = zn_journal_checksum(record, offsetof(struct zn_journal_record, checksum));
+    journal->nr_records++;
+
+    if (journal->nr_buffered == ZN_JOURNAL_BUFFER_RECORDS) {
+        (void) zn_journal_flush_locked(journal);
+    }
+}
+
+void
+zn_journal_append(struct zn_journal *journal, enum zn_journal_op op, uint32_t id,
+                  struct zn_pair location, uint64_t generation) {
+    g_mutex_lock(&journal->lock);
+    zn_journal_put_locked(journal, op, id, location, generation);
+    g_mutex_unlock(&journal->lock);
+}
+
+/**
+ * @brief Writes out and syncs the buffered records, the lock must be held
+ */
+static int
+zn_journal_sync_locked(struct zn_journal *journal) {
+    if (journal->fd < 0) {
+        return journal->failed ? -1 : 0;
+    }
+    if (zn_journal_flush_locked(journal) != 0) {
+        return -1;
+    }
+    if (fdatasync(journal->fd) != 0) {
+        fprintf(stderr, "Couldn't sync the journal: '%s'\n", strerror(errno));
+        zn_journal_stop_locked(journal);
+        return -1;
+    }
+    return 0;
+}
+
+int
+zn_journal_sync(struct zn_journal *journal) {
+    g_mutex_lock(&journal->lock);
+    int ret = zn_journal_sync_locked(journal);
+    g_mutex_unlock(&journal->lock);
+    return ret;
+}
+
+bool
+zn_journal_should_compact(struct zn_journal *journal) {
+    g_mutex_lock(&journal->lock);
+    bool compact = journal->fd >= 0 && journal->nr_records >= journal->compact_at;
+    g_mutex_unlock(&journal->lock);
+    return compact;
+}
+
+uint64_t
+zn_journal_next_generation(struct zn_journal *journal) {
+    g_mutex_lock(&journal->lock);
+    uint64_t generation = journal->generation++;
+    g_mutex_unlock(&journal->lock);
+    return generation;
+}
+
+/**
+ * @brief Syncs the directory holding `path`, so a rename into it is durable
+ */
+static int
+zn_journal_sync_dir(const char *path) {
+    char *dir = g_path_get_dirname(path);
+    int fd = open(dir, O_RDONLY);
+    g_free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int
+zn_journal_compact(struct zn_journal *journal, const char *path, size_t chunk_sz,
+                   uint64_t zone_cap, uint32_t nr_zones,
+                   void (*fill)(struct zn_journal *journal, void *user_data), void *user_data) {
+    g_mutex_lock(&journal->lock);
+
+    if (path != NULL) {
+        g_free(journal->path);
+        journal->path = g_strdup(path);
+    }
+    assert(journal->path != NULL);
+
+    // Records of the old file are either written out by `fill` or no longer needed
+    journal->nr_buffered = 0;
+
+    char *tmp_path = g_strconcat(journal->path, ".tmp", NULL);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't create journal %s: '%s'\n", tmp_path, strerror(errno));
+        g_free(tmp_path);
+        g_mutex_unlock(&journal->lock);
+        return -1;
+    }
+
+    journal->header = (struct zn_journal_header) {
+        .magic = ZN_JOURNAL_MAGIC,
+        .version = ZN_JOURNAL_VERSION,
+        .chunk_sz = chunk_sz,
+        .zone_cap = zone_cap,
+        .nr_zones = nr_zones,
+        .generation = journal->generation,
+    };
+    journal->header.checksum =
+        zn_journal_checksum(&journal->header, offsetof(struct zn_journal_header, checksum));
+
+    int old_fd = journal->fd;
+    journal->fd = fd;
+    journal->nr_records = 0;
+    int ret = zn_journal_write_all(fd, &journal->header, sizeof(journal->header));
+    if (ret == 0) {
+        fill(journal, user_data);
+        ret = journal->fd < 0 ? -1 : zn_journal_sync_locked(journal);
+    }
+    if (ret == 0 && rename(tmp_path, journal->path) != 0) {
+        fprintf(stderr, "Couldn't replace journal %s: '%s'\n", journal->path, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = zn_journal_sync_dir(journal->path);
+    }
+
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    if (ret != 0) {
+        if (journal->fd >= 0) {
+            close(journal->fd);
+            journal->fd = -1;
+        }
+        // The old file misses the records that were buffered, the next start is a cold one
+        journal->failed = true;
+        unlink(tmp_path);
+        unlink(journal->path);
+    } else {
+        // Compact again once the dead records outnumber the live ones
+        journal->compact_at = MAX(2 * journal->nr_records, ZN_JOURNAL_MIN_COMPACT);
+        dbg_printf("Wrote journal %s with %" PRIu64 " records\n", journal->path,
+                   journal->nr_records);
+    }
+
+    g_free(tmp_path);
+    g_mutex_unlock(&journal->lock);
+    return ret;
+}
@@ -0,0 +1,206 @@
+#include "znstage.h"
+
+#include "zncache.h"
+#include "znutil.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+zn_stage_init(struct zn_cache *cache, uint64_t stage_bytes) {
+    cache->stage_chunks = stage_bytes / cache->chunk_sz;
+    if (cache->stage_chunks < 2) {
+        cache->stage_chunks = 0;
+    }
+    cache->stage_chunks = MIN(cache->stage_chunks, cache->max_zone_chunks);
+
+    cache->stages = g_new0(struct zn_stage, cache->nr_zones);
+    for (uint32_t i = 0; i < cache->nr_zones; i++) {
+        g_mutex_init(&cache->stages[i].lock);
+    }
+}
+
+bool
+zn_stage_enabled(struct zn_cache *cache) {
+    return cache->stage_chunks > 0;
+}
+
+bool
+zn_stage_full(struct zn_cache *cache, uint32_t zone) {
+    struct zn_stage *stage = &cache->stages[zone];
+    g_mutex_lock(&stage->lock);
+    bool full = stage->count == cache->stage_chunks;
+    g_mutex_unlock(&stage->lock);
+    return full;
+}
+
+int
+zn_stage_put(struct zn_cache *cache, struct zn_pair location, const struct iovec *iov,
+             int iovcnt) {
+    assert(zn_stage_enabled(cache));
+
+    if (zn_stage_full(cache, location.zone) && zn_stage_flush(cache, location.zone) != 0) {
+        return -1;
+    }
+
+    struct zn_stage *stage = &cache->stages[location.zone];
+    g_mutex_lock(&stage->lock);
+
+    if (stage->buf == NULL) {
+        stage->buf = zn_buffer_alloc_aligned((size_t) cache->stage_chunks * cache->chunk_sz);
+    }
+    if (stage->count == 0) {
+        stage->start = location.chunk_offset;
+    }
+    assert(location.chunk_offset == stage->start + stage->count);
+    assert(stage->count < cache->stage_chunks);
+
+    unsigned char *dst = stage->buf + ((size_t) stage->count * cache->chunk_sz);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    stage->count++;
+
+    g_mutex_unlock(&stage->lock);
+    return 0;
+}
+
+void
+zn_stage_unput(struct zn_cache *cache, struct zn_pair location) {
+    struct zn_stage *stage = &cache->stages[location.zone];
+    g_mutex_lock(&stage->lock);
+    assert(stage->count > 0 && location.chunk_offset == stage->start + stage->count - 1);
+    stage->count--;
+    g_mutex_unlock(&stage->lock);
+}
+
+int
+zn_stage_flush(struct zn_cache *cache, uint32_t zone) {
+    if (!zn_stage_enabled(cache)) {
+        return 0;
+    }
+
+    struct zn_stage *stage = &cache->stages[zone];
+
+    // The zone is held by the caller, nothing is added while the buffer is written. Readers only
+    // copy out of it, so it is written without the lock.
+    g_mutex_lock(&stage->lock);
+    uint32_t start = stage->start;
+    uint32_t count = stage->count;
+    struct iovec iov = {.iov_base = stage->buf, .iov_len = (size_t) count * cache->chunk_sz};
+    g_mutex_unlock(&stage->lock);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned long long wp = CHUNK_POINTER(cache->zone_size, cache->chunk_sz, start, zone);
+    dbg_printf("[%u,%u] flushing %u staged chunks\n", zone, start, count);
+    if (zn_write_out(&cache->io, &iov, 1, wp) != 0) {
+        fprintf(stderr, "Couldn't flush %u staged chunks of zone %u\n", count, zone);
+        return -1;
+    }
+
+    // The buffer may be freed below, keep the headers to journal the chunks
+    struct zn_chunk_header *headers = g_new(struct zn_chunk_header, count);
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(&headers[i], stage->buf + ((size_t) i * cache->chunk_sz), sizeof(headers[i]));
+    }
+
+    g_mutex_lock(&stage->lock);
+    stage->start += count;
+    stage->count = 0;
+    // Nothing more will be staged for a complete zone until it is reset
+    if (stage->start == cache->max_zone_chunks) {
+        free(stage->buf);
+        stage->buf = NULL;
+    }
+    g_mutex_unlock(&stage->lock);
+
+    // Journaled only now that the chunks are on the device, and after they left the stage so a
+    // compaction in between writes them out itself. Chunks evicted while staged are skipped.
+    uint32_t *ids = g_new(uint32_t, cache->max_zone_chunks);
+    zn_cachemap_zone_ids(&cache->cache_map, zone, ids);
+    for (uint32_t i = 0; i < count; i++) {
+        struct zn_pair location = {.zone = zone, .chunk_offset = start + i, .id = headers[i].id};
+        if (ids[location.chunk_offset] == headers[i].id) {
+            zn_journal_append(&cache->journal, ZN_JOURNAL_INSERT, headers[i].id, location,
+                              headers[i].generation);
+        }
+    }
+    g_free(ids);
+    g_free(headers);
+
+    return 0;
+}
+
+bool
+zn_stage_holds(struct zn_cache *cache, struct zn_pair location) {
+    if (!zn_stage_enabled(cache)) {
+        return false;
+    }
+
+    struct zn_stage *stage = &cache->stages[location.zone];
+    g_mutex_lock(&stage->lock);
+    bool staged = stage->count > 0 && location.chunk_offset >= stage->start &&
+                  location.chunk_offset < stage->start + stage->count;
+    g_mutex_unlock(&stage->lock);
+    return staged;
+}
+
+bool
+zn_stage_read(struct zn_cache *cache, struct zn_pair location, size_t offset,
+              const struct iovec *iov, int iovcnt) {
+    if (!zn_stage_enabled(cache)) {
+        return false;
+    }
+
+    struct zn_stage *stage = &cache->stages[location.zone];
+    g_mutex_lock(&stage->lock);
+
+    bool staged = stage->count > 0 && location.chunk_offset >= stage->start &&
+                  location.chunk_offset < stage->start + stage->count;
+    if (staged) {
+        assert(offset + zn_io_iov_len(iov, iovcnt) <= cache->chunk_sz);
+        const unsigned char *src =
+            stage->buf + ((size_t) (location.chunk_offset - stage->start) * cache->chunk_sz) + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(iov[i].iov_base, src, iov[i].iov_len);
+            src += iov[i].iov_len;
+        }
+    }
+
+    g_mutex_unlock(&stage->lock);
+    return staged;
+}
+
+void
+zn_stage_drop(struct zn_cache *cache, uint32_t zone) {
+    if (!zn_stage_enabled(cache)) {
+        return;
+    }
+
+    struct zn_stage *stage = &cache->stages[zone];
+    g_mutex_lock(&stage->lock);
+    free(stage->buf);
+    stage->buf = NULL;
+    stage->start = 0;
+    stage->count = 0;
+    g_mutex_unlock(&stage->lock);
+}
+
+void
+zn_stage_destroy(struct zn_cache *cache) {
+    for (uint32_t i = 0; i < cache->nr_zones; i++) {
+        if (zn_stage_enabled(cache) && zn_stage_flush(cache, i) != 0) {
+            fprintf(stderr, "Couldn't flush staged chunks of zone %u\n", i);
+        }
+        free(cache->stages[i].buf);
+        g_mutex_clear(&cache->stages[i].lock);
+    }
+    g_free(cache->stages);
+    cache->stages = NULL;
+}
@@ -4,13 +4,15 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 inline static void
 print_g_hash_table_zn_pair(gpointer key, gpointer value) {
     struct zn_pair *zp = (struct zn_pair *) value;
     if (zp) {
-        printf("[%d: (zone=%u, chunk=%u, id=%u, in_use=%s)], ", GPOINTER_TO_INT(key),
-               zp->zone, zp->chunk_offset, zp->id, zp->in_use ? "true" : "false");
+        printf("[%d: (zone=%u, chunk=%u, id=%u)], ", GPOINTER_TO_INT(key),
+               zp->zone, zp->chunk_offset, zp->id);
     } else {
         printf("[%d: (NULL)], ", GPOINTER_TO_INT(key));
     }
@@ -31,8 +33,8 @@ print_g_hash_table_zn_pair_node(gpointer key, gpointer value) {
     GList *node = (GList *) value;
     if (node) {
         struct zn_pair *zp = node->data;
-		printf("[%p: (zone=%u, chunk=%u, id=%u, in_use=%s)], ",
-		       key, zp->zone, zp->chunk_offset, zp->id, zp->in_use ? "true" : "false");
+		printf("[%p: (zone=%u, chunk=%u, id=%u)], ",
+		       key, zp->zone, zp->chunk_offset, zp->id);
     } else {
 		printf("[%p: (%s)], ", key, "NULL");
     }
@@ -82,6 +84,12 @@ print_g_queue_zn_zone(GList *node) {
             state_str = "ACTIVE"; break;
         case ZN_ZONE_WRITE_OCCURING:
             state_str = "WRITE_OCCURING"; break;
+        case ZN_ZONE_FINISHING:
+            state_str = "FINISHING"; break;
+        case ZN_ZONE_RESETTING:
+            state_str = "RESETTING"; break;
+        case ZN_ZONE_OFFLINE:
+            state_str = "OFFLINE"; break;
         default:
             assert(!"Invalid zone state");
     }
@@ -91,7 +99,7 @@ print_g_queue_zn_zone(GList *node) {
 inline static void
 print_g_queue_zn_pair(GList *node) {
     struct zn_pair *zn = (struct zn_pair *) node->data;
-    printf("(%u,%u,%u,%s), ", zn->zone, zn->chunk_offset, zn->id, zn->in_use ? "true" : "false");
+    printf("(%u,%u,%u), ", zn->zone, zn->chunk_offset, zn->id);
 }
 
 void
@@ -115,8 +123,8 @@ print_g_queue(char *name, const GQueue *queue, const enum print_g_queue_type typ
 void
 print_zn_pair_list(struct zn_pair *list, uint32_t len) {
     for (uint32_t i = 0; i < len; i++) {
-        printf("[%d: (zone=%u, chunk=%u, id=%u, in_use=%s)], ",
-               i, list[i].zone, list[i].chunk_offset, list[i].id, list[i].in_use ? "true" : "false");
+        printf("[%d: (zone=%u, chunk=%u, id=%u)], ",
+               i, list[i].zone, list[i].chunk_offset, list[i].id);
     }
     puts("");
 }
@@ -183,4 +191,94 @@ zone_cap(int fd, uint64_t *zone_capacity) {
     }
     *zone_capacity = zone.capacity;
     return ret;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Reads an integer attribute from the sysfs queue directory of a block device
+ */
+static int
+read_queue_attr(int fd, const char *attr, uint64_t *value) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return -1;
+    }
+
+    gchar *path = g_strdup_printf("/sys/dev/block/%u:%u/queue/%s", major(st.st_rdev),
+                                  minor(st.st_rdev), attr);
+    gchar *contents = NULL;
+    gboolean ok = g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    if (!ok) {
+        return -1;
+    }
+
+    *value = g_ascii_strtoull(contents, NULL, 10);
+    g_free(contents);
+    return 0;
+}
+
+int
+zone_append_max_bytes(int fd, uint64_t *max_bytes) {
+    return read_queue_attr(fd, "zone_append_max_bytes", max_bytes);
+}
+
+int
+max_write_bytes(int fd, uint64_t *max_bytes) {
+    uint64_t max_kb = 0;
+    if (read_queue_attr(fd, "max_sectors_kb", &max_kb) != 0 || max_kb == 0) {
+        return -1;
+    }
+    *max_bytes = max_kb * 1024;
+    return 0;
+}
+
+static GMutex zn_thread_lock;
+static bool zn_thread_used[ZN_THREAD_SHARED];
+static gint zn_thread_bound = 0;
+
+static void
+zn_thread_index_release(gpointer data) {
+    uint32_t index = GPOINTER_TO_UINT(data) - 1;
+    if (index == ZN_THREAD_SHARED) {
+        return;
+    }
+    g_mutex_lock(&zn_thread_lock);
+    zn_thread_used[index] = false;
+    g_mutex_unlock(&zn_thread_lock);
+}
+
+static GPrivate zn_thread_slot = G_PRIVATE_INIT(zn_thread_index_release);
+
+uint32_t
+zn_thread_index(void) {
+    // Stored plus one, NULL means the thread has no index yet
+    gpointer data = g_private_get(&zn_thread_slot);
+    if (data != NULL) {
+        return GPOINTER_TO_UINT(data) - 1;
+    }
+
+    // Threads that find every index taken share the last one
+    g_mutex_lock(&zn_thread_lock);
+    uint32_t index = 0;
+    while (index < ZN_THREAD_SHARED && zn_thread_used[index]) {
+        index++;
+    }
+    if (index < ZN_THREAD_SHARED) {
+        zn_thread_used[index] = true;
+    } else {
+        dbg_printf("More than %u threads, sharing thread index %u\n", ZN_THREAD_SHARED,
+                   ZN_THREAD_SHARED);
+    }
+    if (index >= (uint32_t) g_atomic_int_get(&zn_thread_bound)) {
+        g_atomic_int_set(&zn_thread_bound, index + 1);
+    }
+    g_mutex_unlock(&zn_thread_lock);
+
+    g_private_set(&zn_thread_slot, GUINT_TO_POINTER(index + 1));
+    return index;
+}
+
+uint32_t
+zn_thread_index_bound(void) {
+    return g_atomic_int_get(&zn_thread_bound);
+}
@@ -7,24 +7,164 @@
 #include "znutil.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+/** Attempts of a zone finish or reset before the worker gives up on the zone */
+#define ZSM_ZONE_CMD_RETRIES 3
+
+static gint
+zsm_waiter_cmp(gconstpointer a, gconstpointer b, gpointer user_data) {
+    (void) user_data;
+    uint64_t ta = ((const struct zsm_waiter *) a)->ticket;
+    uint64_t tb = ((const struct zsm_waiter *) b)->ticket;
+    return (ta > tb) - (ta < tb);
+}
+
+/**
+ * @brief Queues a thread that found no zone to write to
+ *
+ * @note assumes that the lock is held, so a zone freed after the caller looked wakes it
+ */
+static void
+zsm_enqueue_waiter(struct zone_state_manager *state, struct zsm_waiter *waiter) {
+    assert(!waiter->queued);
+    // A waiter that was woken but lost the zone to another thread keeps its place
+    if (waiter->ticket == 0) {
+        waiter->ticket = state->next_ticket++;
+    }
+    waiter->queued = true;
+    g_queue_insert_sorted(&state->waiters, waiter, zsm_waiter_cmp, NULL);
+    g_atomic_int_inc(&state->nr_waiting);
+}
+
+/**
+ * @brief Wakes the longest waiting thread, called once for every zone that can be taken again
+ *
+ * @note assumes that the lock is held
+ */
+static void
+zsm_wake_one(struct zone_state_manager *state) {
+    struct zsm_waiter *waiter = g_queue_pop_head(&state->waiters);
+    if (waiter == NULL) {
+        return;
+    }
+    g_atomic_int_add(&state->nr_waiting, -1);
+    waiter->queued = false;
+    g_cond_signal(&waiter->cond);
+}
+
+/**
+ * @brief Wakes every waiting thread
+ *
+ * @note assumes that the lock is held
+ */
+static void
+zsm_wake_all(struct zone_state_manager *state) {
+    while (!g_queue_is_empty(&state->waiters)) {
+        zsm_wake_one(state);
+    }
+}
+
+/**
+ * @brief Number of zones that count against the active zone limit
+ *
+ * @note assumes that the lock is held
+ */
+static inline uint32_t
+zsm_nr_active(struct zone_state_manager *state) {
+    // Zones stay open on the device until their finish completes
+    return g_queue_get_length(state->active) + state->writes_occurring + state->nr_finishing +
+           state->nr_stuck_open;
+}
+
+/**
+ * @brief Hands a zone to the worker, its state says whether it is finished or reset
+ *
+ * @note assumes that the lock is held
+ */
+static void
+zsm_queue_zone(struct zone_state_manager *state, struct zn_zone *zone) {
+    g_queue_push_tail(&state->pending, zone);
+    g_cond_signal(&state->work_cond);
+}
+
 /**
  * @brief Close a zone
  *
+ * With a worker the zone is finished in the background and stays FINISHING,
+ * counting as active, until the device is done with it.
+ *
  * @param cache cache Pointer to the `zn_cache` structure, caller is responsible for locking
  * @param zone_id Zone to close
  *
- * @return Returns 0 on success and -1 otherwise.
+ * @return Returns 0, the device command can only fail in the worker
  */
 static int
 close_zone(struct zone_state_manager *state, struct zn_zone *zone) {
-    if (zone->state == ZN_ZONE_FULL) {
+    if (zone->state == ZN_ZONE_FULL || zone->state == ZN_ZONE_FINISHING) {
         return 0;
     }
 
-    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
-    dbg_printf("Closing zone %u, zone pointer %llu\n", zone->zone_id, wp);
+    dbg_printf("Closing zone %u\n", zone->zone_id);
+    zone->chunk_offset = 0;
+
+    if (state->worker != NULL) {
+        zone->state = ZN_ZONE_FINISHING;
+        state->nr_finishing++;
+        zsm_queue_zone(state, zone);
+        return 0;
+    }
+
+    zone->state = ZN_ZONE_FULL;
+
+    // The zone no longer counts as active, another one can be opened
+    zsm_wake_one(state);
+
+    return 0;
+}
+
+/**
+ * @brief Reset a zone
+ *
+ * Called once the device reset it, or right away if the backend has no zones.
+ *
+ * @param state Pointer to the `zone_state_manager` structure, caller is responsible for locking
+ * @param zone Zone to reset
+ */
+static void
+reset_zone(struct zone_state_manager *state, struct zn_zone *zone) {
+    dbg_printf("Zone %u is free\n", zone->zone_id);
+
+    zone->state = ZN_ZONE_FREE;
+    zone->chunk_offset = 0;
+    zone->cmd_failures = 0;
+    if (zone->stuck_open) {
+        zone->stuck_open = false;
+        state->nr_stuck_open--;
+    }
+    // Writers that still see the zone as the shared one can't reserve chunks of it
+    g_atomic_int_set(&zone->reserved, (gint) state->max_zone_chunks);
+    zn_bitmap_clear_all(&zone->valid);
+    zn_bitmap_clear_all(&zone->invalid);
+    g_queue_push_tail(state->free, zone);
+    zsm_wake_one(state);
+}
+
+/**
+ * @brief Issues a finish or reset of a run of consecutive zones to the device
+ *
+ * @note called without the lock, it can take milliseconds
+ *
+ * @return Returns 0 on success and non-zero otherwise.
+ */
+static int
+zsm_zone_cmd(struct zone_state_manager *state, uint32_t zone_id, uint32_t nr_zones, bool reset) {
+    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone_id);
+    // The range ends inside the last zone, the command covers every zone it touches
+    unsigned long long len = (unsigned long long) (nr_zones - 1) * state->zone_size + state->zone_cap;
+    dbg_printf("%s zones %u-%u, zone pointer %llu\n", reset ? "Resetting" : "Finishing", zone_id,
+               zone_id + nr_zones - 1, wp);
     zbd_set_log_level(ZBD_LOG_ERROR);
 
     // FOR DEBUGGING ZONE STATE
@@ -34,61 +174,163 @@ close_zone(struct zone_state_manager *state, struct zn_zone *zone) {
     //     printf("Zone state before close: %u\n", zone.cond == ZBD_ZONE_COND_FULL);
     // }
 
-	int ret = 0;
-    if (state->backend_type == ZE_BACKEND_ZNS) {
-		// NOTE: FULL ZONES ARE NOT ACTIVE
-		ret = zbd_finish_zones(state->fd, wp, state->zone_cap);
-		if (ret != 0) {
-			dbg_printf("Failed to close zone %u\n", zone->zone_id);
-			return ret;
-		}
-	}
-
     // EXPLICIT CLOSE FAILS ON NULLBLK, TODO: TEST ON REAL DEV ON CORTES
     // ret = zbd_close_zones(cache->fd, wp, cache->zone_cap);
-    // if (ret != 0) {
-    //     return ret;
-    // }
-    zone->state = ZN_ZONE_FULL;
-    zone->chunk_offset = 0;
 
+    // NOTE: FULL ZONES ARE NOT ACTIVE
+    int ret = reset ? zbd_reset_zones(state->fd, wp, len) : zbd_finish_zones(state->fd, wp, len);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to %s zones %u-%u\n", reset ? "reset" : "finish", zone_id,
+                zone_id + nr_zones - 1);
+    }
     return ret;
 }
 
 /**
- * @brief Reset a zone
+ * @brief Marks a zone that may still be open on the device, it keeps counting as active
  *
- * @param state Pointer to the `zone_state_manager` structure, caller is responsible for locking
- * @param zone Zone to reset
- *
- * @return Returns 0 on success and -1 otherwise.
+ * @note assumes that the lock is held
  */
-static int
-reset_zone(struct zone_state_manager *state, struct zn_zone *zone) {
-    if (zone->state == ZN_ZONE_FREE) {
-        dbg_printf("Zone %u already closed\n", zone->zone_id);
-        return 0;
+static void
+zsm_zone_stuck_open(struct zone_state_manager *state, struct zn_zone *zone) {
+    if (!zone->stuck_open) {
+        zone->stuck_open = true;
+        state->nr_stuck_open++;
     }
+}
 
-    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
-    dbg_printf("Resetting zone %u, zone pointer %llu\n", zone->zone_id, wp);
-    zbd_set_log_level(ZBD_LOG_ERROR);
+/**
+ * @brief Handles a finish or reset the device failed
+ *
+ * The zones are queued again, until they failed `ZSM_ZONE_CMD_RETRIES` times. Then a zone
+ * that couldn't be finished stays FULL, its chunks can still be read. One that couldn't be
+ * reset is taken OFFLINE and never written again.
+ *
+ * @note assumes that the lock is held
+ */
+static void
+zsm_zone_cmd_failed(struct zone_state_manager *state, uint32_t zone_id, uint32_t nr_zones,
+                    bool reset, bool finishing) {
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        struct zn_zone *zone = &state->state[zone_id + i];
+        zone->cmd_failures++;
 
-    int ret = 0;
-    if (state->backend_type == ZE_BACKEND_ZNS) {
-		// NOTE: FULL ZONES ARE NOT ACTIVE
-		ret = zbd_reset_zones(state->fd, wp, state->zone_cap);
-		if (ret != 0) {
-			dbg_printf("Failed to close zone %u\n", zone->zone_id);
-			return ret;
-		}
+        // A zone that was reset instead of finished was open, it no longer counts as finishing
+        if (finishing && reset) {
+            state->nr_finishing--;
+            zsm_zone_stuck_open(state, zone);
+            zsm_wake_one(state);
+        }
+
+        if (zone->cmd_failures < ZSM_ZONE_CMD_RETRIES) {
+            g_queue_push_tail(&state->pending, zone);
+            continue;
+        }
+
+        zone->cmd_failures = 0;
+        if (reset) {
+            fprintf(stderr, "Couldn't reset zone %u, taking it offline\n", zone->zone_id);
+            state->nr_resetting--;
+            zone->state = ZN_ZONE_OFFLINE;
+        } else {
+            fprintf(stderr, "Couldn't finish zone %u, it stays open\n", zone->zone_id);
+            state->nr_finishing--;
+            zsm_zone_stuck_open(state, zone);
+            zone->state = ZN_ZONE_FULL;
+            if (zone->reset_pending) {
+                // Evicted while it was being finished, the reset closes it too
+                zone->reset_pending = false;
+                zone->state = ZN_ZONE_RESETTING;
+                state->nr_resetting++;
+                g_queue_push_tail(&state->pending, zone);
+            }
+        }
+        // Waiters look again, no zone is coming from here
+        zsm_wake_one(state);
     }
+}
 
-    zone->state = ZN_ZONE_FREE;
-    zone->chunk_offset = 0;
-    g_queue_push_tail(state->free, zone);
+/**
+ * @brief Finishes and resets zones queued by `close_zone` and `zsm_evict`
+ *
+ * Zones move to FULL or FREE once the device completed the command, writers
+ * never wait for it while holding the lock. Failed commands are retried, see
+ * `zsm_zone_cmd_failed`.
+ */
+static gpointer
+zsm_worker(gpointer data) {
+    struct zone_state_manager *state = data;
 
-    return ret;
+    g_mutex_lock(&state->state_mutex);
+    while (true) {
+        while (g_queue_is_empty(&state->pending) && !state->stopping) {
+            g_cond_wait(&state->work_cond, &state->state_mutex);
+        }
+        if (g_queue_is_empty(&state->pending)) {
+            break;
+        }
+
+        struct zn_zone *zone = g_queue_pop_head(&state->pending);
+        bool finishing = zone->state == ZN_ZONE_FINISHING;
+        // A zone evicted before its finish started is only reset
+        bool reset = !finishing || zone->reset_pending;
+        if (reset && finishing) {
+            zone->reset_pending = false;
+            zone->state = ZN_ZONE_RESETTING;
+            state->nr_resetting++;
+        }
+
+        // Zones evicted together are queued in order, the ones that follow this one are reset
+        // with the same command
+        uint32_t nr_zones = 1;
+        while (reset && !finishing) {
+            struct zn_zone *next = g_queue_peek_head(&state->pending);
+            if (next == NULL || next->state != ZN_ZONE_RESETTING ||
+                next->zone_id != zone->zone_id + nr_zones) {
+                break;
+            }
+            g_queue_pop_head(&state->pending);
+            nr_zones++;
+        }
+        state->busy = true;
+        g_mutex_unlock(&state->state_mutex);
+
+        int ret = zsm_zone_cmd(state, zone->zone_id, nr_zones, reset);
+
+        g_mutex_lock(&state->state_mutex);
+        if (ret != 0) {
+            zsm_zone_cmd_failed(state, zone->zone_id, nr_zones, reset, finishing);
+        } else {
+            if (finishing) {
+                state->nr_finishing--;
+                zsm_wake_one(state);
+            }
+
+            if (reset) {
+                state->nr_resetting -= nr_zones;
+                for (uint32_t i = 0; i < nr_zones; i++) {
+                    reset_zone(state, &state->state[zone->zone_id + i]);
+                }
+            } else if (zone->reset_pending) {
+                // Evicted while it was being finished
+                zone->reset_pending = false;
+                zone->state = ZN_ZONE_RESETTING;
+                state->nr_resetting++;
+                g_queue_push_tail(&state->pending, zone);
+            } else {
+                zone->cmd_failures = 0;
+                zone->state = ZN_ZONE_FULL;
+            }
+        }
+
+        state->busy = false;
+        if (g_queue_is_empty(&state->pending)) {
+            g_cond_broadcast(&state->idle_cond);
+        }
+    }
+    g_mutex_unlock(&state->state_mutex);
+
+    return NULL;
 }
 
 /**
@@ -107,33 +349,303 @@ open_zone(struct zone_state_manager *state, struct zn_zone *zone) {
     assert(zone);
     assert(zone->state == ZN_ZONE_FREE);
 
-    if (g_queue_get_length(state->active) + state->writes_occurring >= state->max_nr_active_zones) {
+    if (zsm_nr_active(state) >= state->max_nr_active_zones) {
         return -1;
     }
 
-	if (state->backend_type == ZE_BACKEND_ZNS) {
-        dbg_printf("chunk_offset=%u, zone=%u\n", zone->chunk_offset, zone->zone_id);
-		unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
-		dbg_printf("Opening zone %u, zone pointer %llu\n", zone->zone_id, wp);
-
-		int ret = zbd_open_zones(state->fd, wp, 1);
-		if (ret != 0) {
-			return ret;
-		}
-    }
+    // No open command is issued, the device opens the zone implicitly on its first write. The
+    // active zone limit is kept here, so the writer never waits for a zone management command
+    // while holding the lock.
+    dbg_printf("Opening zone %u\n", zone->zone_id);
 
     zone->state = ZN_ZONE_ACTIVE;
     zone->chunk_offset = 0;
     g_queue_push_tail(state->active, zone);
 
+    // Writers reserve chunks of the new shared zone from now on
+    if (state->shared) {
+        g_atomic_int_set(&zone->written, 0);
+        g_atomic_int_set(&zone->reserved, 0);
+        g_atomic_pointer_set(&state->current, zone);
+    }
+
     return 0;
 }
 
+/**
+ * @brief Opens a new shared zone if the current one has no chunks left
+ *
+ * @return ZSM_GET_ACTIVE_ZONE_SUCCESS if there is a zone to reserve chunks of
+ */
+static enum zsm_get_active_zone_error
+zsm_open_shared(struct zone_state_manager *state, struct zsm_waiter *waiter) {
+    g_mutex_lock(&state->state_mutex);
+
+    // Another writer may have opened one in the meantime
+    struct zn_zone *current = state->current;
+    if (current != NULL &&
+        (uint32_t) g_atomic_int_get(&current->reserved) < state->max_zone_chunks) {
+        g_mutex_unlock(&state->state_mutex);
+        return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+    }
+
+    uint32_t active_zones = zsm_nr_active(state);
+    uint32_t free_queue_size = g_queue_get_length(state->free);
+
+    // Perform foreground eviction, zones being finished are full already. A zone being reset
+    // or retired is free soon, wait for it instead.
+    if (active_zones == state->nr_finishing && free_queue_size == 0 &&
+        state->nr_resetting == 0 && state->nr_retired == 0) {
+        g_mutex_unlock(&state->state_mutex);
+        return ZSM_GET_ACTIVE_ZONE_EVICT;
+    }
+
+    // The thread needs to wait for a free zone
+    if (active_zones >= state->max_nr_active_zones || free_queue_size == 0) {
+        zsm_enqueue_waiter(state, waiter);
+        g_mutex_unlock(&state->state_mutex);
+        return ZSM_GET_ACTIVE_ZONE_RETRY;
+    }
+
+    struct zn_zone *new_zone = g_queue_pop_head(state->free);
+    int ret = open_zone(state, new_zone);
+    if (ret) {
+        dbg_printf("Failed to open zone: %d with error: %d\n", new_zone->zone_id, ret);
+        g_mutex_unlock(&state->state_mutex);
+        return ZSM_GET_ACTIVE_ZONE_ERROR;
+    }
+
+    // Every waiter can reserve chunks of the new zone
+    zsm_wake_all(state);
+    g_mutex_unlock(&state->state_mutex);
+    return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+}
+
+/**
+ * @brief Retires a shared zone whose last chunk was just handed out
+ *
+ * Called by the writer that reserved the last chunk before it writes, so the
+ * zone is no longer active before its last write can finish.
+ */
+static void
+zsm_shared_handed_out(struct zone_state_manager *state, struct zn_zone *zone) {
+    g_mutex_lock(&state->state_mutex);
+    if (state->current == zone) {
+        g_atomic_pointer_set(&state->current, NULL);
+    }
+    g_queue_remove(state->active, zone);
+    zone->state = ZN_ZONE_WRITE_OCCURING;
+    state->writes_occurring++;
+    g_mutex_unlock(&state->state_mutex);
+}
+
+/**
+ * @brief Reserves a run of chunks of the shared zone
+ *
+ * The common case is a single atomic add on the zone's cursor, the lock is
+ * only taken to open a new zone and to retire one that was handed out.
+ */
+static enum zsm_get_active_zone_error
+zsm_reserve_shared(struct zone_state_manager *state, uint32_t chunks, struct zn_pair *pair,
+                   uint32_t *nr_chunks, struct zsm_waiter *waiter) {
+    while (true) {
+        struct zn_zone *zone = g_atomic_pointer_get(&state->current);
+        if (zone != NULL) {
+            // Zones that can't take writes have a cursor past the end, so a writer that read
+            // `current` just before it changed gets nothing here
+            uint32_t offset = (uint32_t) g_atomic_int_add(&zone->reserved, (gint) chunks);
+            if (offset < state->max_zone_chunks) {
+                *pair = (struct zn_pair) {.zone = zone->zone_id, .chunk_offset = offset};
+                *nr_chunks = MIN(chunks, state->max_zone_chunks - offset);
+                if (offset + *nr_chunks == state->max_zone_chunks) {
+                    zsm_shared_handed_out(state, zone);
+                }
+                return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+            }
+        }
+
+        enum zsm_get_active_zone_error ret = zsm_open_shared(state, waiter);
+        if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+            return ret;
+        }
+    }
+}
+
+/**
+ * @brief Counts chunks of a shared zone as done, closes the zone after its last one
+ *
+ * @param[out] zone_full set to true if this completed the zone
+ * @return 0 on success, non-zero if the zone could not be closed
+ */
+static int
+zsm_shared_done(struct zone_state_manager *state, struct zn_zone *zone, uint32_t nr_chunks,
+                bool *zone_full) {
+    *zone_full = false;
+
+    // Writes complete in any order, only count them
+    uint32_t done = (uint32_t) g_atomic_int_add(&zone->written, (gint) nr_chunks) + nr_chunks;
+    assert(done <= state->max_zone_chunks);
+    if (done < state->max_zone_chunks) {
+        return 0;
+    }
+
+    // The last outstanding write to a fully handed out zone
+    g_mutex_lock(&state->state_mutex);
+    assert(zone->state == ZN_ZONE_WRITE_OCCURING);
+    state->writes_occurring--;
+
+    int ret = close_zone(state, zone);
+    if (ret != 0) {
+        dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
+        g_mutex_unlock(&state->state_mutex);
+        return ret;
+    }
+    *zone_full = true;
+
+    g_mutex_unlock(&state->state_mutex);
+    return 0;
+}
+
+/**
+ * @brief Takes the zone of the calling thread's affinity slot, opening one if the slot has none
+ *
+ * @return true if the caller holds the slot's zone now, false if it should use the shared pool
+ */
+static bool
+zsm_get_affine_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+    uint32_t index = zn_thread_index() % state->nr_slots;
+    struct zsm_affinity_slot *slot = &state->slots[index];
+
+    // Another thread of the group is writing to it, waiting could deadlock with the eviction
+    // policy lock, so use the pool instead
+    if (!g_mutex_trylock(&slot->lock)) {
+        return false;
+    }
+
+    if (slot->zone == NULL) {
+        g_mutex_lock(&state->state_mutex);
+
+        uint32_t active_zones = zsm_nr_active(state);
+        if (active_zones >= state->max_nr_active_zones || g_queue_is_empty(state->free)) {
+            g_mutex_unlock(&state->state_mutex);
+            g_mutex_unlock(&slot->lock);
+            return false;
+        }
+
+        struct zn_zone *zone = g_queue_pop_head(state->free);
+        int ret = open_zone(state, zone);
+        if (ret) {
+            dbg_printf("Failed to open zone: %d with error: %d\n", zone->zone_id, ret);
+            g_queue_push_head(state->free, zone);
+            g_mutex_unlock(&state->state_mutex);
+            g_mutex_unlock(&slot->lock);
+            return false;
+        }
+
+        // Owned zones aren't in the pool, they count as being written for as long as they're owned
+        g_queue_remove(state->active, zone);
+        state->writes_occurring++;
+        zone->state = ZN_ZONE_WRITE_OCCURING;
+        zone->slot = (int32_t) index;
+        slot->zone = zone;
+
+        g_mutex_unlock(&state->state_mutex);
+    }
+
+    *pair = (struct zn_pair) {
+        .zone = slot->zone->zone_id,
+        .chunk_offset = slot->zone->chunk_offset
+    };
+    return true;
+}
+
+/**
+ * @brief Moves the zone of a slot back to the pool of active zones
+ *
+ * @note assumes that the state lock and the slot lock are held
+ */
+static void
+zsm_release_slot(struct zone_state_manager *state, struct zsm_affinity_slot *slot) {
+    struct zn_zone *zone = slot->zone;
+    assert(zone->state == ZN_ZONE_WRITE_OCCURING);
+    assert(zone->chunk_offset < state->max_zone_chunks);
+
+    state->writes_occurring--;
+    zone->slot = -1;
+    slot->zone = NULL;
+    zone->state = ZN_ZONE_ACTIVE;
+    g_queue_push_tail(state->active, zone);
+    zsm_wake_one(state);
+}
+
+/**
+ * @brief Moves the zones of slots that nobody is writing to back to the pool
+ *
+ * Owned zones count as being written, so without this a thread that finds no zone would wait
+ * for slots that are idle, or evict while they still have room.
+ *
+ * @note assumes that the state lock is held
+ */
+static void
+zsm_release_idle_slots(struct zone_state_manager *state) {
+    for (uint32_t i = 0; i < state->nr_slots; i++) {
+        struct zsm_affinity_slot *slot = &state->slots[i];
+        // Slot locks are taken before the state lock, so only try them
+        if (!g_mutex_trylock(&slot->lock)) {
+            continue;
+        }
+        if (slot->zone != NULL) {
+            zsm_release_slot(state, slot);
+        }
+        g_mutex_unlock(&slot->lock);
+    }
+}
+
+/**
+ * @brief Returns the zone of an affinity slot after it's written to
+ *
+ * Called by the thread holding the slot. The zone stays with the slot until it is full, or
+ * goes back to the pool if other threads are waiting for a zone.
+ */
+static int
+zsm_return_affine_zone(struct zone_state_manager *state, struct zn_zone *zone,
+                       struct zn_pair *pair, uint32_t nr_chunks, bool *zone_full) {
+    struct zsm_affinity_slot *slot = &state->slots[zone->slot];
+    assert(slot->zone == zone);
+    assert(zone->chunk_offset == pair->chunk_offset);
+
+    zone->chunk_offset += nr_chunks;
+    assert(zone->chunk_offset <= state->max_zone_chunks);
+
+    int ret = 0;
+    if (zone->chunk_offset == state->max_zone_chunks) {
+        g_mutex_lock(&state->state_mutex);
+        state->writes_occurring--;
+        zone->slot = -1;
+        slot->zone = NULL;
+        ret = close_zone(state, zone);
+        if (ret != 0) {
+            dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
+        } else {
+            *zone_full = true;
+        }
+        g_mutex_unlock(&state->state_mutex);
+    } else if (g_atomic_int_get(&state->nr_waiting) > 0) {
+        g_mutex_lock(&state->state_mutex);
+        zsm_release_slot(state, slot);
+        g_mutex_unlock(&state->state_mutex);
+    }
+
+    g_mutex_unlock(&slot->lock);
+    return ret;
+}
+
 void
 zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int fd,
          const uint64_t zone_cap, const uint64_t zone_size, const size_t chunk_size,
          const uint32_t max_nr_active_zones,
-         const enum zn_backend backend_type) {
+         const enum zn_backend backend_type, const bool shared, const bool append,
+         const bool affinity) {
     assert(state);
     state->fd = fd;
     state->zone_cap = zone_cap;
@@ -144,8 +656,37 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
     state->writes_occurring = 0;
     state->num_zones = num_zones;
     state->backend_type = backend_type;
+    state->shared = shared || append;
+    state->append = append;
+    state->current = NULL;
+
+    // One zone stays for the shared pool, threads whose group is busy write there
+    state->nr_slots = 0;
+    state->slots = NULL;
+    if (affinity && !state->shared && max_nr_active_zones > 1) {
+        state->nr_slots = MIN(max_nr_active_zones - 1, ZN_MAX_THREADS);
+        state->slots = g_new0(struct zsm_affinity_slot, state->nr_slots);
+        for (uint32_t i = 0; i < state->nr_slots; i++) {
+            g_mutex_init(&state->slots[i].lock);
+        }
+    }
 
     g_mutex_init(&state->state_mutex);
+    g_queue_init(&state->waiters);
+    state->nr_waiting = 0;
+    state->nr_retired = 0;
+    state->next_ticket = 1;
+
+    // Only zoned devices have finish and reset commands to wait for
+    g_queue_init(&state->pending);
+    g_cond_init(&state->work_cond);
+    g_cond_init(&state->idle_cond);
+    state->nr_finishing = 0;
+    state->nr_resetting = 0;
+    state->nr_stuck_open = 0;
+    state->busy = false;
+    state->stopping = false;
+    state->worker = NULL;
 
     state->active = g_queue_new();
     assert(state->active);
@@ -155,40 +696,142 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
     assert(state->free);
     assert(state->state);
     for (uint32_t i = 0; i < num_zones; i++) {
-        GQueue *queue = g_queue_new();
-        assert(queue);
         state->state[i] = (struct zn_zone) {
             .state = ZN_ZONE_FREE,
             .zone_id = i,
             .chunk_offset = 0,
-            .invalid = queue
+            .reserved = (gint) state->max_zone_chunks,
+            .written = 0,
+            .slot = -1,
+            .reset_pending = false,
+            .retired = false,
+            .stuck_open = false,
+            .cmd_failures = 0,
         };
+        zn_bitmap_init(&state->state[i].valid, (uint32_t) state->max_zone_chunks);
+        zn_bitmap_init(&state->state[i].invalid, (uint32_t) state->max_zone_chunks);
         g_queue_push_tail(state->free, &state->state[i]);
     }
+
+    if (backend_type == ZE_BACKEND_ZNS) {
+        state->worker = g_thread_new("zone-worker", zsm_worker, state);
+    }
 }
 
-enum zsm_get_active_zone_error
-zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+void
+zsm_drain(struct zone_state_manager *state) {
+    g_mutex_lock(&state->state_mutex);
+    while (!g_queue_is_empty(&state->pending) || state->busy) {
+        g_cond_wait(&state->idle_cond, &state->state_mutex);
+    }
+    g_mutex_unlock(&state->state_mutex);
+}
+
+void
+zsm_destroy(struct zone_state_manager *state) {
+    if (state->worker != NULL) {
+        // The worker finishes what is queued before it stops
+        g_mutex_lock(&state->state_mutex);
+        state->stopping = true;
+        g_cond_signal(&state->work_cond);
+        g_mutex_unlock(&state->state_mutex);
+        g_thread_join(state->worker);
+        state->worker = NULL;
+    }
+}
+
+int
+zsm_restore(struct zone_state_manager *state, uint32_t *written) {
     assert(state);
-    assert(pair);
+
+    // Only the write pointers are read, not the chunks
+    struct zbd_zone *zones = NULL;
+    if (state->backend_type == ZE_BACKEND_ZNS) {
+        zones = g_new(struct zbd_zone, state->num_zones);
+        unsigned int nr_zones = state->num_zones;
+        if (zbd_report_zones(state->fd, 0, (off_t) state->num_zones * state->zone_size,
+                             ZBD_RO_ALL, zones, &nr_zones) != 0 ||
+            nr_zones < state->num_zones) {
+            fprintf(stderr, "Couldn't report zones to restore\n");
+            g_free(zones);
+            return -1;
+        }
+    }
 
     g_mutex_lock(&state->state_mutex);
+    assert(g_queue_is_empty(state->active) && state->writes_occurring == 0);
+
+    int ret = 0;
+    g_queue_clear(state->free);
+    for (uint32_t i = 0; i < state->num_zones; i++) {
+        struct zn_zone *zone = &state->state[i];
+        assert(zone->state == ZN_ZONE_FREE);
+
+        bool empty = true, full = false;
+        if (zones != NULL) {
+            empty = zbd_zone_empty(&zones[i]);
+            full = zbd_zone_full(&zones[i]);
+            uint64_t on_device =
+                full ? state->max_zone_chunks
+                     : (zbd_zone_wp(&zones[i]) - zbd_zone_start(&zones[i])) / state->chunk_size;
+            if (written[i] > 0) {
+                written[i] = (uint32_t) MIN(on_device, state->max_zone_chunks);
+            }
+        }
+
+        if (written[i] == 0) {
+            // Chunks that were written but never journaled are dropped with the zone
+            if (!empty && zsm_zone_cmd(state, i, 1, true) != 0) {
+                ret = -1;
+            }
+            g_queue_push_tail(state->free, zone);
+            continue;
+        }
+
+        if (zones != NULL && !full && zsm_zone_cmd(state, i, 1, false) != 0) {
+            ret = -1;
+        }
+        dbg_printf("Restored zone %u with %u chunks\n", i, written[i]);
+        zone->state = ZN_ZONE_FULL;
+    }
+
+    g_mutex_unlock(&state->state_mutex);
+    g_free(zones);
+    return ret;
+}
+
+/**
+ * @brief Takes an exclusive zone, queues the caller if none can be taken
+ */
+static enum zsm_get_active_zone_error
+zsm_take_exclusive(struct zone_state_manager *state, struct zn_pair *pair,
+                   struct zsm_waiter *waiter) {
+    if (state->nr_slots > 0 && zsm_get_affine_zone(state, pair)) {
+        return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+    }
+
+    g_mutex_lock(&state->state_mutex);
+
+    // Idle slots have to give their zones up before anyone waits or evicts
+    if (state->nr_slots > 0 && g_queue_is_empty(state->active) &&
+        (zsm_nr_active(state) >= state->max_nr_active_zones || g_queue_is_empty(state->free))) {
+        zsm_release_idle_slots(state);
+    }
 
     uint32_t active_queue_size = g_queue_get_length(state->active);
     uint32_t writer_size = state->writes_occurring;
     uint32_t free_queue_size = g_queue_get_length(state->free);
 
-    // Perform foreground eviction
-    if ((active_queue_size + writer_size) == 0 && free_queue_size == 0) {
+    // Perform foreground eviction, unless a zone being reset or retired is free soon
+    if ((active_queue_size + writer_size) == 0 && free_queue_size == 0 &&
+        state->nr_resetting == 0 && state->nr_retired == 0) {
         g_mutex_unlock(&state->state_mutex);
         return ZSM_GET_ACTIVE_ZONE_EVICT;
     }
 
-    assert((active_queue_size + writer_size) > 0 || free_queue_size > 0);
-
     // No active zones that we can use
     if (active_queue_size == 0) {
-        uint32_t active_zones = g_queue_get_length(state->active) + state->writes_occurring;
+        uint32_t active_zones = zsm_nr_active(state);
 
         // Open a new zone if we can
         if (active_zones < state->max_nr_active_zones && free_queue_size > 0) {
@@ -205,13 +848,15 @@ zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
 
         } else {
             // The thread needs to wait for a free zone
+            zsm_enqueue_waiter(state, waiter);
             g_mutex_unlock(&state->state_mutex);
             return ZSM_GET_ACTIVE_ZONE_RETRY;
         }
     }
 
-    // Get an active zone
     dbg_print_g_queue("active queue (zone,chunk,state)", state->active, PRINT_G_QUEUE_ZN_ZONE);
+
+    // Get an active zone
     struct zn_zone *active_pair = g_queue_pop_head(state->active);
     assert(active_pair->state == ZN_ZONE_ACTIVE);
 
@@ -227,77 +872,256 @@ zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
     return ZSM_GET_ACTIVE_ZONE_SUCCESS;
 }
 
-#ifdef TODO
-// TODO
-GArray
-zsm_get_active_zone_batch(int chunks) {
-    (void) chunks;
+enum zsm_get_active_zone_error
+zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+    uint32_t nr_chunks;
+    return zsm_get_active_zone_batch(state, 1, pair, &nr_chunks);
 }
-#endif
 
-int
-zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+enum zsm_get_active_zone_error
+zsm_get_active_zone_batch(struct zone_state_manager *state, uint32_t chunks, struct zn_pair *pair,
+                          uint32_t *nr_chunks) {
+    struct zsm_waiter waiter;
+    zsm_waiter_init(&waiter);
+
+    enum zsm_get_active_zone_error ret;
+    while ((ret = zsm_try_get_active_zone_batch(state, chunks, pair, nr_chunks, &waiter)) ==
+           ZSM_GET_ACTIVE_ZONE_RETRY) {
+        zsm_wait(state, &waiter);
+    }
+
+    zsm_waiter_clear(&waiter);
+    return ret;
+}
+
+enum zsm_get_active_zone_error
+zsm_try_get_active_zone_batch(struct zone_state_manager *state, uint32_t chunks,
+                              struct zn_pair *pair, uint32_t *nr_chunks,
+                              struct zsm_waiter *waiter) {
     assert(state);
     assert(pair);
+    assert(chunks > 0);
+    assert(nr_chunks);
+    assert(waiter);
 
+    if (state->shared) {
+        return zsm_reserve_shared(state, state->append ? 1 : chunks, pair, nr_chunks, waiter);
+    }
+
+    enum zsm_get_active_zone_error ret = zsm_take_exclusive(state, pair, waiter);
+    if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+        return ret;
+    }
+
+    // The zone is ours until it is returned, its chunk offset can't move
+    *nr_chunks = MIN(chunks, state->max_zone_chunks - pair->chunk_offset);
+    return ret;
+}
+
+void
+zsm_waiter_init(struct zsm_waiter *waiter) {
+    g_cond_init(&waiter->cond);
+    waiter->ticket = 0;
+    waiter->queued = false;
+}
+
+void
+zsm_waiter_clear(struct zsm_waiter *waiter) {
+    assert(!waiter->queued);
+    g_cond_clear(&waiter->cond);
+}
+
+void
+zsm_wait_for_zone(struct zone_state_manager *state, struct zsm_waiter *waiter) {
+    g_mutex_lock(&state->state_mutex);
+    // A zone returned or reset since the caller was told to evict woke nobody
+    if (g_queue_is_empty(state->active) && g_queue_is_empty(state->free) && !waiter->queued) {
+        zsm_enqueue_waiter(state, waiter);
+    }
+    while (waiter->queued) {
+        g_cond_wait(&waiter->cond, &state->state_mutex);
+    }
+    g_mutex_unlock(&state->state_mutex);
+}
+
+void
+zsm_wake_waiter(struct zone_state_manager *state, struct zsm_waiter *waiter) {
+    g_mutex_lock(&state->state_mutex);
+    if (waiter->queued) {
+        g_queue_remove(&state->waiters, waiter);
+        g_atomic_int_add(&state->nr_waiting, -1);
+        waiter->queued = false;
+        g_cond_signal(&waiter->cond);
+    }
+    g_mutex_unlock(&state->state_mutex);
+}
+
+void
+zsm_wait(struct zone_state_manager *state, struct zsm_waiter *waiter) {
     g_mutex_lock(&state->state_mutex);
-    assert(g_queue_get_length(state->active) + state->writes_occurring <=
-           state->max_nr_active_zones);
+    while (waiter->queued) {
+        g_cond_wait(&waiter->cond, &state->state_mutex);
+    }
+    g_mutex_unlock(&state->state_mutex);
+}
+
+int
+zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair, bool *zone_full) {
+    return zsm_return_active_zone_batch(state, pair, 1, zone_full);
+}
+
+int
+zsm_return_active_zone_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                             uint32_t nr_chunks, bool *zone_full) {
+    assert(state);
+    assert(pair);
+    assert(zone_full);
+    assert(nr_chunks > 0);
 
     struct zn_zone *zone = &state->state[pair->zone];
+    if (state->shared) {
+        assert(pair->chunk_offset < state->max_zone_chunks);
+        return zsm_shared_done(state, zone, nr_chunks, zone_full);
+    }
+
+    *zone_full = false;
+
+    if (zone->slot >= 0) {
+        return zsm_return_affine_zone(state, zone, pair, nr_chunks, zone_full);
+    }
+
+    g_mutex_lock(&state->state_mutex);
+    assert(zsm_nr_active(state) <= state->max_nr_active_zones);
+
     assert(zone->state == ZN_ZONE_WRITE_OCCURING);
     assert(zone->chunk_offset == pair->chunk_offset);
 
-    // Update the state of the chunk
+    // Update the state of the chunks
     state->writes_occurring--;
-    zone->chunk_offset++;
-    if (zone->chunk_offset == state->max_zone_chunks) {
-        int ret = close_zone(state, zone);
-        if (ret != 0) {
-            dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
-            g_mutex_unlock(&state->state_mutex);
-            return ret;
-        }
-    } else {
+    zone->chunk_offset += nr_chunks;
+    assert(zone->chunk_offset <= state->max_zone_chunks);
+    if (zone->chunk_offset < state->max_zone_chunks) {
         zone->state = ZN_ZONE_ACTIVE;
         g_queue_push_tail(state->active, zone);
+        zsm_wake_one(state);
+        g_mutex_unlock(&state->state_mutex);
+        return 0;
     }
 
+    int ret = close_zone(state, zone);
+    if (ret != 0) {
+        dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
+        g_mutex_unlock(&state->state_mutex);
+        return ret;
+    }
+    *zone_full = true;
+
     g_mutex_unlock(&state->state_mutex);
     return 0;
 }
 
-int
-zsm_evict(struct zone_state_manager *state, int zone_to_free) {
+void
+zsm_retire_zones(struct zone_state_manager *state, const uint32_t *zones, uint32_t nr_zones) {
     assert(state);
 
     g_mutex_lock(&state->state_mutex);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        struct zn_zone *zone = &state->state[zones[i]];
+        assert(zone->state == ZN_ZONE_FULL || zone->state == ZN_ZONE_FINISHING);
+        assert(!zone->retired);
+        zone->retired = true;
+    }
+    g_atomic_int_add(&state->nr_retired, (gint) nr_zones);
+    g_mutex_unlock(&state->state_mutex);
+}
 
-    struct zn_zone *zone = &state->state[zone_to_free];
-    assert(zone->state == ZN_ZONE_FULL);
+bool
+zsm_waiting_for_retired(struct zone_state_manager *state) {
+    return g_atomic_int_get(&state->nr_retired) > 0 && g_atomic_int_get(&state->nr_waiting) > 0;
+}
 
-    int ret = reset_zone(state, zone);
-    if (!ret) {
-        g_mutex_unlock(&state->state_mutex);
-        return ret;
+int
+zsm_evict(struct zone_state_manager *state, int zone_to_free) {
+    uint32_t zone = (uint32_t) zone_to_free;
+    return zsm_evict_zones(state, &zone, 1);
+}
+
+static int
+zsm_zone_id_cmp(const void *a, const void *b) {
+    uint32_t za = *(const uint32_t *) a;
+    uint32_t zb = *(const uint32_t *) b;
+    return (za > zb) - (za < zb);
+}
+
+int
+zsm_evict_zones(struct zone_state_manager *state, const uint32_t *zones, uint32_t nr_zones) {
+    assert(state);
+
+    // Queued in order, so the worker resets consecutive zones with one command
+    uint32_t *sorted = g_new(uint32_t, nr_zones);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        sorted[i] = zones[i];
     }
+    qsort(sorted, nr_zones, sizeof(uint32_t), zsm_zone_id_cmp);
 
-    assert(zone->state == ZN_ZONE_FREE);
+    g_mutex_lock(&state->state_mutex);
 
-    g_queue_clear(state->state[zone_to_free].invalid);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        struct zn_zone *zone = &state->state[sorted[i]];
+        assert(zone->state == ZN_ZONE_FULL || zone->state == ZN_ZONE_FINISHING);
+        if (zone->retired) {
+            zone->retired = false;
+            g_atomic_int_add(&state->nr_retired, -1);
+        }
+
+        if (state->worker == NULL) {
+            reset_zone(state, zone);
+        } else if (zone->state == ZN_ZONE_FINISHING) {
+            // The worker resets it after the finish, or instead of it if it didn't start yet
+            zone->reset_pending = true;
+        } else {
+            zone->state = ZN_ZONE_RESETTING;
+            state->nr_resetting++;
+            g_queue_push_tail(&state->pending, zone);
+        }
+    }
+    g_cond_signal(&state->work_cond);
 
     g_mutex_unlock(&state->state_mutex);
+    g_free(sorted);
     return 0;
 }
 
-void
+bool
 zsm_failed_to_write(struct zone_state_manager *state, struct zn_pair pair) {
+    return zsm_failed_to_write_batch(state, pair, 1);
+}
+
+bool
+zsm_failed_to_write_batch(struct zone_state_manager *state, struct zn_pair pair,
+                          uint32_t nr_chunks) {
     assert(state);
 
+    struct zn_zone *zone = &state->state[pair.zone];
+    if (state->shared) {
+        // Chunks after it may already be written, so its slot stays empty
+        bool zone_full = false;
+        if (zsm_shared_done(state, zone, nr_chunks, &zone_full) != 0) {
+            dbg_printf("Couldn't close zone %u after a failed write\n", zone->zone_id);
+        }
+        return zone_full;
+    }
+
+    // The zone stays with its group, the same chunk is handed out again
+    if (zone->slot >= 0) {
+        assert(zone->chunk_offset == pair.chunk_offset);
+        g_mutex_unlock(&state->slots[zone->slot].lock);
+        return false;
+    }
+
     g_mutex_lock(&state->state_mutex);
-    assert(g_queue_get_length(state->active) + state->writes_occurring <= state->max_nr_active_zones);
+    assert(zsm_nr_active(state) <= state->max_nr_active_zones);
 
-    struct zn_zone *zone = &state->state[pair.zone];
     assert(zone->state == ZN_ZONE_WRITE_OCCURING);
     assert(zone->chunk_offset == pair.chunk_offset);
     assert(zone->chunk_offset < state->max_zone_chunks);
@@ -306,14 +1130,16 @@ zsm_failed_to_write(struct zone_state_manager *state, struct zn_pair pair) {
     state->writes_occurring--;
     zone->state = ZN_ZONE_ACTIVE;
     g_queue_push_tail(state->active, zone);
+    zsm_wake_one(state);
 
     g_mutex_unlock(&state->state_mutex);
+    return false;
 }
 
 uint32_t
 zsm_get_num_active_zones(struct zone_state_manager *state) {
     g_mutex_lock(&state->state_mutex);
-    uint32_t len = g_queue_get_length(state->active) + state->writes_occurring;
+    uint32_t len = zsm_nr_active(state);
     g_mutex_unlock(&state->state_mutex);
     return len;
 }
@@ -321,7 +1147,8 @@ zsm_get_num_active_zones(struct zone_state_manager *state) {
 uint32_t
 zsm_get_num_free_zones(struct zone_state_manager *state) {
     g_mutex_lock(&state->state_mutex);
-    uint32_t len = g_queue_get_length(state->free);
+    // Zones being reset are free once the device is done, don't evict more for them
+    uint32_t len = g_queue_get_length(state->free) + state->nr_resetting;
     g_mutex_unlock(&state->state_mutex);
     return len;
 }
@@ -332,7 +1159,9 @@ zsm_get_num_full_zones(struct zone_state_manager *state) {
     g_mutex_lock(&state->state_mutex);
     uint32_t count = 0;
     for (uint32_t i = 0; i < state->num_zones; i++) {
-        if (state->state[i].state == ZN_ZONE_FULL) {
+        // A zone being finished is written up to its capacity
+        if (state->state[i].state == ZN_ZONE_FULL ||
+            state->state[i].state == ZN_ZONE_FINISHING) {
             count++;
         }
     }
@@ -343,26 +1172,33 @@ zsm_get_num_full_zones(struct zone_state_manager *state) {
 
 uint32_t
 zsm_get_num_invalid_chunks(struct zone_state_manager *state, uint32_t zone) {
-    g_mutex_lock(&state->state_mutex);
-    uint32_t len = g_queue_get_length(state->state[zone].invalid);
-    g_mutex_unlock(&state->state_mutex);
-    return len;
+    return zn_bitmap_count(&state->state[zone].invalid);
+}
+
+void
+zsm_mark_chunk_valid(struct zone_state_manager *state, struct zn_pair *location) {
+    bool was_clear = zn_bitmap_set(&state->state[location->zone].valid, location->chunk_offset);
+    assert(was_clear);
+    (void) was_clear;
 }
 
 void
 zsm_mark_chunk_invalid(struct zone_state_manager *state, struct zn_pair *location) {
-    g_mutex_lock(&state->state_mutex);
     struct zn_zone *zone = &state->state[location->zone];
-    dbg_print_g_queue(
-        "state[location.zone].state->invalid before mark",
-        zone->invalid,
-        PRINT_G_QUEUE_GINT
-    );
-    g_queue_push_tail(zone->invalid, GUINT_TO_POINTER(location->chunk_offset));
-    dbg_print_g_queue(
-        "state[location.zone].state->invalid after mark",
-        zone->invalid,
-        PRINT_G_QUEUE_GINT
-    );
-    g_mutex_unlock(&state->state_mutex);
+    zn_bitmap_clear(&zone->valid, location->chunk_offset);
+    zn_bitmap_set(&zone->invalid, location->chunk_offset);
+    dbg_printf("Marked [%u,%u] invalid, zone has %u invalid chunks\n", location->zone,
+               location->chunk_offset, zn_bitmap_count(&zone->invalid));
+}
+
+void
+zsm_clear_chunk_valid(struct zone_state_manager *state, struct zn_pair *location) {
+    bool was_set = zn_bitmap_clear(&state->state[location->zone].valid, location->chunk_offset);
+    assert(was_set);
+    (void) was_set;
+}
+
+const struct zn_bitmap *
+zsm_get_valid_chunks(struct zone_state_manager *state, uint32_t zone) {
+    return &state->state[zone].valid;
 }
@@ -0,0 +1,261 @@
+// For O_DIRECT
+#define _GNU_SOURCE
+#include <assert.h>
+#include <libzbd/zbd.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "znutil.h"
+#include "zncache.h"
+
+#define CHUNK_SIZE 524288
+#define SEGMENT_SIZE (3 * ZN_BUFFER_ALIGN)
+#define WORKLOAD_SZ 1
+
+unsigned char *RANDOM_DATA = NULL;
+
+char *device = "/dev/nullb0";
+
+uint32_t workload[WORKLOAD_SZ] = {1};
+
+int
+setup_dev(char *device, struct zn_cache *cfg) {
+    struct zbd_info info = {0};
+    uint64_t zone_capacity = 0;
+    int fd;
+    int open_flags = O_RDWR;
+#ifdef ZN_DIRECT_IO
+    open_flags |= O_DIRECT;
+#endif
+    enum zn_backend backend = zbd_device_is_zoned(device) ? ZE_BACKEND_ZNS : ZE_BACKEND_BLOCK;
+    if (backend == ZE_BACKEND_ZNS) {
+        fd = zbd_open(device, open_flags, &info);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening device: %s\n", device);
+            return fd;
+        }
+
+        int ret = zbd_reset_zones(fd, 0, 0);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't reset zones\n");
+            return -1;
+        }
+
+        ret = zone_cap(fd, &zone_capacity);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't report zone info\n");
+            return ret;
+        }
+    } else {
+        fd = open(device, open_flags);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening device: %s\n", device);
+            return fd;
+        }
+
+        uint64_t size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+            fprintf(stderr, "Error: Couldn't get block size: %s\n", device);
+            return -1;
+        }
+
+        if (size < BLOCK_ZONE_CAPACITY) {
+            fprintf(stderr, "Error: The size of the disk is smaller than a single zone!\n");
+            return -1;
+        }
+        info.nr_zones = ((long) size / BLOCK_ZONE_CAPACITY);
+        info.max_nr_active_zones = 0;
+        info.zone_size = BLOCK_ZONE_CAPACITY;
+
+        zone_capacity = BLOCK_ZONE_CAPACITY;
+    }
+
+    zn_init_cache(cfg, &info, CHUNK_SIZE, zone_capacity, fd, 1, EVICTION_POLICY, backend,
+                  workload, WORKLOAD_SZ, NULL);
+
+    return 0;
+}
+
+struct stream_check {
+    size_t next;   /**< Offset the next segment must start at */
+    int failures;
+};
+
+static int
+check_segment(const unsigned char *data, size_t offset, size_t len, void *user_data) {
+    struct stream_check *check = user_data;
+    if (offset != check->next || len == 0 || len > SEGMENT_SIZE ||
+        memcmp(data, RANDOM_DATA + offset, len) != 0) {
+        printf("TEST FAILED: Bad segment at offset=%zu, len=%zu, expected offset=%zu\n", offset,
+               len, check->next);
+        check->failures++;
+    }
+    check->next = offset + len;
+    return 0;
+}
+
+/**
+ * @brief Test that unaligned ranges of a chunk are read into unaligned buffers.
+ * @return 0 on success, non-zero on failure.
+ */
+int
+test_range(struct zn_cache *cfg) {
+    uint32_t data_id = 1;
+    // Past the chunk header, the rest of the chunk is RANDOM_DATA
+    size_t offset = ZN_BUFFER_ALIGN + 1;
+    size_t len = 1000;
+
+    unsigned char *buf = malloc(2 * ZN_BUFFER_ALIGN + 1);
+    struct iovec iov = {.iov_base = buf + 1, .iov_len = len};
+
+    // Miss, then hit
+    for (int i = 0; i < 2; i++) {
+        memset(buf, 0, 2 * ZN_BUFFER_ALIGN + 1);
+        if (zn_cache_get_range(cfg, data_id, offset, &iov, 1, RANDOM_DATA) != 0) {
+            printf("TEST FAILED: Couldn't get range of id=%u\n", data_id);
+            free(buf);
+            return 1;
+        }
+        if (memcmp(iov.iov_base, RANDOM_DATA + offset, len) != 0) {
+            printf("TEST FAILED: Wrong range returned for id=%u\n", data_id);
+            free(buf);
+            return 2;
+        }
+    }
+
+    // A range that crosses a block boundary
+    offset = 3 * ZN_BUFFER_ALIGN - 7;
+    iov.iov_len = 2 * ZN_BUFFER_ALIGN - 3;
+    if (zn_cache_get_range(cfg, data_id, offset, &iov, 1, RANDOM_DATA) != 0 ||
+        memcmp(iov.iov_base, RANDOM_DATA + offset, iov.iov_len) != 0) {
+        printf("TEST FAILED: Wrong range across blocks for id=%u\n", data_id);
+        free(buf);
+        return 3;
+    }
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief Test that a stream hands out contiguous segments covering exactly the range.
+ * @return 0 on success, non-zero on failure.
+ */
+int
+test_stream(struct zn_cache *cfg) {
+    uint32_t data_id = 2;
+    size_t offset = 100;
+    size_t len = 5 * SEGMENT_SIZE + 17;
+    unsigned char *segment = zn_buffer_alloc_aligned(SEGMENT_SIZE);
+
+    // Miss, then hit
+    int failures = 0;
+    for (int i = 0; i < 2; i++) {
+        struct stream_check check = {.next = offset, .failures = 0};
+        if (zn_cache_get_stream(cfg, data_id, offset, len, segment, SEGMENT_SIZE, check_segment,
+                                &check, RANDOM_DATA) != 0) {
+            printf("TEST FAILED: Couldn't stream id=%u\n", data_id);
+            failures++;
+        }
+        if (check.next != offset + len) {
+            printf("TEST FAILED: Stream ended at %zu, expected %zu\n", check.next, offset + len);
+            failures++;
+        }
+        failures += check.failures;
+    }
+
+    free(segment);
+    return failures;
+}
+
+/**
+ * @brief Test a batched get of hits next to each other, misses and a duplicate ID.
+ * @return 0 on success, non-zero on failure.
+ */
+int
+test_mget(struct zn_cache *cfg) {
+    // Written one after the other, so their chunks are adjacent and read together
+    uint32_t cached[] = {10, 11, 12};
+    for (uint32_t i = 0; i < 3; i++) {
+        unsigned char *data = zn_cache_get(cfg, cached[i], RANDOM_DATA);
+        if (data == NULL) {
+            return 1;
+        }
+        zn_cache_release(cfg, data);
+    }
+
+    uint32_t ids[] = {12, 20, 10, 11, 20, 21};
+    uint32_t nr = sizeof(ids) / sizeof(ids[0]);
+    struct iovec bufs[sizeof(ids) / sizeof(ids[0])];
+    for (uint32_t i = 0; i < nr; i++) {
+        bufs[i] = (struct iovec) {.iov_base = zn_buffer_alloc_aligned(CHUNK_SIZE),
+                                  .iov_len = CHUNK_SIZE};
+    }
+
+    uint64_t hits = cfg->ratio.hits, misses = cfg->ratio.misses;
+    int failures = 0;
+    if (zn_cache_mget(cfg, ids, nr, bufs, RANDOM_DATA) != 0) {
+        printf("TEST FAILED: Couldn't get batch\n");
+        failures++;
+    }
+    for (uint32_t i = 0; i < nr; i++) {
+        if (zn_validate_read(cfg, bufs[i].iov_base, ids[i], RANDOM_DATA) != 0) {
+            printf("TEST FAILED: Wrong data returned for ids[%u]=%u\n", i, ids[i]);
+            failures++;
+        }
+        free(bufs[i].iov_base);
+    }
+
+    // The second 20 waits for the first one and is a hit
+    if (cfg->ratio.hits - hits != 4 || cfg->ratio.misses - misses != 2) {
+        printf("TEST FAILED: hits=%" PRIu64 ", misses=%" PRIu64 ", expected 4 and 2\n",
+               cfg->ratio.hits - hits, cfg->ratio.misses - misses);
+        failures++;
+    }
+
+    return failures;
+}
+
+int
+main(void) {
+    int failures = 0;
+
+    RANDOM_DATA = generate_random_buffer(CHUNK_SIZE);
+    if (RANDOM_DATA == NULL) {
+        return 1;
+    }
+
+    struct zn_cache cfg = {0};
+    if (setup_dev(device, &cfg) != 0) {
+        fprintf(stderr, "Error: Couldn't setup device %s\n", device);
+        return 1;
+    }
+
+    if (test_range(&cfg) != 0) {
+        printf("Test FAILED: test_range()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_range()\n");
+    }
+
+    if (test_stream(&cfg) != 0) {
+        printf("Test FAILED: test_stream()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_stream()\n");
+    }
+
+    if (test_mget(&cfg) != 0) {
+        printf("Test FAILED: test_mget()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_mget()\n");
+    }
+
+    return failures;
+}
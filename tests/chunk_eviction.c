@@ -74,7 +74,7 @@ setup_dev(char *device, struct zn_cache *cfg) {
     }
 
 	zn_init_cache(cfg, &info, CHUNK_SIZE, zone_capacity,
-              fd, ZN_EVICT_CHUNK, backend, workload,
+              fd, 1, ZN_EVICT_CHUNK, backend, workload,
               WORKLOAD_SZ, NULL);
 
     return 0;
@@ -90,9 +90,11 @@ test_evict(struct zn_cache *cfg) {
             printf("TEST FAILED: Wrong data returned for workload[%u]=%u\n", wi, workload[wi]);
             return 1;
         }
+        zn_cache_release(cfg, data);
     }
 
-    // Now we are preloaded, check:
+    // Now we are preloaded, check once the zones were finished:
+    zsm_drain(&cfg->zone_state);
     uint32_t free_zones = zsm_get_num_free_zones(&cfg->zone_state);
     if (free_zones != 0) {
         printf("TEST FAILED: Free zones %u, expected 0\n", free_zones);
@@ -118,8 +120,12 @@ test_evict(struct zn_cache *cfg) {
         printf("TEST FAILED: Wrong data returned for id=%u\n", data_id);
         failures++;
     }
+    if (data != NULL) {
+        zn_cache_release(cfg, data);
+    }
 
     // 3 because 14-4, add 1 chunk, 3 free
+    zsm_drain(&cfg->zone_state);
     free_zones = zsm_get_num_free_zones(&cfg->zone_state);
     uint32_t expect = EVICT_LOW_THRESH_ZONES-1;
     if (free_zones != expect) {
@@ -0,0 +1,201 @@
+// For O_DIRECT
+#define _GNU_SOURCE
+#include <assert.h>
+#include <libzbd/zbd.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "znutil.h"
+#include "zncache.h"
+
+#define CHUNK_SIZE 524288
+#define STAGE_CHUNKS 4
+#define WORKLOAD_SZ 1
+
+unsigned char *RANDOM_DATA = NULL;
+
+char *device = "/dev/nullb0";
+
+uint32_t workload[WORKLOAD_SZ] = {1};
+
+int
+setup_dev(char *device, struct zn_cache *cfg) {
+    struct zbd_info info = {0};
+    uint64_t zone_capacity = 0;
+    int fd;
+    int open_flags = O_RDWR;
+#ifdef ZN_DIRECT_IO
+    open_flags |= O_DIRECT;
+#endif
+    enum zn_backend backend = zbd_device_is_zoned(device) ? ZE_BACKEND_ZNS : ZE_BACKEND_BLOCK;
+    if (backend == ZE_BACKEND_ZNS) {
+        fd = zbd_open(device, open_flags, &info);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening device: %s\n", device);
+            return fd;
+        }
+
+        int ret = zbd_reset_zones(fd, 0, 0);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't reset zones\n");
+            return -1;
+        }
+
+        ret = zone_cap(fd, &zone_capacity);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't report zone info\n");
+            return ret;
+        }
+    } else {
+        fd = open(device, open_flags);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening device: %s\n", device);
+            return fd;
+        }
+
+        uint64_t size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+            fprintf(stderr, "Error: Couldn't get block size: %s\n", device);
+            return -1;
+        }
+
+        if (size < BLOCK_ZONE_CAPACITY) {
+            fprintf(stderr, "Error: The size of the disk is smaller than a single zone!\n");
+            return -1;
+        }
+        info.nr_zones = ((long) size / BLOCK_ZONE_CAPACITY);
+        info.max_nr_active_zones = 0;
+        info.zone_size = BLOCK_ZONE_CAPACITY;
+
+        zone_capacity = BLOCK_ZONE_CAPACITY;
+    }
+
+    zn_init_cache(cfg, &info, CHUNK_SIZE, zone_capacity, fd, 1, EVICTION_POLICY, backend,
+                  workload, WORKLOAD_SZ, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief Gets a chunk and checks its data
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+get_valid(struct zn_cache *cfg, uint32_t id) {
+    unsigned char *data = zn_cache_get(cfg, id, RANDOM_DATA);
+    if (data == NULL) {
+        printf("TEST FAILED: Couldn't get id=%u\n", id);
+        return 1;
+    }
+    int ret = zn_validate_read(cfg, data, id, RANDOM_DATA);
+    if (ret != 0) {
+        printf("TEST FAILED: Wrong data returned for id=%u\n", id);
+    }
+    zn_cache_release(cfg, data);
+    return ret;
+}
+
+/**
+ * @brief Test that a zone whose staged chunks couldn't be flushed isn't completed, and that
+ * the flush is retried by the next write to the zone.
+ * @return 0 on success, non-zero on failure.
+ */
+int
+test_failed_flush(struct zn_cache *cfg) {
+    uint32_t last = (uint32_t) cfg->max_zone_chunks;
+
+    // Single threaded, every chunk goes to the first zone
+    for (uint32_t id = 1; id < last; id++) {
+        if (get_valid(cfg, id) != 0) {
+            return 1;
+        }
+    }
+
+    // Writes to a read only descriptor fail, reads still work
+    int open_flags = O_RDONLY;
+#ifdef ZN_DIRECT_IO
+    open_flags |= O_DIRECT;
+#endif
+    int fd = cfg->io.fd;
+    int ro_fd = open(device, open_flags);
+    if (ro_fd < 0) {
+        printf("TEST FAILED: Couldn't open %s read only\n", device);
+        return 2;
+    }
+    cfg->io.fd = ro_fd;
+
+    int failures = 0;
+    unsigned char *data = zn_cache_get(cfg, last, RANDOM_DATA);
+    if (data != NULL) {
+        printf("TEST FAILED: The last chunk of the zone was written with a failed flush\n");
+        zn_cache_release(cfg, data);
+        failures++;
+    }
+
+    zsm_drain(&cfg->zone_state);
+    if (zsm_get_num_full_zones(&cfg->zone_state) != 0) {
+        printf("TEST FAILED: The zone was completed with a failed flush\n");
+        failures++;
+    }
+
+    // Still staged
+    failures += get_valid(cfg, last - 1);
+
+    cfg->io.fd = fd;
+    close(ro_fd);
+
+    // The retry flushes the chunks staged before the failure too
+    failures += get_valid(cfg, last);
+    zsm_drain(&cfg->zone_state);
+    if (zsm_get_num_full_zones(&cfg->zone_state) != 1) {
+        printf("TEST FAILED: The zone wasn't completed after the flush was retried\n");
+        failures++;
+    }
+    if (zn_stage_holds(cfg, (struct zn_pair) {.zone = 0, .chunk_offset = last - 1})) {
+        printf("TEST FAILED: Chunks are still staged in a full zone\n");
+        failures++;
+    }
+    failures += get_valid(cfg, last - 1);
+
+    return failures;
+}
+
+int
+main(void) {
+    int failures = 0;
+
+    RANDOM_DATA = generate_random_buffer(CHUNK_SIZE);
+    if (RANDOM_DATA == NULL) {
+        return 1;
+    }
+
+    struct zn_cache cfg = {0};
+    if (setup_dev(device, &cfg) != 0) {
+        fprintf(stderr, "Error: Couldn't setup device %s\n", device);
+        return 1;
+    }
+
+    // Shared zones are never staged
+    if (cfg.shared_zones) {
+        printf("Test SKIPPED: test_failed_flush(), zones are shared\n");
+        return 0;
+    }
+
+    // Stage every write, whatever the build configured
+    zn_stage_destroy(&cfg);
+    zn_stage_init(&cfg, STAGE_CHUNKS * CHUNK_SIZE);
+    cfg.coalescer.max_chunks = 1;
+
+    if (test_failed_flush(&cfg) != 0) {
+        printf("Test FAILED: test_failed_flush()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_failed_flush()\n");
+    }
+
+    return failures;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+
+#include "znbitmap.h"
+
+/**
+ * @brief Test setting, clearing and counting bits, with a partial last word.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_set_clear_count() {
+    struct zn_bitmap bitmap;
+    zn_bitmap_init(&bitmap, 70);
+
+    if (zn_bitmap_count(&bitmap) != 0) return 1;
+
+    if (!zn_bitmap_set(&bitmap, 0)) return 2;
+    if (!zn_bitmap_set(&bitmap, 31)) return 3;
+    if (!zn_bitmap_set(&bitmap, 32)) return 4;
+    if (!zn_bitmap_set(&bitmap, 69)) return 5;
+    if (zn_bitmap_set(&bitmap, 69)) return 6; // Already set
+    if (zn_bitmap_count(&bitmap) != 4) return 7;
+
+    if (!zn_bitmap_test(&bitmap, 31) || zn_bitmap_test(&bitmap, 30)) return 8;
+
+    if (!zn_bitmap_clear(&bitmap, 31)) return 9;
+    if (zn_bitmap_clear(&bitmap, 31)) return 10; // Already clear
+    if (zn_bitmap_count(&bitmap) != 3) return 11;
+
+    zn_bitmap_clear_all(&bitmap);
+    if (zn_bitmap_count(&bitmap) != 0) return 12;
+
+    zn_bitmap_destroy(&bitmap);
+    return 0;
+}
+
+/**
+ * @brief Test walking the set bits across words.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_next_set() {
+    struct zn_bitmap bitmap;
+    zn_bitmap_init(&bitmap, 100);
+
+    if (zn_bitmap_next_set(&bitmap, 0) != 100) return 1;
+
+    uint32_t bits[] = {3, 4, 31, 64, 99};
+    uint32_t nr = sizeof(bits) / sizeof(bits[0]);
+    for (uint32_t i = 0; i < nr; i++) {
+        zn_bitmap_set(&bitmap, bits[i]);
+    }
+
+    uint32_t found = 0;
+    for (uint32_t b = zn_bitmap_next_set(&bitmap, 0); b < 100; b = zn_bitmap_next_set(&bitmap, b + 1)) {
+        if (found >= nr || b != bits[found]) return 2;
+        found++;
+    }
+    if (found != nr) return 3;
+
+    // Bits before the start in the same word are skipped
+    if (zn_bitmap_next_set(&bitmap, 5) != 31) return 4;
+    if (zn_bitmap_next_set(&bitmap, 65) != 99) return 5;
+    if (zn_bitmap_next_set(&bitmap, 100) != 100) return 6;
+
+    zn_bitmap_destroy(&bitmap);
+    return 0;
+}
+
+int main() {
+    int failures = 0;
+
+    if (test_set_clear_count() != 0) {
+        printf("Test FAILED: test_set_clear_count()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_set_clear_count()\n");
+    }
+
+    if (test_next_set() != 0) {
+        printf("Test FAILED: test_next_set()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_next_set()\n");
+    }
+
+    return failures;
+}
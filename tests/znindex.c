@@ -0,0 +1,198 @@
+#include <stdio.h>
+
+#include "znindex.h"
+
+/**
+ * @brief Test inserting, updating and looking up entries.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_insert_lookup() {
+    struct zn_index index;
+    zn_index_init(&index, 16);
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+
+    if (zn_index_lookup(&index, 7, &entry, &slot)) return 1;
+
+    zn_index_insert(&index, 7, ZN_INDEX_PENDING, 0, 0);
+    if (!zn_index_lookup(&index, 7, &entry, &slot)) return 2;
+    if (zn_index_entry_state(&entry) != ZN_INDEX_PENDING) return 3;
+
+    zn_index_update(&index, 7, ZN_INDEX_LOC, 3, 9);
+    if (!zn_index_lookup(&index, 7, &entry, &slot)) return 4;
+    if (zn_index_entry_state(&entry) != ZN_INDEX_LOC || entry.zone != 3 || entry.chunk_offset != 9) return 5;
+    if (entry.id != 7) return 6;
+
+    zn_index_destroy(&index);
+    return 0;
+}
+
+/**
+ * @brief Test that removals keep every other entry reachable, with many colliding probe sequences.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_remove_shift() {
+    struct zn_index index;
+    zn_index_init(&index, 32); // 64 slots, so clusters form
+
+    uint32_t nr = 60;
+    for (uint32_t id = 0; id < nr; id++) {
+        zn_index_insert(&index, id, ZN_INDEX_LOC, id, id * 2);
+    }
+
+    // Remove every third entry
+    for (uint32_t id = 0; id < nr; id += 3) {
+        if (!zn_index_remove(&index, id)) return 1;
+    }
+    if (zn_index_remove(&index, 0)) return 2;
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+    for (uint32_t id = 0; id < nr; id++) {
+        bool found = zn_index_lookup(&index, id, &entry, &slot);
+        if (id % 3 == 0) {
+            if (found) return 3;
+        } else {
+            if (!found) return 4;
+            if (entry.zone != id || entry.chunk_offset != id * 2) return 5;
+        }
+    }
+
+    if (index.count != nr - (nr + 2) / 3) return 6;
+
+    zn_index_destroy(&index);
+    return 0;
+}
+
+/**
+ * @brief Test that inserts into a full index fail instead of probing forever.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_full() {
+    struct zn_index index;
+    zn_index_init(&index, 32); // 64 slots, 60 of them can be used
+
+    for (uint32_t id = 0; id < 60; id++) {
+        if (zn_index_insert(&index, id, ZN_INDEX_LOC, id, 0) != 0) return 1;
+    }
+    if (zn_index_insert(&index, 60, ZN_INDEX_LOC, 60, 0) == 0) return 2;
+    if (index.count != 60) return 3;
+
+    // A removal makes room again
+    if (!zn_index_remove(&index, 0)) return 4;
+    if (zn_index_insert(&index, 60, ZN_INDEX_LOC, 60, 0) != 0) return 5;
+
+    struct zn_index_entry entry;
+    uint64_t slot;
+    for (uint32_t id = 1; id <= 60; id++) {
+        if (!zn_index_lookup(&index, id, &entry, &slot) || entry.zone != id) return 6;
+    }
+
+    zn_index_destroy(&index);
+    return 0;
+}
+
+#define STABLE_IDS 200
+#define CHURN_ROUNDS 2000
+
+struct reader_args {
+    struct zn_index *index;
+    gint *stop;
+    int failures;
+};
+
+static gpointer
+reader_thread(gpointer data) {
+    struct reader_args *args = data;
+    struct zn_index_entry entry;
+    uint64_t slot;
+
+    while (!g_atomic_int_get(args->stop)) {
+        for (uint32_t id = 0; id < STABLE_IDS; id++) {
+            if (!zn_index_lookup(args->index, id, &entry, &slot) || entry.zone != id ||
+                entry.chunk_offset != id + 1) {
+                args->failures++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Test that lock-free lookups always find stable entries while a writer inserts and removes others.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_concurrent_lookup() {
+    struct zn_index index;
+    zn_index_init(&index, 512);
+
+    for (uint32_t id = 0; id < STABLE_IDS; id++) {
+        zn_index_insert(&index, id, ZN_INDEX_LOC, id, id + 1);
+    }
+
+    gint stop = 0;
+    struct reader_args args[4];
+    GThread *threads[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = (struct reader_args) {.index = &index, .stop = &stop, .failures = 0};
+        threads[i] = g_thread_new("reader", reader_thread, &args[i]);
+    }
+
+    // The churned IDs share clusters with the stable ones, so removals shift stable entries
+    for (uint32_t round = 0; round < CHURN_ROUNDS; round++) {
+        for (uint32_t id = STABLE_IDS; id < 2 * STABLE_IDS; id++) {
+            zn_index_insert(&index, id, ZN_INDEX_PENDING, 0, 0);
+        }
+        for (uint32_t id = STABLE_IDS; id < 2 * STABLE_IDS; id++) {
+            zn_index_remove(&index, id);
+        }
+    }
+
+    g_atomic_int_set(&stop, 1);
+    int failures = 0;
+    for (int i = 0; i < 4; i++) {
+        g_thread_join(threads[i]);
+        failures += args[i].failures;
+    }
+
+    zn_index_destroy(&index);
+    return failures;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_insert_lookup() != 0) {
+        printf("Test FAILED: test_insert_lookup()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_insert_lookup()\n");
+    }
+
+    if (test_remove_shift() != 0) {
+        printf("Test FAILED: test_remove_shift()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_remove_shift()\n");
+    }
+
+    if (test_full() != 0) {
+        printf("Test FAILED: test_full()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_full()\n");
+    }
+
+    if (test_concurrent_lookup() != 0) {
+        printf("Test FAILED: test_concurrent_lookup()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_concurrent_lookup()\n");
+    }
+
+    return failures;
+}
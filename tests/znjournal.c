@@ -0,0 +1,132 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "znjournal.h"
+
+#define CHUNK_SZ 4096
+#define ZONE_CAP (CHUNK_SZ * 8)
+#define NR_ZONES 4
+
+struct replayed {
+    struct zn_journal_record records[16];
+    uint32_t nr;
+};
+
+static void
+collect(const struct zn_journal_record *record, void *user_data) {
+    struct replayed *r = user_data;
+    if (r->nr < 16) {
+        r->records[r->nr] = *record;
+    }
+    r->nr++;
+}
+
+static void
+fill_one(struct zn_journal *journal, void *user_data) {
+    (void) user_data;
+    struct zn_pair location = {.zone = 1, .chunk_offset = 2, .id = 7};
+    zn_journal_put_locked(journal, ZN_JOURNAL_INSERT, 7, location, 0);
+}
+
+/**
+ * @brief Test that chunk headers detect a changed field.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_chunk_header() {
+    struct zn_chunk_header header;
+    zn_chunk_header_init(&header, 42, CHUNK_SZ, 9);
+    if (!zn_chunk_header_valid(&header)) return 1;
+
+    header.generation++;
+    if (zn_chunk_header_valid(&header)) return 2;
+
+    return 0;
+}
+
+/**
+ * @brief Test that a compacted journal and its appends replay in order.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_replay(const char *path) {
+    struct zn_journal journal;
+    zn_journal_init(&journal);
+    if (zn_journal_matches(path, CHUNK_SZ, ZONE_CAP, NR_ZONES)) return 1; // Doesn't exist yet
+
+    if (zn_journal_compact(&journal, path, CHUNK_SZ, ZONE_CAP, NR_ZONES, fill_one, NULL) != 0)
+        return 2;
+    struct zn_pair location = {.zone = 3, .chunk_offset = 0, .id = 8};
+    zn_journal_append(&journal, ZN_JOURNAL_INSERT, 8, location, 5);
+    zn_journal_append(&journal, ZN_JOURNAL_CLEAR_CHUNK, 8, location, 0);
+    zn_journal_destroy(&journal);
+
+    if (!zn_journal_matches(path, CHUNK_SZ, ZONE_CAP, NR_ZONES)) return 3;
+    if (zn_journal_matches(path, CHUNK_SZ * 2, ZONE_CAP, NR_ZONES)) return 4;
+
+    struct replayed r = {.nr = 0};
+    uint64_t generation = 0;
+    bool torn = true;
+    if (zn_journal_replay(path, collect, &r, &generation, &torn) != 3 || r.nr != 3) return 5;
+    if (torn) return 10;
+    if (!zn_journal_intact(path, CHUNK_SZ, ZONE_CAP, NR_ZONES)) return 11;
+    if (r.records[0].op != ZN_JOURNAL_INSERT || r.records[0].id != 7 ||
+        r.records[0].zone != 1 || r.records[0].chunk_offset != 2) return 6;
+    if (r.records[1].op != ZN_JOURNAL_INSERT || r.records[1].generation != 5) return 7;
+    if (r.records[2].op != ZN_JOURNAL_CLEAR_CHUNK) return 8;
+    // Newer than every chunk in the journal
+    if (generation <= 5) return 9;
+
+    return 0;
+}
+
+/**
+ * @brief Test that a torn record ends the replay.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_torn_tail(const char *path) {
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0) return 1;
+    unsigned char garbage[sizeof(struct zn_journal_record)] = {1, 2, 3};
+    if (write(fd, garbage, sizeof(garbage)) != (ssize_t) sizeof(garbage)) return 2;
+    close(fd);
+
+    struct replayed r = {.nr = 0};
+    uint64_t generation = 0;
+    bool torn = false;
+    if (zn_journal_replay(path, collect, &r, &generation, &torn) != 3 || r.nr != 3) return 3;
+    if (!torn) return 4;
+    if (zn_journal_intact(path, CHUNK_SZ, ZONE_CAP, NR_ZONES)) return 5;
+
+    return 0;
+}
+
+int main() {
+    int failures = 0;
+    const char *path = "znjournal-test.jnl";
+    unlink(path);
+
+    if (test_chunk_header() != 0) {
+        printf("Test FAILED: test_chunk_header()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_chunk_header()\n");
+    }
+
+    if (test_replay(path) != 0) {
+        printf("Test FAILED: test_replay()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_replay()\n");
+    }
+
+    if (test_torn_tail(path) != 0) {
+        printf("Test FAILED: test_torn_tail()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_torn_tail()\n");
+    }
+
+    unlink(path);
+    return failures;
+}